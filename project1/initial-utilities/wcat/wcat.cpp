@@ -7,7 +7,7 @@
 #include <sys/uio.h>
 #include <unistd.h>
 
-int main(int argc, char *argv[]) {
+int wcat(int argc, char *argv[]) {
   if (argc > 1) {
     int file_descriptor;
     for (int i = 1; i < argc; i++) {
@@ -24,6 +24,8 @@ int main(int argc, char *argv[]) {
         int bytes_written = write(STDOUT_FILENO, r_buf, read_bytes);
         if (bytes_written != read_bytes) {
           write(STDOUT_FILENO, "wcat: invalid write operation\n", 30);
+          if (file_descriptor != STDIN_FILENO)
+            close(file_descriptor);
           return 1;
         }
       }
@@ -39,3 +41,9 @@ int main(int argc, char *argv[]) {
 
   return 0;
 }
+
+#ifndef WISH_INPROC_UTILS
+// Built standalone; wish links wcat() directly when built with
+// -DWISH_INPROC_UTILS
+int main(int argc, char *argv[]) { return wcat(argc, argv); }
+#endif
@@ -41,6 +41,8 @@ int grep(int file_descriptor, char *search_str) {
           int write_res = write(STDOUT_FILENO, line.c_str(), line.length());
           if (write_res == -1) {
             write(STDOUT_FILENO, "wgrep: invalid write operation\n", 31);
+            if (file_descriptor != STDIN_FILENO)
+              close(file_descriptor);
             return 1;
           }
         }
@@ -66,8 +68,8 @@ int grep(int file_descriptor, char *search_str) {
     return 1;
   }
 
-  // Handle if last line doesn't end in \n
-  if (r_buf[read_bytes - 1] != '\n' && search_i == search_str_len) {
+  // Handle if last line doesn't end in \n (line is cleared at each \n)
+  if (!line.empty() && search_i == search_str_len) {
     int write_res = write(STDOUT_FILENO, line.c_str(), line.length());
     if (write_res == -1) {
       write(STDOUT_FILENO, "wgrep: invalid write operation\n", 31);
@@ -78,7 +80,7 @@ int grep(int file_descriptor, char *search_str) {
   return 0;
 }
 
-int main(int argc, char *argv[]) {
+int wgrep(int argc, char *argv[]) {
   if (argc == 1) {
     // No args
     write(STDOUT_FILENO, "wgrep: searchterm [file ...]\n", 29);
@@ -108,3 +110,9 @@ int main(int argc, char *argv[]) {
 
   return 0;
 }
+
+#ifndef WISH_INPROC_UTILS
+// Built standalone; wish links wgrep() directly when built with
+// -DWISH_INPROC_UTILS
+int main(int argc, char *argv[]) { return wgrep(argc, argv); }
+#endif
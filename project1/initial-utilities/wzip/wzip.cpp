@@ -11,7 +11,7 @@
 #include <sys/uio.h>
 #include <unistd.h>
 
-int main(int argc, char *argv[]) {
+int wzip(int argc, char *argv[]) {
   if (argc == 1) {
     // No args
     write(STDOUT_FILENO, "wzip: file1 [file2 ...]\n", 24);
@@ -75,3 +75,9 @@ int main(int argc, char *argv[]) {
 
   return 0;
 }
+
+#ifndef WISH_INPROC_UTILS
+// Built standalone; wish links wzip() directly when built with
+// -DWISH_INPROC_UTILS
+int main(int argc, char *argv[]) { return wzip(argc, argv); }
+#endif
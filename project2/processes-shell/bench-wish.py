@@ -0,0 +1,200 @@
+#! /usr/bin/env python3
+
+"""Launch and streaming benchmarks for wish.
+
+Generates batch scripts with many short commands, wide & groups and large
+redirected streams, runs them under each launch backend and prints one
+JSON document with the results, so runs before and after a change to the
+shell can be diffed or compared by a script:
+
+  prompt> ./bench-wish.py > before.json
+  prompt> ./bench-wish.py --backend fork --backend zygote:4 --commands 5000
+
+wish does not implement | pipelines, so stream throughput is measured by
+pushing a large file through `cat file > out`.
+
+The inproc backend runs `wcat small-file` where the others run `true`, as
+only the w-prefixed utilities run in-process. It needs wish built with
+-DWISH_INPROC_UTILS and is refused otherwise, rather than timing fork+exec
+under its name.
+"""
+
+import argparse
+import json
+import os
+import re
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+REAL_RE = re.compile(r'^real ([0-9.]+)s ')
+SMALL_TEXT = 'a line for wcat\n'
+
+
+def percentile(samples, pct):
+    ordered = sorted(samples)
+    if not ordered:
+        raise ValueError('percentile of no samples')
+    idx = min(len(ordered) - 1, int(round(pct / 100.0 * (len(ordered) - 1))))
+    return ordered[idx]
+
+
+def backend_args(backend):
+    # "fork", "zygote:N" or "inproc" -> (extra wish args, extra environment)
+    if backend == 'fork':
+        return [], {}
+    if backend.startswith('zygote'):
+        count = backend.partition(':')[2] or '1'
+        return ['--zygote', count], {}
+    if backend == 'inproc':
+        return [], {'WISH_INPROC': '1'}
+    raise ValueError('unknown backend ' + backend)
+
+
+def run_wish(wish, backend, script):
+    args, env = backend_args(backend)
+    full_env = dict(os.environ)
+    full_env.update(env)
+    start = time.monotonic()
+    proc = subprocess.run([wish] + args + [script], env=full_env,
+                          stdout=subprocess.DEVNULL, stderr=subprocess.PIPE,
+                          universal_newlines=True)
+    elapsed = time.monotonic() - start
+    if proc.returncode != 0:
+        raise RuntimeError('wish exited with %d: %s' %
+                           (proc.returncode, proc.stderr[-500:]))
+    return elapsed, proc.stderr
+
+
+def write_script(workdir, name, lines):
+    path = os.path.join(workdir, name)
+    with open(path, 'w') as f:
+        f.write('path /bin /usr/bin\n')
+        for line in lines:
+            f.write(line + '\n')
+    return path
+
+
+def short_command(workdir, backend):
+    # The cheapest command the backend runs its own way
+    if backend == 'inproc':
+        return 'wcat ' + os.path.join(workdir, 'small.txt')
+    return 'true'
+
+
+def check_inproc(opts, workdir):
+    # builtin fails unless the kernels were linked into wish
+    line = 'builtin ' + short_command(workdir, 'inproc')
+    script = write_script(workdir, 'probe.sh', [line])
+    proc = subprocess.run([opts.wish, script], stdout=subprocess.PIPE,
+                          stderr=subprocess.PIPE, universal_newlines=True)
+    if proc.stdout != SMALL_TEXT or proc.stderr:
+        sys.exit('inproc needs wish built with -DWISH_INPROC_UTILS')
+
+
+def bench_sequential(opts, workdir, backend):
+    # Thousands of short commands, one per line
+    script = write_script(workdir, 'sequential.sh',
+                          [short_command(workdir, backend)] * opts.commands)
+    best = min(run_wish(opts.wish, backend, script)[0]
+               for _ in range(opts.repeat))
+    return {'commands': opts.commands, 'seconds': best,
+            'commands_per_sec': opts.commands / best}
+
+
+def bench_wide(opts, workdir, backend):
+    # Lines of `true & true & ...`, all forked before the line waits
+    groups = max(1, opts.commands // opts.width)
+    line = ' & '.join([short_command(workdir, backend)] * opts.width)
+    script = write_script(workdir, 'wide.sh', [line] * groups)
+    best = min(run_wish(opts.wish, backend, script)[0]
+               for _ in range(opts.repeat))
+    total = groups * opts.width
+    return {'commands': total, 'width': opts.width, 'seconds': best,
+            'commands_per_sec': total / best}
+
+
+def bench_latency(opts, workdir, backend):
+    # Per-command wall time from the time prefix (fork until reap)
+    script = write_script(workdir, 'latency.sh',
+                          ['time ' + short_command(workdir, backend)] *
+                          opts.commands)
+    samples = []
+    for _ in range(opts.repeat):
+        _, err = run_wish(opts.wish, backend, script)
+        for line in err.splitlines():
+            match = REAL_RE.match(line)
+            if match:
+                samples.append(float(match.group(1)))
+    if not samples:
+        raise RuntimeError('no timings in the output of time')
+    return {'samples': len(samples),
+            'p50_ms': percentile(samples, 50) * 1e3,
+            'p99_ms': percentile(samples, 99) * 1e3,
+            'mean_ms': statistics.mean(samples) * 1e3}
+
+
+def bench_stream(opts, workdir, backend):
+    # Large file pushed through a redirected cat
+    data = os.path.join(workdir, 'stream.in')
+    if not os.path.exists(data):
+        chunk = os.urandom(1 << 20)
+        with open(data, 'wb') as f:
+            for _ in range(opts.mb):
+                f.write(chunk)
+    out = os.path.join(workdir, 'stream.out')
+    util = 'wcat' if backend == 'inproc' else 'cat'
+    script = write_script(workdir, 'stream.sh',
+                          ['%s %s > %s' % (util, data, out)])
+    best = min(run_wish(opts.wish, backend, script)[0]
+               for _ in range(opts.repeat))
+    if os.path.getsize(out) != opts.mb << 20:
+        raise RuntimeError('stream output was truncated')
+    return {'megabytes': opts.mb, 'seconds': best, 'mb_per_sec': opts.mb / best}
+
+
+def main():
+    # keeps the docstring's line breaks and example commands
+    parser = argparse.ArgumentParser(
+        description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--wish', default='./wish')
+    parser.add_argument('--backend', action='append',
+                        help='fork, zygote:N or inproc (repeatable)')
+    parser.add_argument('--commands', type=int, default=2000)
+    parser.add_argument('--width', type=int, default=32)
+    parser.add_argument('--mb', type=int, default=64)
+    parser.add_argument('--repeat', type=int, default=3)
+    opts = parser.parse_args()
+
+    if not os.access(opts.wish, os.X_OK):
+        sys.exit('wish executable does not exist: ' + opts.wish)
+    backends = opts.backend or ['fork', 'zygote:1', 'zygote:4']
+
+    workdir = tempfile.mkdtemp(prefix='wish-bench-')
+    results = {'wish': os.path.abspath(opts.wish), 'backends': {}}
+    try:
+        with open(os.path.join(workdir, 'small.txt'), 'w') as f:
+            f.write(SMALL_TEXT)
+        if 'inproc' in backends:
+            check_inproc(opts, workdir)
+        for backend in backends:
+            print('running ' + backend, file=sys.stderr)
+            results['backends'][backend] = {
+                'sequential': bench_sequential(opts, workdir, backend),
+                'wide': bench_wide(opts, workdir, backend),
+                'latency': bench_latency(opts, workdir, backend),
+                'stream': bench_stream(opts, workdir, backend),
+            }
+    finally:
+        shutil.rmtree(workdir)
+
+    json.dump(results, sys.stdout, indent=2, sort_keys=True)
+    print()
+
+
+if __name__ == '__main__':
+    main()
@@ -1,19 +1,100 @@
+#include <algorithm>
+#include <cerrno>
 #include <cstring>
-#include <fstream>
+#include <deque>
 #include <iostream>
+#include <map>
 #include <memory>
 #include <set>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdlib.h>
 
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef WISH_INPROC_UTILS
+// Kernels of the project 1 utilities, linked in for in-process use by
+// compiling wish.cpp together with wcat.cpp, wgrep.cpp and wzip.cpp from
+// project1/initial-utilities, all with -DWISH_INPROC_UTILS
+int wcat(int argc, char *argv[]);
+int wgrep(int argc, char *argv[]);
+int wzip(int argc, char *argv[]);
+#endif
+
+typedef int (*util_kernel)(int argc, char *argv[]);
+
+util_kernel find_util_kernel(const char *name, bool plain_names) {
+  /*
+   * Looks up an in-process implementation of a utility
+   *
+   * Args:
+   *   name: utility name, wcat, wgrep or wzip
+   *   plain_names: also take cat, grep and zip for them, which are not
+   *                the system tools and only do for an explicit `builtin`
+   *
+   * Returns:
+   *   kernel function, or nullptr if none is linked in
+   */
+#ifdef WISH_INPROC_UTILS
+  if (plain_names && name[0] != 'w') {
+    std::string w_name = std::string("w") + name;
+    return find_util_kernel(w_name.c_str(), false);
+  } else if (strcmp(name, "wcat") == 0) {
+    return wcat;
+  } else if (strcmp(name, "wgrep") == 0) {
+    return wgrep;
+  } else if (strcmp(name, "wzip") == 0) {
+    return wzip;
+  }
+#endif
+  (void)name;
+  (void)plain_names;
+  return nullptr;
+}
+
+// Self-pipe written by the SIGCHLD handler so the shell knows to reap jobs
+int sigchld_pipe[2] = {-1, -1};
+
+void on_sigchld(int) {
+  int saved_errno = errno;
+  ssize_t ret = write(sigchld_pipe[1], "c", 1);
+  (void)ret;
+  errno = saved_errno;
+}
+
+void install_sigchld_pipe() {
+  // Creates a fresh self-pipe and points SIGCHLD at it
+  if (sigchld_pipe[0] != -1) {
+    close(sigchld_pipe[0]);
+    close(sigchld_pipe[1]);
+    sigchld_pipe[0] = sigchld_pipe[1] = -1;
+  }
+  if (pipe2(sigchld_pipe, O_NONBLOCK | O_CLOEXEC) == 0) {
+    struct sigaction sa;
+    std::memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sigchld;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, nullptr);
+  }
+}
+
 class Command {
   /*
    * Data structure for command and metadata
@@ -23,6 +104,7 @@ private:
   std::vector<char *> args = {};
   std::vector<std::unique_ptr<char[]>> arg_mem = {};
   bool parallel = false;
+  bool timed = false;
   std::string redir_in_file = "";
   std::string redir_out_file = "";
 
@@ -44,6 +126,10 @@ public:
 
   void set_parallel() { parallel = true; }
 
+  const bool &get_timed() { return timed; }
+
+  void set_timed() { timed = true; }
+
   const std::string &get_in_file() { return redir_in_file; }
 
   void set_in_file(const std::string &in_f) { redir_in_file = in_f; }
@@ -64,7 +150,7 @@ private:
 public:
   Tokenizer() {}
 
-  std::vector<std::string> tokenize(const std::string &line) {
+  std::vector<std::string> tokenize(std::string_view line) {
     /*
      * Tokenizes a line of input. Will check for incorrect sequences of tokens.
      *
@@ -199,6 +285,438 @@ public:
   }
 };
 
+class BatchReader {
+  /*
+   * Reads a batch script one line at a time without copying lines. Regular
+   * files are mapped into memory; anything else (pipes, fifos, ttys) is
+   * streamed through a large buffer.
+   */
+
+private:
+  static constexpr size_t stream_chunk = 1 << 20;
+
+  int fd = -1;
+  char *map = nullptr;
+  size_t map_len = 0;
+  std::vector<char> buf = {};
+  size_t buf_len = 0;
+  bool stream_eof = false;
+
+  // Start of the next line to hand out
+  size_t scan = 0;
+
+  const char *data() const { return map != nullptr ? map : buf.data(); }
+
+  size_t size() const { return map != nullptr ? map_len : buf_len; }
+
+  bool fill() {
+    /*
+     * Reads more of a streamed script into the buffer. Lines already handed
+     * out are discarded and the buffer grows if a single line does not fit.
+     *
+     * Returns:
+     *   true if more bytes were read, false at end of input or on error
+     */
+    if (map != nullptr || stream_eof) {
+      return false;
+    }
+
+    if (scan > 0) {
+      std::memmove(buf.data(), buf.data() + scan, buf_len - scan);
+      buf_len -= scan;
+      scan = 0;
+    }
+    if (buf.size() - buf_len < stream_chunk / 2) {
+      buf.resize(buf.size() + stream_chunk);
+    }
+
+    ssize_t got;
+    do {
+      got = read(fd, buf.data() + buf_len, buf.size() - buf_len);
+    } while (got == -1 && errno == EINTR);
+    if (got <= 0) {
+      stream_eof = true;
+      return false;
+    }
+    buf_len += got;
+    return true;
+  }
+
+  bool find_line(size_t &off, size_t &len) {
+    /*
+     * Finds the line starting at the scan position, with the same rules as
+     * std::getline: the newline is dropped and a last line without one still
+     * counts.
+     *
+     * Returns:
+     *   true if a line was found, false at end of input
+     */
+    size_t searched = scan;
+    while (true) {
+      const char *nl = static_cast<const char *>(
+          std::memchr(data() + searched, '\n', size() - searched));
+      if (nl != nullptr) {
+        off = scan;
+        len = nl - (data() + scan);
+        scan += len + 1;
+        return true;
+      }
+      searched = size() - scan;
+      if (!fill()) {
+        break;
+      }
+      searched += scan;
+    }
+
+    if (scan < size()) {
+      // Final line without a trailing newline
+      off = scan;
+      len = size() - scan;
+      scan = size();
+      return true;
+    }
+    return false;
+  }
+
+public:
+  BatchReader() {}
+
+  BatchReader(const BatchReader &) = delete;
+  BatchReader &operator=(const BatchReader &) = delete;
+
+  ~BatchReader() {
+    if (map != nullptr) {
+      munmap(map, map_len);
+    }
+    if (fd > STDERR_FILENO) {
+      close(fd);
+    }
+  }
+
+  bool open(const char *file) {
+    /*
+     * Opens a batch script for reading
+     *
+     * Args:
+     *   file: path to the script
+     *
+     * Returns:
+     *   true on success, false if the script could not be opened
+     */
+    fd = ::open(file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+      return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+      void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p != MAP_FAILED) {
+        madvise(p, st.st_size, MADV_SEQUENTIAL);
+        map = static_cast<char *>(p);
+        map_len = st.st_size;
+        return true;
+      }
+    }
+    // Fall back to streaming for pipes and anything that cannot be mapped
+    buf.resize(stream_chunk);
+    return true;
+  }
+
+  bool next(std::string_view &line) {
+    /*
+     * Advances to the next line. The returned view stays valid until the
+     * following call to next().
+     *
+     * Args:
+     *   line: set to the next line on success
+     *
+     * Returns:
+     *   true if a line was read, false at end of input
+     */
+    size_t off;
+    size_t len;
+    if (!find_line(off, len)) {
+      return false;
+    }
+    line = std::string_view(data() + off, len);
+    return true;
+  }
+};
+
+class Zygote {
+  /*
+   * Small pre-forked helper that launches commands for the shell. It is
+   * forked before the shell's address space grows, so the cost of its own
+   * forks stays flat. Children are started with CLONE_PARENT, which makes
+   * them children of the shell, so they are waited on like any other child.
+   * Requests come over a SOCK_SEQPACKET socket as "path\0arg0\0arg1\0...",
+   * with the child's cwd, stdin, stdout and stderr attached as SCM_RIGHTS
+   * fds, and for timed commands the write end of a pipe that closes when
+   * the child's exec does. Each request is answered with the child's pid,
+   * in order.
+   */
+
+private:
+  static constexpr size_t max_request = 1 << 18;
+  static constexpr int request_fds = 4;
+  // The optional exec pipe after them
+  static constexpr int max_fds = request_fds + 1;
+
+  int sock = -1;
+  pid_t pid = -1;
+
+  [[noreturn]] static void serve(int sock) {
+    // Request loop run inside the zygote process
+    std::vector<char> request(max_request);
+    while (true) {
+      union {
+        char buf[CMSG_SPACE(sizeof(int) * max_fds)];
+        struct cmsghdr align;
+      } control;
+      struct iovec iov = {request.data(), request.size() - 1};
+      struct msghdr msg;
+      std::memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = control.buf;
+      msg.msg_controllen = sizeof(control.buf);
+
+      ssize_t len = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+      if (len <= 0) {
+        // The shell went away
+        _exit(0);
+      }
+      request[len] = '\0';
+
+      // Received close-on-exec, so the exec pipe closes when exec succeeds
+      int fds[max_fds] = {-1, -1, -1, -1, -1};
+      struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+      if (cmsg != nullptr && cmsg->cmsg_level == SOL_SOCKET &&
+          cmsg->cmsg_type == SCM_RIGHTS &&
+          (cmsg->cmsg_len == CMSG_LEN(sizeof(int) * request_fds) ||
+           cmsg->cmsg_len == CMSG_LEN(sizeof(int) * max_fds))) {
+        std::memcpy(fds, CMSG_DATA(cmsg), cmsg->cmsg_len - CMSG_LEN(0));
+      }
+
+      std::vector<char *> argv = {};
+      char *exec_path = request.data();
+      for (char *arg = exec_path + strlen(exec_path) + 1;
+           arg < request.data() + len; arg += strlen(arg) + 1) {
+        argv.push_back(arg);
+      }
+      argv.push_back(nullptr);
+
+      pid_t child = -1;
+      if (fds[request_fds - 1] != -1 && argv.size() > 1) {
+        child = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, 0, 0, 0);
+      }
+      if (child == 0) {
+        if (fchdir(fds[0]) == -1 || dup2(fds[1], STDIN_FILENO) == -1 ||
+            dup2(fds[2], STDOUT_FILENO) == -1 ||
+            dup2(fds[3], STDERR_FILENO) == -1) {
+          _exit(1);
+        }
+        execv(exec_path, argv.data());
+        // Unsuccessful execution
+        ssize_t ret = write(STDERR_FILENO, "An error has occurred\n", 22);
+        (void)ret;
+        _exit(1);
+      }
+
+      for (auto fd : fds) {
+        if (fd != -1) {
+          close(fd);
+        }
+      }
+      if (send(sock, &child, sizeof(child), MSG_NOSIGNAL) != sizeof(child)) {
+        _exit(0);
+      }
+    }
+  }
+
+public:
+  Zygote() {}
+
+  bool start() {
+    /*
+     * Forks the zygote process
+     *
+     * Returns:
+     *   true if the zygote is running
+     */
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+      return false;
+    }
+
+    std::cout.flush();
+    pid = fork();
+    if (pid == 0) {
+      // Children it starts are not its own, so it never sees SIGCHLD
+      signal(SIGCHLD, SIG_DFL);
+      close(sv[0]);
+      serve(sv[1]);
+    }
+    close(sv[1]);
+    if (pid == -1) {
+      close(sv[0]);
+      return false;
+    }
+    sock = sv[0];
+    return true;
+  }
+
+  void stop() {
+    // Closes our end; the zygote exits when it sees the socket close
+    if (sock != -1) {
+      close(sock);
+      sock = -1;
+    }
+  }
+
+  bool send_request(const std::string &exec_path,
+                    const std::vector<char *> &args,
+                    const int (&fds)[request_fds], int exec_fd) {
+    /*
+     * Asks the zygote to start a command. The pid is read with recv_pid.
+     *
+     * Args:
+     *   exec_path: resolved path of the executable
+     *   args: argv, terminated by nullptr
+     *   fds: cwd, stdin, stdout and stderr for the child
+     *   exec_fd: pipe the child holds until its exec completes, or -1
+     *
+     * Returns:
+     *   true if the request was sent
+     */
+    std::string request = exec_path;
+    request += '\0';
+    for (auto arg : args) {
+      if (arg == nullptr) {
+        break;
+      }
+      request += arg;
+      request += '\0';
+    }
+    if (sock == -1 || request.size() >= max_request) {
+      return false;
+    }
+
+    int all_fds[max_fds];
+    std::memcpy(all_fds, fds, sizeof(fds));
+    all_fds[request_fds] = exec_fd;
+    size_t fds_len = sizeof(int) * (exec_fd == -1 ? request_fds : max_fds);
+
+    union {
+      char buf[CMSG_SPACE(sizeof(all_fds))];
+      struct cmsghdr align;
+    } control;
+    std::memset(&control, 0, sizeof(control));
+    struct iovec iov = {request.data(), request.size()};
+    struct msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(fds_len);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(fds_len);
+    std::memcpy(CMSG_DATA(cmsg), all_fds, fds_len);
+
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) ==
+           static_cast<ssize_t>(request.size());
+  }
+
+  pid_t recv_pid() {
+    // Reads the pid for the oldest outstanding request, -1 on failure
+    pid_t child;
+    ssize_t got;
+    do {
+      got = recv(sock, &child, sizeof(child), 0);
+    } while (got == -1 && errno == EINTR);
+    return got == sizeof(child) ? child : -1;
+  }
+
+  pid_t get_pid() { return pid; }
+};
+
+double seconds_since(const struct timespec &start) {
+  // Wall-clock seconds elapsed since start
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+double timeval_seconds(const struct timeval &tv) {
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+struct ChildTiming {
+  /*
+   * Launch bookkeeping for a child that is being timed
+   */
+  std::string name = "";
+  bool report = false;
+  struct timespec start = {};
+  // Seconds from before fork, or the zygote request, until the child's exec
+  // (or exit) completed
+  double launch = 0;
+};
+
+struct CommandStats {
+  /*
+   * Totals for one command name, printed by --stats
+   */
+  size_t count = 0;
+  double total = 0;
+  double max = 0;
+  double launch = 0;
+  double run = 0;
+
+  void add(const CommandStats &other) {
+    count += other.count;
+    total += other.total;
+    max = std::max(max, other.max);
+    launch += other.launch;
+    run += other.run;
+  }
+};
+
+struct BatchLine {
+  /*
+   * One line of a batch script scheduled by the parallel executor
+   */
+  std::string text = "";
+  // Files the line reads (redirected or named as arguments) and redirects to
+  std::set<std::string> reads = {};
+  std::set<std::string> writes = {};
+  // Lines with built-ins run in the shell once everything before them is done
+  bool barrier = false;
+  pid_t pid = -1;
+  bool done = false;
+  // Captured stdout and stderr, replayed in script order
+  int out_fd = -1;
+  int err_fd = -1;
+
+  bool depends_on(const BatchLine &earlier) const {
+    // True if this line must wait for an earlier, unfinished line
+    for (auto &file : earlier.writes) {
+      if (reads.count(file) || writes.count(file)) {
+        return true;
+      }
+    }
+    for (auto &file : earlier.reads) {
+      if (writes.count(file)) {
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
 class Wish {
   /*
    * Class for Wish shell
@@ -207,12 +725,44 @@ class Wish {
 private:
   Tokenizer tokenizer = Tokenizer();
   std::vector<std::string> paths = {"/bin"};
-  std::string input = "";
+  // View of the line being run, backed by stdin_line or the batch reader
+  std::string_view input = "";
+  std::string stdin_line = "";
   // Each command is a vector of args
   // Multiple commands will be due to an ampersand
   std::vector<Command> commands = {};
   std::string error_message = "An error has occurred\n";
   std::vector<pid_t> pid_list = {};
+  // Background jobs from lines ending in &, mapped to their command text
+  std::map<pid_t, std::string> jobs = {};
+  // Most children alive at once, 0 for no limit (jobs-max or WISH_JOBS_MAX)
+  size_t jobs_max = 0;
+  // Run linked-in utilities without fork+exec (WISH_INPROC=1)
+  bool inproc_enabled = false;
+  // Timing is only collected for `time` commands or when --stats is on
+  bool stats_enabled = false;
+  std::map<pid_t, ChildTiming> timings = {};
+  std::map<std::string, CommandStats> stats = {};
+  // Runners in -j mode append their totals here for the shell to merge
+  int stats_fd = -1;
+
+  struct ZygoteLaunch {
+    // A command sent to a zygote whose pid has not been read yet
+    size_t zygote = 0;
+    bool background = false;
+    std::string text = "";
+    ChildTiming timing = {};
+    bool timed = false;
+    // Read end of the exec pipe, at EOF once the child has exec'd
+    int exec_fd = -1;
+  };
+
+  // Launch helpers from --zygote N, used round-robin
+  std::vector<Zygote> zygotes = {};
+  size_t next_zygote = 0;
+  std::vector<ZygoteLaunch> zygote_pending = {};
+  // Directory fd handed to zygote children as their cwd, reopened on cd
+  int cwd_fd = -1;
 
   int path(const std::vector<char *> &command) {
     /*
@@ -258,143 +808,767 @@ private:
       std::cerr << error_message;
       return 1;
     }
+    if (cwd_fd != -1) {
+      // Zygote children pick up the new directory on their next launch
+      close(cwd_fd);
+      cwd_fd = -1;
+    }
     return 0;
   }
 
-  int parse_command() {
+  pid_t wait_child(pid_t pid, int options) {
     /*
-     * Parses command line input
+     * waitpid() that also records timing for children being measured
      *
      * Args:
-     *   args: arguments passed along with cd invocation
+     *   pid: child to wait for, or -1 for any child
+     *   options: waitpid options
      *
      * Returns:
-     *   exit code: 0 on success, 1 on error
+     *   pid of the reaped child, 0 if none was ready, -1 on error
      */
-    std::vector<std::string> tokens = tokenizer.tokenize(input);
-    if (tokens.empty()) {
-      // Invalid line
-      std::cerr << error_message;
-      return 1;
-    } else if (tokens.size() == 1 && tokens[0] == "") {
-      // Empty line
-      return 0;
+    int child_stat;
+    struct rusage usage;
+    pid_t reaped = wait4(pid, &child_stat, options, &usage);
+    if (reaped > 0 && !timings.empty()) {
+      auto it = timings.find(reaped);
+      if (it != timings.end()) {
+        record_timing(it->second, seconds_since(it->second.start), usage);
+        timings.erase(it);
+      }
     }
-    Command cmd = Command();
-    bool redir_out = false;
-    bool redir_in = false;
+    return reaped;
+  }
 
-    for (auto token : tokens) {
-      if (token == "eof_exit") {
-        if (!cmd.get_args().empty()) {
-          // Push back last command
-          cmd.add_arg(nullptr);
-          // Need to use std::move due to the unique pointers
-          commands.push_back(std::move(cmd));
-          cmd = Command();
-        }
-        cmd.add_arg(std::string("exit"));
-        cmd.add_arg(nullptr);
-        commands.push_back(std::move(cmd));
-        return 0;
-      } else if (token == "&") {
-        // Done with command, set it to parallel since & was read
-        cmd.set_parallel();
-        cmd.add_arg(nullptr);
-        commands.push_back(std::move(cmd));
+  void record_timing(const ChildTiming &timing, double wall,
+                     const struct rusage &usage) {
+    // Reports a `time` command and adds it to the --stats totals
+    if (timing.report) {
+      char line[160];
+      snprintf(line, sizeof(line),
+               "real %.6fs user %.6fs sys %.6fs maxrss %ldKB\n", wall,
+               timeval_seconds(usage.ru_utime), timeval_seconds(usage.ru_stime),
+               usage.ru_maxrss);
+      std::cerr << line;
+    }
+    if (stats_enabled) {
+      CommandStats &entry = stats[timing.name];
+      entry.count++;
+      entry.total += wall;
+      entry.max = std::max(entry.max, wall);
+      entry.launch += timing.launch;
+      entry.run += std::max(0.0, wall - timing.launch);
+    }
+  }
 
-        // Reset for new command
-        cmd = Command();
-        redir_out = false;
-        redir_in = false;
-      } else if (token == ">") {
-        redir_out = true;
-      } else if (token == "<") {
-        // TODO: Implement redirect in
-        redir_in = true;
-        std::cerr << error_message;
-        return 1;
-      } else if (token == "|") {
-        // TODO: Implement piping
-        std::cerr << error_message;
-        return 1;
-      } else {
-        if (redir_out) {
-          // Outfile token
-          cmd.set_out_file(token);
-        } else if (redir_in) {
-          // Infile token
-          cmd.set_in_file(token);
-        } else {
-          // Argument token
-          cmd.add_arg(token);
-        }
+  void write_runner_stats() {
+    // Hands a runner's totals to the shell, one record per command name
+    for (auto &entry : stats) {
+      const CommandStats &st = entry.second;
+      char record[512];
+      int len = snprintf(record, sizeof(record), "%s\t%zu\t%a\t%a\t%a\t%a\n",
+                         entry.first.c_str(), st.count, st.total, st.max,
+                         st.launch, st.run);
+      if (len > 0 && static_cast<size_t>(len) < sizeof(record)) {
+        // O_APPEND keeps records from concurrent runners whole
+        ssize_t ret = write(stats_fd, record, len);
+        (void)ret;
       }
     }
+  }
 
-    if (!cmd.get_args().empty()) {
-      // Add last command
-      cmd.add_arg(nullptr);
-      commands.push_back(std::move(cmd));
+  void merge_runner_stats() {
+    // Folds the records written by -j runners into this shell's totals
+    off_t len = lseek(stats_fd, 0, SEEK_END);
+    std::string records(len, '\0');
+    if (len <= 0 || pread(stats_fd, records.data(), len, 0) != len) {
+      return;
     }
 
-    return 0;
+    size_t start = 0;
+    while (start < records.size()) {
+      size_t end = records.find('\n', start);
+      if (end == std::string::npos) {
+        break;
+      }
+      std::string record = records.substr(start, end - start);
+      start = end + 1;
+
+      size_t tab = record.find('\t');
+      if (tab == std::string::npos) {
+        continue;
+      }
+      CommandStats st;
+      if (sscanf(record.c_str() + tab + 1, "%zu\t%la\t%la\t%la\t%la",
+                 &st.count, &st.total, &st.max, &st.launch, &st.run) == 5) {
+        stats[record.substr(0, tab)].add(st);
+      }
+    }
+    close(stats_fd);
+    stats_fd = -1;
   }
 
-  int exec_command(Command &command) {
+  void reap_jobs() {
+    // Collects background jobs that have finished since the last SIGCHLD
+    char drain[64];
+    bool signalled = false;
+    while (read(sigchld_pipe[0], drain, sizeof(drain)) > 0) {
+      signalled = true;
+    }
+    if (!signalled) {
+      return;
+    }
+
+    for (auto it = jobs.begin(); it != jobs.end();) {
+      if (wait_child(it->first, WNOHANG) != 0) {
+        // Finished, or no longer our child
+        it = jobs.erase(it);
+      } else {
+        it++;
+      }
+    }
+  }
+
+  int list_jobs(const std::vector<char *> &command) {
     /*
-     * Searches paths for command and attempts to execute via execv
+     * Prints the background jobs that are still running
      *
      * Args:
      *   command: array of arguments with command[0] being the command name
      *
      * Returns:
-     *   return code: 0 on success, 1 on failure
+     *   exit code: 0 on success, 1 on error
      */
-    std::string exec_path = "";
-    for (auto path : paths) {
-      // Look for executable in paths
-      exec_path = path + '/' + command.get_args()[0];
-      if (access(exec_path.c_str(), X_OK) == 0) {
-        // Found executable
-        int out_fd;
-        if (!command.get_out_file().empty()) {
-          // Redirect stdout to out file
-          out_fd = creat(command.get_out_file().c_str(),
-                         S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
-          if (out_fd == -1 || dup2(out_fd, STDOUT_FILENO) == -1) {
-            // Unsuccessful in redirecting stdout
-            std::cerr << error_message;
-            return 1;
-          }
-          close(out_fd);
-        }
-        // Execute command
-        if (execv(exec_path.c_str(), command.get_args().data()) == -1) {
-          // Unsuccessful execution
-          std::cerr << error_message;
-          if (!command.get_out_file().empty()) {
-            // Close out file
-            close(STDOUT_FILENO);
-          }
-          return 1;
+    if (command.size() != 2) {
+      // jobs takes no arguments
+      std::cerr << error_message;
+      return 1;
+    }
+
+    reap_jobs();
+    for (auto &job : jobs) {
+      std::cout << "[" << job.first << "] Running " << job.second << "\n";
+    }
+    std::cout.flush();
+    return 0;
+  }
+
+  int wait_jobs(const std::vector<char *> &command) {
+    /*
+     * Waits for one background job, or all of them if no pid is given
+     *
+     * Args:
+     *   command: array of arguments with command[0] being the command name
+     *
+     * Returns:
+     *   exit code: 0 on success, 1 on error
+     */
+    if (command.size() == 2) {
+      wait_all_jobs();
+      return 0;
+    } else if (command.size() != 3) {
+      // Incorrect wait command
+      std::cerr << error_message;
+      return 1;
+    }
+
+    char *end;
+    long pid = std::strtol(command[1], &end, 10);
+    if (*end != '\0' || jobs.count(pid) == 0) {
+      // Not one of our background jobs
+      std::cerr << error_message;
+      return 1;
+    }
+    wait_child(pid, 0);
+    jobs.erase(pid);
+    return 0;
+  }
+
+  int set_jobs_max(const std::vector<char *> &command) {
+    /*
+     * Shows or sets the limit on children alive at once
+     *
+     * Args:
+     *   command: array of arguments with command[0] being the command name
+     *
+     * Returns:
+     *   exit code: 0 on success, 1 on error
+     */
+    if (command.size() == 2) {
+      std::cout << jobs_max << std::endl;
+      return 0;
+    }
+
+    if (command.size() != 3 || !parse_jobs_max(command[1])) {
+      // Incorrect jobs-max command
+      std::cerr << error_message;
+      return 1;
+    }
+    return 0;
+  }
+
+  bool parse_jobs_max(const char *text) {
+    /*
+     * Sets the limit on children alive at once from its text
+     *
+     * Args:
+     *   text: a count, 0 for no limit
+     *
+     * Returns:
+     *   true if text was a count, false and the limit unchanged otherwise
+     */
+    char *end = nullptr;
+    long limit = std::strtol(text, &end, 10);
+    if (end == text || *end != '\0' || limit < 0) {
+      return false;
+    }
+    jobs_max = limit;
+    return true;
+  }
+
+  bool is_inproc(Command &command) {
+    /*
+     * Checks whether a command runs as an in-process utility. `builtin cmd`
+     * always does; with WISH_INPROC=1 wcat, wgrep and wzip do too, unless
+     * they are given options the kernels do not understand. cat, grep and
+     * zip stay the system tools, which the kernels do not behave like.
+     */
+    const std::vector<char *> &args = command.get_args();
+    if (strcmp(args[0], "builtin") == 0) {
+      return true;
+    } else if (!inproc_enabled || find_util_kernel(args[0], false) == nullptr) {
+      return false;
+    }
+    for (size_t idx = 1; idx < args.size() && args[idx] != nullptr; idx++) {
+      if (args[idx][0] == '-') {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  int run_inproc(Command &command) {
+    /*
+     * Runs a linked-in utility in the shell process. Output redirection is
+     * done by swapping stdout with dup2 around the call.
+     *
+     * Args:
+     *   command: in-process utility command
+     *
+     * Returns:
+     *   exit code of the utility, 1 on error
+     */
+    std::vector<char *> args = command.get_args();
+    if (strcmp(args[0], "builtin") == 0) {
+      args.erase(args.begin());
+    }
+    util_kernel kernel =
+        args[0] == nullptr ? nullptr : find_util_kernel(args[0], true);
+    if (kernel == nullptr) {
+      // Unknown utility or not built with WISH_INPROC_UTILS
+      std::cerr << error_message;
+      return 1;
+    }
+
+    int saved_stdout = -1;
+    if (!command.get_out_file().empty()) {
+      std::cout.flush();
+      int out_fd = open(command.get_out_file().c_str(),
+                        O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                        S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+      saved_stdout = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+      if (out_fd == -1 || saved_stdout == -1 ||
+          dup2(out_fd, STDOUT_FILENO) == -1) {
+        // Unsuccessful in redirecting stdout
+        std::cerr << error_message;
+        if (out_fd != -1) {
+          close(out_fd);
         }
-        if (!command.get_out_file().empty()) {
-          // Close out file
-          close(STDOUT_FILENO);
+        if (saved_stdout != -1) {
+          close(saved_stdout);
         }
+        return 1;
+      }
+      close(out_fd);
+    }
+
+    // The kernels only use read/write on raw fds, so nothing to flush
+    int ret = kernel(args.size() - 1, args.data());
+
+    if (saved_stdout != -1) {
+      dup2(saved_stdout, STDOUT_FILENO);
+      close(saved_stdout);
+    }
+    return ret;
+  }
+
+  bool is_builtin(Command &command) {
+    const char *name = command.get_args()[0];
+    return strcmp(name, "exit") == 0 || strcmp(name, "cd") == 0 ||
+           strcmp(name, "path") == 0 || strcmp(name, "jobs") == 0 ||
+           strcmp(name, "wait") == 0 || strcmp(name, "jobs-max") == 0;
+  }
+
+  int run_builtin(Command &command) {
+    /*
+     * Runs a built-in command in the current process, timing it if asked
+     *
+     * Args:
+     *   command: command whose name is a built-in
+     *
+     * Returns:
+     *   exit code: 0 on success, 1 on error
+     */
+    if (!stats_enabled && !command.get_timed()) {
+      return dispatch_builtin(command);
+    }
+
+    ChildTiming timing;
+    timing.name = command.get_args()[0];
+    timing.report = command.get_timed();
+    struct rusage before, after;
+    getrusage(RUSAGE_SELF, &before);
+    clock_gettime(CLOCK_MONOTONIC, &timing.start);
+    int ret = dispatch_builtin(command);
+    double wall = seconds_since(timing.start);
+    getrusage(RUSAGE_SELF, &after);
+
+    // Built-ins do not fork, so report the shell's own usage for the call
+    timersub(&after.ru_utime, &before.ru_utime, &after.ru_utime);
+    timersub(&after.ru_stime, &before.ru_stime, &after.ru_stime);
+    record_timing(timing, wall, after);
+    return ret;
+  }
+
+  int dispatch_builtin(Command &command) {
+    if (is_inproc(command)) {
+      return run_inproc(command);
+    }
+
+    const std::vector<char *> &args = command.get_args();
+    if (strcmp(args[0], "exit") == 0) {
+      if (args.size() != 2) {
+        std::cerr << error_message;
+        return 1;
+      }
+      finish(0);
+    } else if (strcmp(args[0], "cd") == 0) {
+      return cd(args);
+    } else if (strcmp(args[0], "path") == 0) {
+      return path(args);
+    } else if (strcmp(args[0], "jobs") == 0) {
+      return list_jobs(args);
+    } else if (strcmp(args[0], "jobs-max") == 0) {
+      return set_jobs_max(args);
+    }
+    return wait_jobs(args);
+  }
+
+  void wait_all_jobs() {
+    // Blocks until every background job has finished
+    for (auto &job : jobs) {
+      wait_child(job.first, 0);
+    }
+    jobs.clear();
+  }
+
+  [[noreturn]] void finish(int code) {
+    // Waits for outstanding background jobs, then exits the shell
+    wait_all_jobs();
+    print_stats();
+    exit(code);
+  }
+
+  std::string command_text(Command &command) {
+    // Rebuilds a printable command line for the jobs listing
+    std::string text = "";
+    for (auto arg : command.get_args()) {
+      if (arg == nullptr) {
+        break;
+      }
+      if (!text.empty()) {
+        text += ' ';
+      }
+      text += arg;
+    }
+    if (!command.get_out_file().empty()) {
+      text += " > " + command.get_out_file();
+    }
+    return text;
+  }
+
+  int parse_command() {
+    /*
+     * Parses command line input
+     *
+     * Args:
+     *   args: arguments passed along with cd invocation
+     *
+     * Returns:
+     *   exit code: 0 on success, 1 on error
+     */
+    std::vector<std::string> tokens = tokenizer.tokenize(input);
+    if (tokens.empty()) {
+      // Invalid line
+      std::cerr << error_message;
+      return 1;
+    } else if (tokens.size() == 1 && tokens[0] == "") {
+      // Empty line
+      return 0;
+    }
+    Command cmd = Command();
+    bool redir_out = false;
+    bool redir_in = false;
+
+    for (auto token : tokens) {
+      if (token == "eof_exit") {
+        if (!cmd.get_args().empty() || cmd.get_timed()) {
+          // Push back last command
+          cmd.add_arg(nullptr);
+          // Need to use std::move due to the unique pointers
+          commands.push_back(std::move(cmd));
+          cmd = Command();
+        }
+        cmd.add_arg(std::string("exit"));
+        cmd.add_arg(nullptr);
+        commands.push_back(std::move(cmd));
         return 0;
+      } else if (token == "&") {
+        // Done with command, set it to parallel since & was read
+        cmd.set_parallel();
+        cmd.add_arg(nullptr);
+        commands.push_back(std::move(cmd));
+
+        // Reset for new command
+        cmd = Command();
+        redir_out = false;
+        redir_in = false;
+      } else if (token == "time" && cmd.get_args().empty() &&
+                 !cmd.get_timed() && !redir_out && !redir_in) {
+        // Prefix asking for the command to be timed
+        cmd.set_timed();
+      } else if (token == ">") {
+        redir_out = true;
+      } else if (token == "<") {
+        // TODO: Implement redirect in
+        redir_in = true;
+        std::cerr << error_message;
+        return 1;
+      } else if (token == "|") {
+        // TODO: Implement piping
+        std::cerr << error_message;
+        return 1;
+      } else {
+        if (redir_out) {
+          // Outfile token
+          cmd.set_out_file(token);
+        } else if (redir_in) {
+          // Infile token
+          cmd.set_in_file(token);
+        } else {
+          // Argument token
+          cmd.add_arg(token);
+        }
       }
     }
-    // Could not find executable in any of the paths
-    std::cerr << error_message;
-    return 1;
+
+    if (!cmd.get_args().empty() || cmd.get_timed()) {
+      // Add last command, or a bare time prefix to report as an error
+      cmd.add_arg(nullptr);
+      commands.push_back(std::move(cmd));
+    }
+
+    return 0;
+  }
+
+  std::string find_executable(Command &command) {
+    /*
+     * Searches paths for a command's executable
+     *
+     * Args:
+     *   command: array of arguments with command[0] being the command name
+     *
+     * Returns:
+     *   path to the executable, or an empty string if it was not found
+     */
+    for (auto path : paths) {
+      std::string exec_path = path + '/' + command.get_args()[0];
+      if (access(exec_path.c_str(), X_OK) == 0) {
+        return exec_path;
+      }
+    }
+    return "";
+  }
+
+  int exec_command(Command &command) {
+    /*
+     * Searches paths for command and attempts to execute via execv
+     *
+     * Args:
+     *   command: array of arguments with command[0] being the command name
+     *
+     * Returns:
+     *   return code: 0 on success, 1 on failure
+     */
+    std::string exec_path = find_executable(command);
+    if (exec_path.empty()) {
+      // Could not find executable in any of the paths
+      std::cerr << error_message;
+      return 1;
+    }
+
+    int out_fd;
+    if (!command.get_out_file().empty()) {
+      // Redirect stdout to out file
+      out_fd = creat(command.get_out_file().c_str(),
+                     S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+      if (out_fd == -1 || dup2(out_fd, STDOUT_FILENO) == -1) {
+        // Unsuccessful in redirecting stdout
+        std::cerr << error_message;
+        return 1;
+      }
+      close(out_fd);
+    }
+    // Execute command
+    if (execv(exec_path.c_str(), command.get_args().data()) == -1) {
+      // Unsuccessful execution
+      std::cerr << error_message;
+      if (!command.get_out_file().empty()) {
+        // Close out file
+        close(STDOUT_FILENO);
+      }
+      return 1;
+    }
+    if (!command.get_out_file().empty()) {
+      // Close out file
+      close(STDOUT_FILENO);
+    }
+    return 0;
+  }
+
+  bool zygote_launch(Command &command, bool background) {
+    /*
+     * Hands an external command to the next zygote. The pid is collected
+     * later by collect_zygote_launches, so an & group is fanned out across
+     * all zygotes before the shell waits on any of them.
+     *
+     * Args:
+     *   command: external command to start
+     *   background: whether the command becomes a background job
+     *
+     * Returns:
+     *   true if the command was dealt with, false to fall back to fork
+     */
+    if (zygotes.empty()) {
+      return false;
+    }
+    std::string exec_path = find_executable(command);
+    if (exec_path.empty()) {
+      // Could not find executable in any of the paths
+      std::cerr << error_message;
+      return true;
+    }
+    if (cwd_fd == -1) {
+      cwd_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    }
+
+    int out_fd = STDOUT_FILENO;
+    if (!command.get_out_file().empty()) {
+      // Redirect stdout to out file
+      out_fd = open(command.get_out_file().c_str(),
+                    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                    S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+      if (out_fd == -1) {
+        std::cerr << error_message;
+        return true;
+      }
+    }
+
+    wait_for_slot();
+    ZygoteLaunch launch;
+    launch.zygote = next_zygote;
+    launch.background = background;
+    launch.timed = stats_enabled || command.get_timed();
+    if (launch.timed) {
+      launch.timing.name = command.get_args()[0];
+      launch.timing.report = command.get_timed();
+      clock_gettime(CLOCK_MONOTONIC, &launch.timing.start);
+    }
+    if (background) {
+      launch.text = command_text(command);
+    }
+
+    // Like fork_command, the launch time runs until the child's exec
+    int exec_pipe[2] = {-1, -1};
+    if (launch.timed && pipe2(exec_pipe, O_CLOEXEC) == 0) {
+      launch.exec_fd = exec_pipe[0];
+    }
+
+    std::cout.flush();
+    int fds[4] = {cwd_fd, STDIN_FILENO, out_fd, STDERR_FILENO};
+    bool sent = cwd_fd != -1 &&
+                zygotes[next_zygote].send_request(
+                    exec_path, command.get_args(), fds, exec_pipe[1]);
+    if (out_fd != STDOUT_FILENO) {
+      close(out_fd);
+    }
+    if (exec_pipe[1] != -1) {
+      close(exec_pipe[1]);
+    }
+    if (!sent) {
+      if (launch.exec_fd != -1) {
+        close(launch.exec_fd);
+      }
+      return false;
+    }
+    next_zygote = (next_zygote + 1) % zygotes.size();
+    zygote_pending.push_back(std::move(launch));
+    return true;
+  }
+
+  void collect_zygote_launches() {
+    // Reads the pids of commands handed to zygotes, in request order
+    for (auto &launch : zygote_pending) {
+      pid_t pid = zygotes[launch.zygote].recv_pid();
+      if (launch.exec_fd != -1) {
+        char done;
+        while (pid != -1 && read(launch.exec_fd, &done, 1) == -1 &&
+               errno == EINTR) {
+        }
+        close(launch.exec_fd);
+      }
+      if (pid == -1) {
+        // Unsuccessful launch
+        std::cerr << error_message;
+        continue;
+      }
+      if (launch.timed) {
+        launch.timing.launch = seconds_since(launch.timing.start);
+        timings[pid] = launch.timing;
+      }
+      if (launch.background) {
+        jobs[pid] = launch.text;
+      } else {
+        pid_list.push_back(pid);
+      }
+    }
+    zygote_pending.clear();
+  }
+
+  void close_zygotes() {
+    // Stops using zygotes in this process, e.g. in a -j runner
+    for (auto &zygote : zygotes) {
+      zygote.stop();
+    }
+    zygotes.clear();
+  }
+
+  void release_child(pid_t pid) {
+    // Forgets a child that was reaped early to free up a job slot
+    if (jobs.erase(pid) == 0) {
+      auto it = std::find(pid_list.begin(), pid_list.end(), pid);
+      if (it != pid_list.end()) {
+        pid_list.erase(it);
+      }
+    }
+  }
+
+  bool reap_one() {
+    /*
+     * Blocks until one live child exits
+     *
+     * Returns:
+     *   true if a child was reaped, false if there were none to wait for
+     */
+    if (pid_list.empty() && jobs.empty()) {
+      return false;
+    }
+    pid_t pid = wait_child(-1, 0);
+    if (pid == -1) {
+      return false;
+    }
+    release_child(pid);
+    return true;
+  }
+
+  void wait_for_slot() {
+    // Holds the next command until fewer than jobs_max children are alive
+    while (jobs_max != 0 &&
+           pid_list.size() + jobs.size() + zygote_pending.size() >=
+               jobs_max) {
+      if (!zygote_pending.empty()) {
+        // Their pids are needed before any of them can be reaped
+        collect_zygote_launches();
+      } else if (!reap_one()) {
+        break;
+      }
+    }
+  }
+
+  pid_t fork_child() {
+    /*
+     * Forks once a job slot is free. Commands past the jobs-max limit are
+     * held here until a running child is reaped, and a fork that fails with
+     * EAGAIN is retried after reaping instead of being dropped.
+     *
+     * Returns:
+     *   pid from fork, or -1 on failure
+     */
+    wait_for_slot();
+
+    pid_t pid;
+    while ((pid = fork()) == -1 && errno == EAGAIN && reap_one()) {
+    }
+    return pid;
+  }
+
+  pid_t fork_command(Command &command) {
+    /*
+     * Forks a child for a command. When the command is being timed, an
+     * O_CLOEXEC pipe tells the shell when the child's exec has happened, so
+     * the fork/exec overhead can be split from the time the program ran.
+     *
+     * Args:
+     *   command: command the child will run
+     *
+     * Returns:
+     *   pid from fork, or -1 on failure
+     */
+    int exec_pipe[2];
+    if ((!stats_enabled && !command.get_timed()) ||
+        pipe2(exec_pipe, O_CLOEXEC) == -1) {
+      return fork_child();
+    }
+
+    wait_for_slot();
+    ChildTiming timing;
+    timing.name = command.get_args()[0];
+    timing.report = command.get_timed();
+    clock_gettime(CLOCK_MONOTONIC, &timing.start);
+    pid_t pid = fork_child();
+    if (pid == 0) {
+      // The write end closes when exec succeeds or the child exits
+      close(exec_pipe[0]);
+      return 0;
+    }
+
+    close(exec_pipe[1]);
+    if (pid > 0) {
+      char done;
+      while (read(exec_pipe[0], &done, 1) == -1 && errno == EINTR) {
+      }
+      timing.launch = seconds_since(timing.start);
+      timings[pid] = timing;
+    }
+    close(exec_pipe[0]);
+    return pid;
   }
 
   int run() {
     // Allocates processes and runs command
     commands.clear();
     pid_list.clear();
+    reap_jobs();
 
     if (input.length() == 0) {
       // Empty line
@@ -402,10 +1576,23 @@ private:
     }
 
     if (parse_command() == 0) {
+      // A line ending in & leaves its commands running as background jobs
+      bool background = !commands.empty() && commands.back().get_parallel();
+
       for (auto &cmd : commands) {
-        if (cmd.get_parallel()) {
+        if (cmd.get_args()[0] == nullptr) {
+          // Nothing to run, e.g. a lone & or a bare time prefix
+          if (cmd.get_timed()) {
+            std::cerr << error_message;
+          }
+          continue;
+        } else if (!is_builtin(cmd) && !is_inproc(cmd) &&
+                   zygote_launch(cmd, background)) {
+          // Started by a zygote, its pid is collected below
+          continue;
+        } else if (cmd.get_parallel()) {
           // Command should be run as a child process
-          pid_t pid = fork();
+          pid_t pid = fork_command(cmd);
           if (pid == -1) {
             // Unsuccessful fork
             std::cerr << error_message;
@@ -414,106 +1601,432 @@ private:
 
           if (pid == 0) {
             // Execute command in child process
-            if (strcmp(cmd.get_args()[0], "exit") == 0) {
-              if (cmd.get_args().size() != 2) {
-                std::cerr << error_message;
-              } else {
-                exit(0);
-              }
-            } else if (strcmp(cmd.get_args()[0], "cd") == 0) {
-              exit(cd(cmd.get_args()));
-            } else if (strcmp(cmd.get_args()[0], "path") == 0) {
-              exit(path(cmd.get_args()));
-            } else {
-              exit(exec_command(cmd));
+            if (is_builtin(cmd) || is_inproc(cmd)) {
+              exit(run_builtin(cmd));
             }
+            exit(exec_command(cmd));
+          } else if (background) {
+            jobs[pid] = command_text(cmd);
           } else {
             // Add pid to pid list in parent process
             pid_list.push_back(pid);
           }
+        } else if (is_builtin(cmd) || is_inproc(cmd)) {
+          // Built-ins that are not run in parallel run in the shell itself
+          run_builtin(cmd);
         } else {
-          // Command is not supposed to be run in parallel
-          if (strcmp(cmd.get_args()[0], "exit") == 0) {
-            if (cmd.get_args().size() != 2) {
-              std::cerr << error_message;
-            } else {
-              exit(0);
-            }
-          } else if (strcmp(cmd.get_args()[0], "cd") == 0) {
-            cd(cmd.get_args());
-          } else if (strcmp(cmd.get_args()[0], "path") == 0) {
-            path(cmd.get_args());
+          // Fork since it is not a built-in command
+          pid_t pid = fork_command(cmd);
+          if (pid == -1) {
+            // Unsuccessful fork
+            std::cerr << error_message;
+          } else if (pid == 0) {
+            // Execute command in child process
+            exit(exec_command(cmd));
           } else {
-            // Fork since it is not a built-in command
-            pid_t pid = fork();
-            if (pid == -1) {
-              // Unsuccessful fork
-              std::cerr << error_message;
-            } else if (pid == 0) {
-              // Execute command in child process
-              exit(exec_command(cmd));
-            } else {
-              // Add pid to pid list in parent process
-              pid_list.push_back(pid);
-            }
+            // Add pid to pid list in parent process
+            pid_list.push_back(pid);
           }
         }
       }
 
+      collect_zygote_launches();
       for (auto pid : pid_list) {
         // Wait for all child processes to finish
-        int child_stat;
-        waitpid(pid, &child_stat, 0);
+        wait_child(pid, 0);
       }
     }
 
     return 0;
   }
 
+  BatchLine analyze_line(std::string_view line) {
+    /*
+     * Works out what a batch line depends on without running it
+     *
+     * Args:
+     *   line: line of the batch script
+     *
+     * Returns:
+     *   batch line with the files it uses and barrier flag filled in
+     */
+    BatchLine batch_line;
+    batch_line.text = std::string(line);
+
+    std::vector<std::string> tokens = tokenizer.tokenize(line);
+    bool command_name = true;
+    for (size_t idx = 0; idx < tokens.size(); idx++) {
+      const std::string &token = tokens[idx];
+      if (token == "&") {
+        command_name = true;
+      } else if ((token == ">" || token == "<") && idx + 1 < tokens.size()) {
+        if (token == ">") {
+          batch_line.writes.insert(tokens[idx + 1]);
+        } else {
+          batch_line.reads.insert(tokens[idx + 1]);
+        }
+        idx++;
+      } else if (command_name && token == "time") {
+        continue;
+      } else if (command_name) {
+        Command probe;
+        probe.add_arg(token);
+        batch_line.barrier |= token == "eof_exit" || is_builtin(probe);
+        command_name = false;
+      } else {
+        // Maybe a file the command reads, e.g. cat out after ... > out
+        batch_line.reads.insert(token);
+      }
+    }
+    return batch_line;
+  }
+
+  bool start_line(BatchLine &line) {
+    /*
+     * Forks a runner process for a batch line with its output captured
+     *
+     * Args:
+     *   line: batch line to start
+     *
+     * Returns:
+     *   true if the runner was started
+     */
+    line.out_fd = memfd_create("wish-stdout", MFD_CLOEXEC);
+    line.err_fd = memfd_create("wish-stderr", MFD_CLOEXEC);
+    if (line.out_fd == -1 || line.err_fd == -1) {
+      return false;
+    }
+
+    std::cout.flush();
+    line.pid = fork();
+    if (line.pid == -1) {
+      return false;
+    } else if (line.pid == 0) {
+      // Runner: run the line like the sequential shell would, into the files
+      // Zygote children would belong to the shell, not this runner
+      install_sigchld_pipe();
+      close_zygotes();
+      stats.clear();
+      if (dup2(line.out_fd, STDOUT_FILENO) == -1 ||
+          dup2(line.err_fd, STDERR_FILENO) == -1) {
+        _exit(1);
+      }
+      input = line.text;
+      run();
+      wait_all_jobs();
+      if (stats_enabled && stats_fd != -1) {
+        write_runner_stats();
+      }
+      std::cout.flush();
+      _exit(0);
+    }
+    return true;
+  }
+
+  void flush_line(BatchLine &line) {
+    // Replays a finished line's captured output and releases it
+    int fds[2][2] = {{line.out_fd, STDOUT_FILENO},
+                     {line.err_fd, STDERR_FILENO}};
+    for (auto &fd : fds) {
+      if (fd[0] == -1) {
+        continue;
+      }
+      off_t len = lseek(fd[0], 0, SEEK_END);
+      off_t offset = 0;
+      while (offset < len) {
+        if (sendfile(fd[1], fd[0], &offset, len - offset) > 0) {
+          continue;
+        }
+        // sendfile refuses some outputs (O_APPEND files), copy those instead
+        char chunk[65536];
+        ssize_t got = pread(fd[0], chunk, sizeof(chunk), offset);
+        if (got <= 0 || write(fd[1], chunk, got) != got) {
+          break;
+        }
+        offset += got;
+      }
+      close(fd[0]);
+    }
+    line.out_fd = -1;
+    line.err_fd = -1;
+  }
+
 public:
-  Wish() {}
+  void enable_stats() { stats_enabled = true; }
+
+  bool start_zygotes(size_t count) {
+    /*
+     * Starts the launch helpers used instead of fork for external commands
+     *
+     * Args:
+     *   count: number of zygotes to fan launches out over
+     *
+     * Returns:
+     *   true if all zygotes started
+     */
+    for (size_t idx = 0; idx < count; idx++) {
+      Zygote zygote;
+      if (!zygote.start()) {
+        return false;
+      }
+      zygotes.push_back(zygote);
+    }
+    return true;
+  }
+
+  void print_stats() {
+    // Prints per-command totals to stderr when --stats is on
+    if (!stats_enabled) {
+      return;
+    }
+    if (stats_fd != -1) {
+      merge_runner_stats();
+    }
+
+    char line[256];
+    snprintf(line, sizeof(line), "%-16s %8s %12s %10s %12s %12s\n", "command",
+             "count", "total_ms", "max_ms", "launch_ms", "run_ms");
+    std::cerr << line;
+    for (auto &entry : stats) {
+      const CommandStats &st = entry.second;
+      snprintf(line, sizeof(line), "%-16s %8zu %12.3f %10.3f %12.3f %12.3f\n",
+               entry.first.c_str(), st.count, st.total * 1e3, st.max * 1e3,
+               st.launch * 1e3, st.run * 1e3);
+      std::cerr << line;
+    }
+  }
+
+  Wish() {
+    // Background jobs are reaped via a self-pipe written from SIGCHLD
+    install_sigchld_pipe();
+
+    const char *inproc = getenv("WISH_INPROC");
+    inproc_enabled = inproc != nullptr && strcmp(inproc, "1") == 0;
+
+    const char *limit = getenv("WISH_JOBS_MAX");
+    if (limit != nullptr && !parse_jobs_max(limit)) {
+      // Not a count, rather than silently no limit
+      std::cerr << error_message;
+      exit(1);
+    }
+  }
 
   int run_stdin() {
     // Runs wish taking input from stdin
     while (true) {
-      input.clear();
+      stdin_line.clear();
       std::cout << "wish> ";
-      std::getline(std::cin, input);
+      std::getline(std::cin, stdin_line);
+      input = stdin_line;
       run();
     }
     return 0;
   }
 
+  int run_batch_parallel(char *file, size_t job_slots) {
+    /*
+     * Runs a batch script with independent lines on up to job_slots
+     * runners. A line waits for earlier lines that write a file it reads or
+     * writes, or read a file it writes. Files named as arguments count as
+     * read; only > counts as a write, so a line using a file that an
+     * earlier rm or mv changes needs a built-in (wait) between them. Lines
+     * with built-ins (cd, path, wait, exit, ...) are barriers that run in
+     * the shell once all earlier lines are done. Output is flushed in
+     * script order.
+     *
+     * Args:
+     *   file: batch script
+     *   job_slots: maximum number of lines running at once
+     *
+     * Returns:
+     *   exit code: 0 on success, 1 on error
+     */
+    BatchReader reader;
+    if (!reader.open(file)) {
+      std::cerr << error_message;
+      return 1;
+    }
+
+    if (stats_enabled) {
+      stats_fd = memfd_create("wish-stats", MFD_CLOEXEC);
+      if (stats_fd != -1) {
+        fcntl(stats_fd, F_SETFL, O_APPEND);
+      }
+    }
+
+    std::deque<BatchLine> window = {};
+    size_t window_max = std::max<size_t>(64, 16 * job_slots);
+    size_t running = 0;
+    bool valid_batch = false;
+    bool input_done = false;
+    std::string_view line;
+
+    while (true) {
+      while (!input_done && window.size() < window_max) {
+        if (!reader.next(line)) {
+          input_done = true;
+        } else {
+          valid_batch = true;
+          if (!line.empty()) {
+            window.push_back(analyze_line(line));
+          }
+        }
+      }
+
+      // Retire finished lines in order and run barriers that reach the front
+      while (!window.empty()) {
+        BatchLine &front = window.front();
+        if (front.done) {
+          flush_line(front);
+        } else if (front.barrier && running == 0) {
+          std::cout.flush();
+          input = front.text;
+          run();
+          std::cout.flush();
+        } else {
+          break;
+        }
+        window.pop_front();
+      }
+      if (window.empty()) {
+        if (input_done) {
+          break;
+        }
+        continue;
+      }
+
+      for (size_t idx = 0; idx < window.size() && running < job_slots;
+           idx++) {
+        BatchLine &candidate = window[idx];
+        if (candidate.barrier) {
+          break;
+        } else if (candidate.pid != -1 || candidate.done) {
+          continue;
+        }
+
+        bool ready = true;
+        for (size_t earlier = 0; earlier < idx && ready; earlier++) {
+          ready = window[earlier].done ||
+                  !candidate.depends_on(window[earlier]);
+        }
+        if (!ready) {
+          continue;
+        }
+
+        if (start_line(candidate)) {
+          running++;
+        } else {
+          // Could not start a runner, report it in the line's place
+          flush_line(candidate);
+          candidate.done = true;
+          std::cerr << error_message;
+        }
+      }
+
+      if (running == 0) {
+        continue;
+      }
+      pid_t pid = wait_child(-1, 0);
+      if (pid == -1) {
+        break;
+      }
+      jobs.erase(pid);
+      for (auto &batch_line : window) {
+        if (batch_line.pid == pid && !batch_line.done) {
+          batch_line.done = true;
+          running--;
+          break;
+        }
+      }
+    }
+
+    wait_all_jobs();
+    if (!valid_batch) {
+      // Nothing was read from the file
+      std::cerr << error_message;
+      return 1;
+    }
+    return 0;
+  }
+
   int run_batch(char *file) {
     // Runs the wish shell with specified batch script
-    std::ifstream ifs(file, std::ios::in);
-    if (!ifs) {
+    BatchReader reader;
+    if (!reader.open(file)) {
       std::cerr << error_message;
       return 1;
     }
 
     bool valid_batch = false;
-    while (std::getline(ifs, input)) {
+    while (reader.next(input)) {
       valid_batch = true;
       run();
     }
-    ifs.close();
     if (!valid_batch) {
       // Nothing was read from the file
       std::cerr << error_message;
       return 1;
     }
+    wait_all_jobs();
     return 0;
   }
 };
 
 int main(int argc, char *argv[]) {
   Wish wish = Wish();
-  switch (argc) {
-  case 2:
-    return wish.run_batch(argv[1]);
+  int arg = 1;
+  long job_slots = 1;
+  long zygotes = 0;
+  while (arg < argc && argv[arg][0] == '-') {
+    if (strcmp(argv[arg], "--stats") == 0) {
+      wish.enable_stats();
+      arg++;
+      continue;
+    }
+
+    char *end = nullptr;
+    long value = 0;
+    if (arg + 1 < argc) {
+      value = std::strtol(argv[arg + 1], &end, 10);
+    }
+    if (end == nullptr || *end != '\0' || value < 1) {
+      end = nullptr;
+    } else if (strcmp(argv[arg], "-j") == 0) {
+      job_slots = value;
+    } else if (strcmp(argv[arg], "--zygote") == 0) {
+      zygotes = value;
+    } else {
+      end = nullptr;
+    }
+    if (end == nullptr) {
+      std::cerr << "An error has occurred\n";
+      exit(1);
+    }
+    arg += 2;
+  }
+
+  // Start zygotes while the shell is still small
+  if (zygotes > 0 && !wish.start_zygotes(zygotes)) {
+    std::cerr << "An error has occurred\n";
+    exit(1);
+  }
+
+  int ret;
+  switch (argc - arg) {
   case 1:
-    return wish.run_stdin();
+    if (job_slots > 1) {
+      ret = wish.run_batch_parallel(argv[arg], job_slots);
+    } else {
+      ret = wish.run_batch(argv[arg]);
+    }
+    wish.print_stats();
+    return ret;
+  case 0:
+    if (job_slots == 1) {
+      return wish.run_stdin();
+    }
+    // -j only makes sense with a batch script
+    [[fallthrough]];
   default:
     std::cerr << "An error has occurred\n";
     exit(1);
@@ -0,0 +1,200 @@
+#include "AccessLog.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+
+using namespace std;
+
+// per thread, entries past this are dropped until the writer catches up
+#define BUFFER_BYTES (256 * 1024)
+#define FLUSH_INTERVAL_MS 100
+// the live file plus rotated ones
+#define KEEP_FILES 5
+// longest path we log
+#define MAX_PATH_LOGGED 1024
+
+static thread_local void *my_buffer = NULL;
+static AccessLog *exit_log = NULL;
+
+static void flush_at_exit() {
+  exit_log->flush();
+}
+
+AccessLog::AccessLog(string file, size_t rotateBytes) {
+  m_file = file;
+  m_rotateBytes = file == "-" ? 0 : rotateBytes;
+  m_fd = -1;
+  m_written = 0;
+  m_dropped = 0;
+  m_reportedDrops = 0;
+  pthread_mutex_init(&m_buffersMutex, NULL);
+  pthread_mutex_init(&m_writeMutex, NULL);
+  openFile();
+}
+
+void AccessLog::openFile() {
+  if (m_file == "-") {
+    m_fd = STDOUT_FILENO;
+    return;
+  }
+
+  m_fd = open(m_file.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (m_fd < 0) {
+    cerr << "Could not open access log: " << m_file << endl;
+    exit(1);
+  }
+  m_written = lseek(m_fd, 0, SEEK_END);
+}
+
+void AccessLog::start() {
+  // a plain pthread, the access log is not part of the dthread log
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  pthread_t thread;
+  int ret = pthread_create(&thread, NULL, &AccessLog::writerThread, this);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (ret != 0) {
+    cerr << "Could not start the access log writer" << endl;
+    exit(1);
+  }
+  pthread_detach(thread);
+
+  exit_log = this;
+  atexit(flush_at_exit);
+}
+
+AccessLog::Buffer *AccessLog::threadBuffer() {
+  if (my_buffer == NULL) {
+    // lives as long as the process, the writer may still look at it
+    Buffer *buffer = new Buffer;
+    pthread_mutex_init(&buffer->mutex, NULL);
+    buffer->data.reserve(BUFFER_BYTES);
+    buffer->second = 0;
+    pthread_mutex_lock(&m_buffersMutex);
+    m_buffers.push_back(buffer);
+    pthread_mutex_unlock(&m_buffersMutex);
+    my_buffer = buffer;
+  }
+  return (Buffer *) my_buffer;
+}
+
+void AccessLog::log(const char *method, const string &path, int status,
+                    size_t bytes, uint64_t latencyUs) {
+  Buffer *buffer = threadBuffer();
+
+  // only this thread touches the time stamp
+  time_t now = time(NULL);
+  if (now != buffer->second) {
+    struct tm tm;
+    char stamp[32];
+    gmtime_r(&now, &tm);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", &tm);
+    buffer->second = now;
+    buffer->stamp = stamp;
+  }
+
+  char line[MAX_PATH_LOGGED + 128];
+  int length = snprintf(line, sizeof(line), "%s %s %.*s %d %zu %llu\n",
+                        buffer->stamp.c_str(), method,
+                        (int) min(path.length(), (size_t) MAX_PATH_LOGGED),
+                        path.c_str(), status, bytes,
+                        (unsigned long long) latencyUs);
+  if (length <= 0) {
+    return;
+  }
+
+  pthread_mutex_lock(&buffer->mutex);
+  if (buffer->data.length() + length > BUFFER_BYTES) {
+    pthread_mutex_unlock(&buffer->mutex);
+    m_dropped++;
+    return;
+  }
+  buffer->data.append(line, length);
+  pthread_mutex_unlock(&buffer->mutex);
+}
+
+uint64_t AccessLog::now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void AccessLog::flush() {
+  pthread_mutex_lock(&m_buffersMutex);
+  vector<Buffer *> buffers = m_buffers;
+  pthread_mutex_unlock(&m_buffersMutex);
+
+  pthread_mutex_lock(&m_writeMutex);
+  string batch;
+  for (size_t idx = 0; idx < buffers.size(); idx++) {
+    // request threads only wait for this copy, never for the write
+    pthread_mutex_lock(&buffers[idx]->mutex);
+    batch.append(buffers[idx]->data);
+    buffers[idx]->data.clear();
+    pthread_mutex_unlock(&buffers[idx]->mutex);
+  }
+
+  unsigned long dropped = m_dropped.load();
+  if (dropped != m_reportedDrops) {
+    batch += "# access log dropped " + to_string(dropped - m_reportedDrops) +
+             " entries\n";
+    m_reportedDrops = dropped;
+  }
+
+  if (!batch.empty()) {
+    writeOut(batch);
+  }
+  pthread_mutex_unlock(&m_writeMutex);
+}
+
+void AccessLog::writeOut(const string &data) {
+  const char *next = data.data();
+  size_t left = data.length();
+  while (left > 0) {
+    ssize_t ret = write(m_fd, next, left);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      // a full disk should not take the server down, count it instead
+      m_dropped++;
+      return;
+    }
+    next += ret;
+    left -= ret;
+  }
+
+  m_written += data.length();
+  if (m_rotateBytes > 0 && m_written >= m_rotateBytes) {
+    rotate();
+  }
+}
+
+void AccessLog::rotate() {
+  // file.3 -> file.4 ... file -> file.1, the oldest falls off
+  close(m_fd);
+  for (int idx = KEEP_FILES - 1; idx >= 1; idx--) {
+    string from = idx == 1 ? m_file : m_file + "." + to_string(idx - 1);
+    string to = m_file + "." + to_string(idx);
+    rename(from.c_str(), to.c_str());
+  }
+  openFile();
+}
+
+void *AccessLog::writerThread(void *arg) {
+  AccessLog *accessLog = (AccessLog *) arg;
+  while (true) {
+    usleep(FLUSH_INTERVAL_MS * 1000);
+    accessLog->flush();
+  }
+  return NULL;
+}
@@ -0,0 +1,90 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <iostream>
+
+#include "Arena.h"
+
+using namespace std;
+
+Arena::Arena() {
+  m_top = m_inline;
+  m_end = m_inline + INLINE_BYTES;
+  m_blocks = NULL;
+  memset(m_spares, 0, sizeof(m_spares));
+  m_nextSpare = 0;
+}
+
+Arena::~Arena() {
+  while (m_blocks != NULL) {
+    Block *next = m_blocks->next;
+    free(m_blocks);
+    m_blocks = next;
+  }
+}
+
+char *Arena::allocate(size_t size, size_t align) {
+  uintptr_t top = ((uintptr_t) m_top + align - 1) & ~(uintptr_t) (align - 1);
+  if (top + size > (uintptr_t) m_end) {
+    // what is left of the current block is given up, a block is many
+    // requests' worth of header lines so little is lost
+    size_t bytes = sizeof(Block) + align + size;
+    if (bytes < BLOCK_BYTES) {
+      bytes = BLOCK_BYTES;
+    }
+    Block *block = (Block *) malloc(bytes);
+    if (block == NULL) {
+      cerr << "arena: out of memory" << endl;
+      exit(1);
+    }
+    block->next = m_blocks;
+    m_blocks = block;
+    m_top = (char *) (block + 1);
+    m_end = (char *) block + bytes;
+    top = ((uintptr_t) m_top + align - 1) & ~(uintptr_t) (align - 1);
+  }
+  m_top = (char *) top + size;
+  return (char *) top;
+}
+
+string_view Arena::copy(const char *data, size_t len) {
+  char *to = allocate(len);
+  memcpy(to, data, len);
+  return string_view(to, len);
+}
+
+string_view Arena::append(string_view view, const char *data, size_t len) {
+  if (view.empty()) {
+    return copy(data, len);
+  }
+  if (view.data() + view.size() == m_top && len <= (size_t) (m_end - m_top)) {
+    memcpy(m_top, data, len);
+    m_top += len;
+    return string_view(view.data(), view.size() + len);
+  }
+  // http_parser hands over the URL, path and query a piece each in turn,
+  // so the string is often not the last thing allocated; it may still end
+  // where a copy below left room for it to grow
+  char *end = (char *) view.data() + view.size();
+  for (size_t idx = 0; idx < SPARES; idx++) {
+    Spare &spare = m_spares[idx];
+    if (spare.end == end && len <= (size_t) (spare.limit - end)) {
+      memcpy(end, data, len);
+      spare.end += len;
+      return string_view(view.data(), view.size() + len);
+    }
+  }
+  // take as much again as the string needs so the pieces after this one
+  // grow it in place; a string that arrives a byte at a time then costs a
+  // few times its size, not its size squared
+  size_t size = view.size() + len;
+  char *to = allocate(2 * size);
+  memcpy(to, view.data(), view.size());
+  memcpy(to + view.size(), data, len);
+  Spare &spare = m_spares[m_nextSpare];
+  m_nextSpare = (m_nextSpare + 1) % SPARES;
+  spare.end = to + size;
+  spare.limit = to + 2 * size;
+  return string_view(to, size);
+}
@@ -0,0 +1,270 @@
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <functional>
+#include <iostream>
+#include <vector>
+
+#include "ContentCache.h"
+#include "dthread.h"
+
+using namespace std;
+
+// a power of two
+#define SHARDS 16
+// bookkeeping we charge each entry on top of its path and bytes
+#define ENTRY_OVERHEAD 256
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE | \
+                    IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |            \
+                    IN_DELETE_SELF | IN_MOVE_SELF)
+
+ContentCache::ContentCache(string basedir, size_t budget) {
+  m_basedir = normalize(basedir);
+  m_shardBudget = budget / SHARDS;
+  // a single file may take a quarter of its shard
+  m_maxFileBytes = m_shardBudget / 4;
+  m_enabled = false;
+  m_generation = 0;
+  m_inotifyFd = -1;
+
+  m_shards = new Shard[SHARDS];
+  for (int idx = 0; idx < SHARDS; idx++) {
+    pthread_mutex_init(&m_shards[idx].mutex, NULL);
+    m_shards[idx].bytes = 0;
+  }
+}
+
+bool ContentCache::start() {
+  m_inotifyFd = inotify_init1(IN_CLOEXEC);
+  if (m_inotifyFd < 0) {
+    return false;
+  }
+  addWatches(m_basedir);
+  if (m_watches.empty()) {
+    close(m_inotifyFd);
+    return false;
+  }
+
+  pthread_t thread;
+  if (dthread_create(&thread, NULL, &ContentCache::watchThread, this) != 0 ||
+      dthread_detach(thread) != 0) {
+    return false;
+  }
+  m_enabled = true;
+  return true;
+}
+
+string ContentCache::normalize(const string &path) {
+  string result;
+  size_t start = 0;
+  if (!path.empty() && path[0] == '/') {
+    result = "/";
+    start = 1;
+  }
+
+  while (start <= path.length()) {
+    size_t end = path.find('/', start);
+    if (end == string::npos) {
+      end = path.length();
+    }
+    string segment = path.substr(start, end - start);
+    if (!segment.empty() && segment != ".") {
+      if (!result.empty() && result[result.length() - 1] != '/') {
+        result += '/';
+      }
+      result += segment;
+    }
+    start = end + 1;
+  }
+  return result;
+}
+
+ContentCache::Shard &ContentCache::shardFor(const string &path) {
+  return m_shards[hash<string>()(path) & (SHARDS - 1)];
+}
+
+shared_ptr<const CachedFile> ContentCache::lookup(const string &path) {
+  if (!m_enabled) {
+    return NULL;
+  }
+
+  Shard &shard = shardFor(path);
+  shared_ptr<const CachedFile> file;
+  dthread_mutex_lock(&shard.mutex);
+  unordered_map<string, list<Node>::iterator>::iterator found =
+    shard.index.find(path);
+  if (found != shard.index.end()) {
+    // to the front, it is the most recently used now
+    shard.lru.splice(shard.lru.begin(), shard.lru, found->second);
+    file = found->second->file;
+  }
+  dthread_mutex_unlock(&shard.mutex);
+  return file;
+}
+
+void ContentCache::insert(const string &path, shared_ptr<const CachedFile> file,
+                          unsigned long generation) {
+  if (!m_enabled) {
+    return;
+  }
+
+  size_t bytes = path.length() + ENTRY_OVERHEAD;
+  if (file->content) {
+    bytes += file->content->headers.length() + file->content->body.length();
+  }
+  if (bytes > m_shardBudget) {
+    return;
+  }
+
+  Shard &shard = shardFor(path);
+  dthread_mutex_lock(&shard.mutex);
+  // checked under the lock, invalidate() bumps it before taking the lock
+  if (generation != m_generation.load()) {
+    dthread_mutex_unlock(&shard.mutex);
+    return;
+  }
+
+  unordered_map<string, list<Node>::iterator>::iterator found =
+    shard.index.find(path);
+  if (found != shard.index.end()) {
+    shard.bytes -= found->second->bytes;
+    shard.lru.erase(found->second);
+    shard.index.erase(found);
+  }
+
+  Node node;
+  node.path = path;
+  node.file = file;
+  node.bytes = bytes;
+  shard.lru.push_front(node);
+  shard.index[path] = shard.lru.begin();
+  shard.bytes += bytes;
+
+  // evict from the cold end, readers may still hold what we drop
+  while (shard.bytes > m_shardBudget) {
+    Node &victim = shard.lru.back();
+    shard.bytes -= victim.bytes;
+    shard.index.erase(victim.path);
+    shard.lru.pop_back();
+  }
+  dthread_mutex_unlock(&shard.mutex);
+}
+
+void ContentCache::invalidate(const string &path) {
+  m_generation++;
+
+  Shard &shard = shardFor(path);
+  dthread_mutex_lock(&shard.mutex);
+  unordered_map<string, list<Node>::iterator>::iterator found =
+    shard.index.find(path);
+  if (found != shard.index.end()) {
+    shard.bytes -= found->second->bytes;
+    shard.lru.erase(found->second);
+    shard.index.erase(found);
+  }
+  dthread_mutex_unlock(&shard.mutex);
+}
+
+void ContentCache::invalidateAll() {
+  m_generation++;
+
+  for (int idx = 0; idx < SHARDS; idx++) {
+    Shard &shard = m_shards[idx];
+    dthread_mutex_lock(&shard.mutex);
+    shard.lru.clear();
+    shard.index.clear();
+    shard.bytes = 0;
+    dthread_mutex_unlock(&shard.mutex);
+  }
+}
+
+void ContentCache::addWatches(const string &dir) {
+  int wd = inotify_add_watch(m_inotifyFd, dir.c_str(), WATCH_MASK | IN_ONLYDIR);
+  if (wd < 0) {
+    return;
+  }
+  m_watches[wd] = dir;
+
+  DIR *listing = opendir(dir.c_str());
+  if (listing == NULL) {
+    return;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(listing)) != NULL) {
+    string name = entry->d_name;
+    if (name == "." || name == "..") {
+      continue;
+    }
+    string child = dir + "/" + name;
+    struct stat st;
+    if (lstat(child.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+      addWatches(child);
+    }
+  }
+  closedir(listing);
+}
+
+void ContentCache::watch() {
+  // room for a good batch of events with the longest names
+  vector<char> buffer(64 * (sizeof(struct inotify_event) + NAME_MAX + 1));
+  while (true) {
+    ssize_t len = read(m_inotifyFd, buffer.data(), buffer.size());
+    if (len < 0 && errno == EINTR) {
+      continue;
+    }
+    if (len <= 0) {
+      // we can no longer tell when files change, stop caching
+      m_enabled = false;
+      invalidateAll();
+      cerr << "content cache: lost inotify, caching off" << endl;
+      return;
+    }
+
+    for (ssize_t offset = 0; offset < len;) {
+      struct inotify_event *event =
+        (struct inotify_event *) (buffer.data() + offset);
+      offset += sizeof(struct inotify_event) + event->len;
+
+      if (event->mask & IN_Q_OVERFLOW) {
+        invalidateAll();
+        continue;
+      }
+      if (event->mask & IN_IGNORED) {
+        m_watches.erase(event->wd);
+        continue;
+      }
+      map<int, string>::iterator dir = m_watches.find(event->wd);
+      if (dir == m_watches.end()) {
+        continue;
+      }
+
+      if (event->mask & (IN_ISDIR | IN_DELETE_SELF | IN_MOVE_SELF)) {
+        // a whole tree came or went, new directories need watches of
+        // their own
+        if (event->len > 0 && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+          addWatches(dir->second + "/" + event->name);
+        }
+        invalidateAll();
+        continue;
+      }
+      if (event->len > 0) {
+        string path = dir->second + "/" + event->name;
+        invalidate(path);
+        // FileService sends x.gz for x
+        if (path.length() > 3 &&
+            path.compare(path.length() - 3, 3, ".gz") == 0) {
+          invalidate(path.substr(0, path.length() - 3));
+        }
+      }
+    }
+  }
+}
+
+void *ContentCache::watchThread(void *arg) {
+  ((ContentCache *) arg)->watch();
+  return NULL;
+}
@@ -0,0 +1,408 @@
+#include <string.h>
+
+#include "FastRequestParser.h"
+#include "http_parser.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SCANNERS 1
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+// bytes that may appear in an origin-form URL, as http_parser's
+// normal_url_char has them plus '?'. Controls, space, '#', DEL and
+// anything past ASCII end it
+static bool urlChar(unsigned char c) {
+  return c > ' ' && c < 0x7f && c != '#';
+}
+
+// RFC 7230 token characters, what a header name is made of
+static const unsigned char tokenChars[256] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  //   !  "  #  $  %  &  '  (  )  *  +  ,  -  .  /
+  0, 1, 1, 1, 1, 1, 1, 1, 0, 0, 1, 1, 0, 1, 1, 0,
+  // 0-9                           :  ;  <  =  >  ?
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0,
+  // @  A-O
+  0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  // P-Z                           [  \  ]  ^  _
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 1,
+  // `  a-o
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  // p-z                           {  |  }  ~  DEL
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 0, 1, 0,
+};
+
+/****************************** Scanners ***********************************/
+
+// first '\r' or '\n' at or after p, or end
+static const char *lineEndScalar(const char *p, const char *end) {
+  while (p < end && *p != '\r' && *p != '\n') {
+    p++;
+  }
+  return p;
+}
+
+// first byte at or after p that cannot be part of a URL, or end
+static const char *urlEndScalar(const char *p, const char *end) {
+  while (p < end && urlChar(*p)) {
+    p++;
+  }
+  return p;
+}
+
+#ifdef HAVE_X86_SCANNERS
+
+// pcmpestri does the whole job for us: "equal any" finds the line end,
+// "ranges" finds the bytes outside the URL characters. Both only look at
+// whole 16 byte blocks, the tail is left to the scalar loop
+
+__attribute__((target("sse4.2")))
+static const char *lineEndSse42(const char *p, const char *end) {
+  const __m128i lineEnds = _mm_setr_epi8('\r', '\n', 0, 0, 0, 0, 0, 0,
+                                         0, 0, 0, 0, 0, 0, 0, 0);
+  while (end - p >= 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *) p);
+    int idx = _mm_cmpestri(lineEnds, 2, block, 16,
+                           _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY |
+                           _SIDD_LEAST_SIGNIFICANT);
+    if (idx != 16) {
+      return p + idx;
+    }
+    p += 16;
+  }
+  return lineEndScalar(p, end);
+}
+
+__attribute__((target("sse4.2")))
+static const char *urlEndSse42(const char *p, const char *end) {
+  // 0x00-0x20, '#' and 0x7f-0xff
+  const __m128i stops = _mm_setr_epi8(0x00, 0x20, '#', '#', 0x7f, (char) 0xff,
+                                      0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+  while (end - p >= 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *) p);
+    int idx = _mm_cmpestri(stops, 6, block, 16,
+                           _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES |
+                           _SIDD_LEAST_SIGNIFICANT);
+    if (idx != 16) {
+      return p + idx;
+    }
+    p += 16;
+  }
+  return urlEndScalar(p, end);
+}
+
+// AVX2 has no string instructions, compare and take the mask instead
+
+__attribute__((target("avx2")))
+static const char *lineEndAvx2(const char *p, const char *end) {
+  const __m256i cr = _mm256_set1_epi8('\r');
+  const __m256i lf = _mm256_set1_epi8('\n');
+  while (end - p >= 32) {
+    __m256i block = _mm256_loadu_si256((const __m256i *) p);
+    __m256i hits = _mm256_or_si256(_mm256_cmpeq_epi8(block, cr),
+                                   _mm256_cmpeq_epi8(block, lf));
+    unsigned mask = (unsigned) _mm256_movemask_epi8(hits);
+    if (mask != 0) {
+      return p + __builtin_ctz(mask);
+    }
+    p += 32;
+  }
+  return lineEndScalar(p, end);
+}
+
+__attribute__((target("avx2")))
+static const char *urlEndAvx2(const char *p, const char *end) {
+  const __m256i space = _mm256_set1_epi8(' ');
+  const __m256i del = _mm256_set1_epi8(0x7f);
+  const __m256i hash = _mm256_set1_epi8('#');
+  while (end - p >= 32) {
+    __m256i block = _mm256_loadu_si256((const __m256i *) p);
+    // unsigned b <= ' ' is min(b, ' ') == b, b >= DEL is max(b, DEL) == b
+    __m256i low = _mm256_cmpeq_epi8(_mm256_min_epu8(block, space), block);
+    __m256i high = _mm256_cmpeq_epi8(_mm256_max_epu8(block, del), block);
+    __m256i hits = _mm256_or_si256(_mm256_or_si256(low, high),
+                                   _mm256_cmpeq_epi8(block, hash));
+    unsigned mask = (unsigned) _mm256_movemask_epi8(hits);
+    if (mask != 0) {
+      return p + __builtin_ctz(mask);
+    }
+    p += 32;
+  }
+  return urlEndScalar(p, end);
+}
+
+#endif
+
+struct Scanners {
+  FastRequestParser::Isa isa;
+  const char *(*lineEnd)(const char *p, const char *end);
+  const char *(*urlEnd)(const char *p, const char *end);
+};
+
+static bool supported(FastRequestParser::Isa isa) {
+#ifdef HAVE_X86_SCANNERS
+  if (isa == FastRequestParser::AVX2) {
+    return __builtin_cpu_supports("avx2");
+  }
+  if (isa == FastRequestParser::SSE42) {
+    return __builtin_cpu_supports("sse4.2");
+  }
+#endif
+  return isa == FastRequestParser::SCALAR;
+}
+
+static Scanners scannersFor(FastRequestParser::Isa isa) {
+  Scanners scanners = {FastRequestParser::SCALAR, lineEndScalar,
+                       urlEndScalar};
+#ifdef HAVE_X86_SCANNERS
+  if (isa == FastRequestParser::AVX2) {
+    scanners.isa = isa;
+    scanners.lineEnd = lineEndAvx2;
+    scanners.urlEnd = urlEndAvx2;
+  } else if (isa == FastRequestParser::SSE42) {
+    scanners.isa = isa;
+    scanners.lineEnd = lineEndSse42;
+    scanners.urlEnd = urlEndSse42;
+  }
+#endif
+  return scanners;
+}
+
+static Scanners &scanners() {
+  // the best the CPU has, decided once
+  static Scanners chosen = scannersFor(
+    supported(FastRequestParser::AVX2) ? FastRequestParser::AVX2 :
+    supported(FastRequestParser::SSE42) ? FastRequestParser::SSE42 :
+    FastRequestParser::SCALAR);
+  return chosen;
+}
+
+FastRequestParser::Isa FastRequestParser::getIsa() {
+  return scanners().isa;
+}
+
+bool FastRequestParser::setIsa(Isa isa) {
+  if (!supported(isa)) {
+    return false;
+  }
+  scanners() = scannersFor(isa);
+  return true;
+}
+
+const char *FastRequestParser::isaName(Isa isa) {
+  switch (isa) {
+  case AVX2:
+    return "avx2";
+  case SSE42:
+    return "sse4.2";
+  default:
+    return "scalar";
+  }
+}
+
+/****************************************************************************/
+
+size_t FastRequestParser::findEnd(string_view head, const char *data,
+                                  size_t len) {
+  // the head ends at an empty line, a '\n' right after "\n" or "\n\r",
+  // and the two bytes before data may still be in head
+  const char *p = data;
+  const char *end = data + len;
+  while ((p = (const char *) memchr(p, '\n', end - p)) != NULL) {
+    size_t at = p - data;
+    char before = at >= 1 ? data[at - 1] :
+                  head.size() >= 1 ? head[head.size() - 1] : 0;
+    char twoBefore = at >= 2 ? data[at - 2] :
+                     head.size() + at >= 2 ? head[head.size() + at - 2] : 0;
+    if (before == '\n' || (before == '\r' && twoBefore == '\n')) {
+      return at + 1;
+    }
+    p++;
+  }
+  return string_view::npos;
+}
+
+// header names we have to act on, lower case
+static bool nameIs(string_view name, const char *lower, size_t len) {
+  if (name.size() != len) {
+    return false;
+  }
+  for (size_t idx = 0; idx < len; idx++) {
+    if ((name[idx] | 0x20) != lower[idx]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// the value as http_parser sees it, without trailing spaces, and whether
+// it has only the characters its matchers look at
+static string_view connectionValue(string_view value, bool &plain) {
+  while (!value.empty() && value.back() == ' ') {
+    value.remove_suffix(1);
+  }
+  plain = true;
+  for (size_t idx = 0; idx < value.size(); idx++) {
+    char c = value[idx];
+    if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+          (c >= '0' && c <= '9') || c == '-' || c == '_' || c == ' ')) {
+      plain = false;
+    }
+  }
+  return value;
+}
+
+FastRequestParser::Result FastRequestParser::parse(string_view head,
+                                                   Head &out,
+                                                   HttpHeader *headers,
+                                                   size_t capacity) {
+  const Scanners &scan = scanners();
+  const char *p = head.data();
+  const char *end = head.data() + head.size();
+
+  // method, only the ones HTTP serves
+  const char *space = (const char *) memchr(p, ' ', end - p);
+  if (space == NULL) {
+    return UNSUPPORTED;
+  }
+  string_view method(p, space - p);
+  if (method == "GET") {
+    out.method = HTTP_GET;
+  } else if (method == "HEAD") {
+    out.method = HTTP_HEAD;
+  } else if (method == "POST") {
+    out.method = HTTP_POST;
+  } else if (method == "PUT") {
+    out.method = HTTP_PUT;
+  } else if (method == "DELETE") {
+    out.method = HTTP_DELETE;
+  } else {
+    return UNSUPPORTED;
+  }
+
+  // an origin-form URL, path and query split at the first '?'
+  p = space + 1;
+  if (p == end || *p != '/') {
+    return UNSUPPORTED;
+  }
+  const char *urlEnd = scan.urlEnd(p, end);
+  if (urlEnd == end || *urlEnd != ' ') {
+    return UNSUPPORTED;
+  }
+  out.url = string_view(p, urlEnd - p);
+  size_t question = out.url.find('?');
+  if (question == string_view::npos) {
+    out.path = out.url;
+    out.query = string_view();
+  } else {
+    out.path = out.url.substr(0, question);
+    // http_parser skips '?'s right after the first one
+    size_t start = out.url.find_first_not_of('?', question);
+    out.query = start == string_view::npos ? string_view() :
+                out.url.substr(start);
+  }
+
+  // "HTTP/1.1" and the line end
+  p = urlEnd + 1;
+  if (end - p < 9 || memcmp(p, "HTTP/", 5) != 0 || p[5] < '1' ||
+      p[5] > '9' || p[6] != '.' || p[7] < '0' || p[7] > '9') {
+    return UNSUPPORTED;
+  }
+  out.httpMajor = p[5] - '0';
+  out.httpMinor = p[7] - '0';
+  p += 8;
+  if (*p == '\r' && p[1] == '\n') {
+    p += 2;
+  } else if (*p == '\n') {
+    p++;
+  } else {
+    return UNSUPPORTED;
+  }
+
+  out.contentLength = -1;
+  out.headerCount = 0;
+  bool keepAlive = false;
+  bool close = false;
+  while (true) {
+    if (p == end) {
+      return UNSUPPORTED;
+    }
+    // the empty line, and findEnd made it the last one
+    if (*p == '\n' || (*p == '\r' && end - p >= 2 && p[1] == '\n')) {
+      break;
+    }
+
+    const char *name = p;
+    while (p < end && tokenChars[(unsigned char) *p]) {
+      p++;
+    }
+    if (p == name || p == end || *p != ':') {
+      return UNSUPPORTED;
+    }
+    string_view field(name, p - name);
+    p++;
+    while (p < end && *p == ' ') {
+      p++;
+    }
+    const char *lineEnd = scan.lineEnd(p, end);
+    if (lineEnd == end) {
+      return UNSUPPORTED;
+    }
+    string_view value(p, lineEnd - p);
+    if (*lineEnd == '\r') {
+      // a CR on its own ends the value too, as http_parser reads it
+      if (end - lineEnd < 2 || lineEnd[1] != '\n') {
+        return UNSUPPORTED;
+      }
+      p = lineEnd + 2;
+    } else {
+      p = lineEnd + 1;
+    }
+
+    // the headers http_parser acts on, if they are anything but plain
+    // the replay through it works out what they mean
+    if (nameIs(field, "content-length", 14)) {
+      if (out.contentLength >= 0 || value.empty() || value.size() > 18) {
+        return UNSUPPORTED;
+      }
+      int64_t length = 0;
+      for (size_t idx = 0; idx < value.size(); idx++) {
+        if (value[idx] < '0' || value[idx] > '9') {
+          return UNSUPPORTED;
+        }
+        length = length * 10 + (value[idx] - '0');
+      }
+      out.contentLength = length;
+    } else if (nameIs(field, "connection", 10) ||
+               nameIs(field, "proxy-connection", 16)) {
+      bool plain;
+      string_view token = connectionValue(value, plain);
+      if (!plain) {
+        return UNSUPPORTED;
+      }
+      keepAlive |= nameIs(token, "keep-alive", 10);
+      close |= nameIs(token, "close", 5);
+    } else if (nameIs(field, "transfer-encoding", 17) ||
+               nameIs(field, "upgrade", 7)) {
+      return UNSUPPORTED;
+    }
+
+    if (out.headerCount == capacity) {
+      return NO_ROOM;
+    }
+    headers[out.headerCount].name = field;
+    headers[out.headerCount].value = value;
+    out.headerCount++;
+  }
+
+  // http_should_keep_alive's rules
+  if (out.httpMajor > 0 && out.httpMinor > 0) {
+    out.keepAlive = !close;
+  } else {
+    out.keepAlive = keepAlive;
+  }
+  return PARSED;
+}
@@ -1,18 +1,30 @@
 #include <errno.h>
+#include <ctype.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <iostream>
 #include <map>
 #include <string>
+#include <vector>
 
 #include "FileService.h"
+#include "StringUtils.h"
 
 using namespace std;
 
-FileService::FileService(string basedir) : HttpService("/") {
+// smaller files do not gain enough to be worth the gzip header and trailer
+#define MIN_GZIP_BYTES 256
+
+FileService::FileService(string basedir, ContentCache *cache,
+                         GzipCache *gzip)
+    : HttpService("/") {
   while (endswith(basedir, "/")) {
     basedir = basedir.substr(0, basedir.length() - 1);
   }
@@ -23,6 +35,8 @@ FileService::FileService(string basedir) : HttpService("/") {
   }
 
   this->m_basedir = basedir;
+  this->m_cache = cache;
+  this->m_gzip = gzip;
 }
 
 FileService::~FileService() {}
@@ -32,53 +46,526 @@ bool FileService::endswith(string str, string suffix) {
   return pos == (str.length() - suffix.length());
 }
 
+string FileService::contentType(string path) {
+  if (this->endswith(path, ".css")) {
+    return "text/css";
+  } else if (this->endswith(path, ".js")) {
+    return "text/javascript";
+  }
+  return "text/html; charset=ISO-8859-1";
+}
+
+bool FileService::compressible(string path, off_t size) {
+  // text, the rest is usually compressed already
+  const char *types[] = {".html", ".htm", ".css", ".js", ".txt", ".json",
+                         ".svg", ".xml"};
+  if (size < MIN_GZIP_BYTES) {
+    return false;
+  }
+  for (size_t idx = 0; idx < sizeof(types) / sizeof(types[0]); idx++) {
+    if (this->endswith(path, types[idx])) {
+      return true;
+    }
+  }
+  return false;
+}
+
+string FileService::etag(const struct stat &st) {
+  // changes whenever the file is rewritten or replaced, like nginx's
+  char tag[96];
+  unsigned long long mtime =
+    (unsigned long long) st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+  snprintf(tag, sizeof(tag), "\"%llx-%llx-%llx\"",
+           (unsigned long long) st.st_ino, mtime,
+           (unsigned long long) st.st_size);
+  return tag;
+}
+
+string FileService::httpDate(time_t when) {
+  struct tm tm;
+  char date[64];
+  gmtime_r(&when, &tm);
+  strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  return date;
+}
+
+static string trim(const string &value) {
+  size_t start = value.find_first_not_of(" \t");
+  if (start == string::npos) {
+    return "";
+  }
+  size_t end = value.find_last_not_of(" \t");
+  return value.substr(start, end - start + 1);
+}
+
+string FileService::gzipEtag(const string &etag) {
+  // each encoding needs a tag of its own, "x" becomes "x-gz"
+  return etag.substr(0, etag.length() - 1) + "-gz\"";
+}
+
+bool FileService::acceptsGzip(HTTPRequest *request) {
+  // "gzip, deflate, br" or "gzip;q=0.8, *;q=0.1". gzip;q=0 and a bare *
+  // count as you would expect
+  vector<string> codings =
+    StringUtils::split(string(request->getHeader("Accept-Encoding")), ',');
+  bool star = false;
+  for (size_t idx = 0; idx < codings.size(); idx++) {
+    string coding = trim(codings[idx]);
+    double quality = 1;
+    size_t semicolon = coding.find(';');
+    if (semicolon != string::npos) {
+      size_t q = coding.find("q=", semicolon);
+      if (q != string::npos) {
+        quality = atof(coding.c_str() + q + 2);
+      }
+      coding = trim(coding.substr(0, semicolon));
+    }
+    if (strcasecmp(coding.c_str(), "gzip") == 0 ||
+        strcasecmp(coding.c_str(), "x-gzip") == 0) {
+      return quality > 0;
+    }
+    if (coding == "*") {
+      star = quality > 0;
+    }
+  }
+  return star;
+}
+
+bool FileService::notModified(HTTPRequest *request, const string &etag,
+                              time_t modified) {
+  // If-None-Match wins, If-Modified-Since only counts without it
+  string match(request->getHeader("If-None-Match"));
+  if (!match.empty()) {
+    vector<string> tags = StringUtils::split(match, ',');
+    for (size_t idx = 0; idx < tags.size(); idx++) {
+      string tag = trim(tags[idx]);
+      // weak comparison, W/"x" matches "x"
+      if (tag.compare(0, 2, "W/") == 0) {
+        tag = tag.substr(2);
+      }
+      if (tag == "*" || tag == etag) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  string since(request->getHeader("If-Modified-Since"));
+  if (since.empty()) {
+    return false;
+  }
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  const char *end = strptime(since.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  if (end == NULL || *end != '\0') {
+    // not a date we understand, send the file
+    return false;
+  }
+  return modified <= timegm(&tm);
+}
+
+void FileService::setNotModified(HTTPResponse *response, const string &etag,
+                                 const string &lastModified) {
+  response->setStatus(304);
+  response->setHeader("ETag", etag);
+  response->setHeader("Last-Modified", lastModified);
+}
+
 void FileService::get(HTTPRequest *request, HTTPResponse *response) {
   string path = this->m_basedir + request->getPath();
   if (path.find("..") != string::npos) {
     response->setStatus(403);
     return;
   }
-  string fileContents = this->readFile(path);
-  if (fileContents.size() == 0) {
+
+  // the cache only has whole files, and ranges are always of the file
+  // as it is
+  string range(request->getHeader("Range"));
+  bool gzip = range.empty() && acceptsGzip(request);
+  if (m_cache != NULL && range.empty() &&
+      getCached(request, path, response, gzip)) {
+    return;
+  }
+
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    response->setStatus(errno == EACCES ? 403 : 404);
+    return;
+  }
+  // directories and such were always a 404
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
     response->setStatus(404);
+    close(fd);
     return;
-  } else if (fileContents[0] == static_cast<char>(0)) {
-    response->setStatus(403);
+  }
+
+  bool negotiated = compressible(path, st.st_size);
+  if (negotiated) {
+    response->setHeader("Vary", "Accept-Encoding");
+  }
+  if (negotiated && gzip && getGzip(request, path, fd, st, response)) {
+    close(fd);
     return;
+  }
+
+  string tag = etag(st);
+  string lastModified = httpDate(st.st_mtime);
+  if (notModified(request, tag, st.st_mtime)) {
+    setNotModified(response, tag, lastModified);
+    close(fd);
+    return;
+  }
+
+  response->setContentType(contentType(path));
+  response->setHeader("Accept-Ranges", "bytes");
+  response->setHeader("ETag", tag);
+  response->setHeader("Last-Modified", lastModified);
+
+  off_t start = 0;
+  off_t length = st.st_size;
+  if (!range.empty()) {
+    int result = parseRange(range, st.st_size, start, length);
+    if (result == RANGE_UNSATISFIABLE) {
+      response->setStatus(416);
+      response->setHeader("Content-Range",
+                          "bytes */" + to_string(st.st_size));
+      close(fd);
+      return;
+    } else if (result == RANGE_PARTIAL) {
+      response->setStatus(206);
+      response->setHeader("Content-Range",
+                          "bytes " + to_string(start) + "-" +
+                          to_string(start + length - 1) + "/" +
+                          to_string(st.st_size));
+    }
+  }
+
+  response->setFileBody(fd, start, length);
+}
+
+bool FileService::getGzip(HTTPRequest *request, const string &path, int fd,
+                          const struct stat &st, HTTPResponse *response) {
+  // HEAD passes no fd, it only needs the length
+  bool head = fd < 0;
+
+  // a .gz next to the file wins, it was made ahead of time and probably
+  // with more effort than we would spend
+  string gzPath = path + ".gz";
+  struct stat gzst;
+  int gzfd = -1;
+  bool sibling;
+  if (head) {
+    sibling = stat(gzPath.c_str(), &gzst) == 0 && S_ISREG(gzst.st_mode);
   } else {
-    if (this->endswith(path, ".css")) {
-      response->setContentType("text/css");
-    } else if (this->endswith(path, ".js")) {
-      response->setContentType("text/javascript");
+    gzfd = open(gzPath.c_str(), O_RDONLY | O_CLOEXEC);
+    sibling = gzfd >= 0 && fstat(gzfd, &gzst) == 0 && S_ISREG(gzst.st_mode);
+    if (!sibling && gzfd >= 0) {
+      close(gzfd);
+      gzfd = -1;
     }
-    response->setBody(fileContents);
   }
+  if (!sibling && m_gzip == NULL) {
+    return false;
+  }
+
+  // a sibling is a file with validators of its own, what we compress
+  // takes the original's
+  string tag = sibling ? etag(gzst) : gzipEtag(etag(st));
+  time_t modified = sibling ? gzst.st_mtime : st.st_mtime;
+  if (notModified(request, tag, modified)) {
+    if (gzfd >= 0) {
+      close(gzfd);
+    }
+    setNotModified(response, tag, httpDate(modified));
+    return true;
+  }
+
+  // HEAD does not compress, so until get() has the length is not known
+  // and the response is described the way a streamed one goes out
+  size_t length = sibling ? gzst.st_size : 0;
+  bool unknown = !sibling && head && !m_gzip->find(path, st, length);
+  GzipSource *source = NULL;
+  if (!sibling && !head) {
+    gzfd = m_gzip->get(path, fd, st, length);
+    if (gzfd < 0) {
+      // too big to keep, compress it on the way out instead
+      int copy = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+      if (copy < 0) {
+        return false;
+      }
+      source = new GzipSource(copy, st.st_size);
+    }
+  }
+
+  response->setContentType(contentType(path));
+  response->setHeader("Content-Encoding", "gzip");
+  response->setHeader("ETag", tag);
+  response->setHeader("Last-Modified", httpDate(modified));
+  if (head && unknown) {
+    response->withStreaming();
+    response->omitBody();
+  } else if (head) {
+    response->omitBody(length);
+  } else if (source != NULL) {
+    response->setBodySource(source);
+  } else {
+    response->setFileBody(gzfd, 0, length);
+  }
+  return true;
 }
 
-string FileService::readFile(string path) {
-  int fd = open(path.c_str(), O_RDONLY);
+bool FileService::getCached(HTTPRequest *request, string path,
+                            HTTPResponse *response, bool gzip) {
+  string key = ContentCache::normalize(path);
+  shared_ptr<const CachedFile> file = m_cache->lookup(key);
+  if (!file) {
+    file = loadFile(key);
+  }
+  if (!file) {
+    return false;
+  }
+
+  if (file->missing) {
+    response->setStatus(404);
+    return true;
+  }
+
+  if (file->negotiated) {
+    response->setHeader("Vary", "Accept-Encoding");
+  }
+  bool useGzip = gzip && file->gzipContent;
+  const string &tag = useGzip ? file->gzipEtag : file->etag;
+  if (notModified(request, tag, file->modified)) {
+    setNotModified(response, tag, file->lastModified);
+  } else {
+    response->setSharedBody(useGzip ? file->gzipContent : file->content);
+  }
+  return true;
+}
+
+// reads size bytes from the start of fd into out
+static bool readAll(int fd, size_t size, string &out) {
+  out.resize(size);
+  size_t done = 0;
+  while (done < size) {
+    ssize_t ret = pread(fd, &out[done], size - done, done);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      // it shrank while we read it
+      return false;
+    }
+    done += ret;
+  }
+  return true;
+}
+
+shared_ptr<const CachedFile> FileService::loadFile(string path) {
+  // before touching the file, see ContentCache::generation
+  unsigned long generation = m_cache->generation();
+  shared_ptr<CachedFile> file = make_shared<CachedFile>();
+  file->missing = true;
+  file->negotiated = false;
+
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
   if (fd < 0) {
-    if (errno == EACCES || errno == EISDIR) {
-      return string(1, static_cast<char>(0));
-    } else {
-      return "";
+    if (errno != ENOENT && errno != ENOTDIR) {
+      // e.g. a 403, let get() sort it out
+      return NULL;
     }
+    m_cache->insert(path, file, generation);
+    return file;
   }
 
-  string result;
-  int ret;
-  char buffer[4096];
-  while ((ret = read(fd, buffer, sizeof(buffer))) > 0) {
-    result.append(buffer, ret);
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return NULL;
+  }
+  if (!S_ISREG(st.st_mode)) {
+    close(fd);
+    m_cache->insert(path, file, generation);
+    return file;
+  }
+  if ((size_t) st.st_size > m_cache->maxFileBytes()) {
+    // large files go out with sendfile
+    close(fd);
+    return NULL;
   }
 
+  shared_ptr<SharedBody> content = make_shared<SharedBody>();
+  if (!readAll(fd, st.st_size, content->body)) {
+    // inotify will tell us soon
+    close(fd);
+    return NULL;
+  }
   close(fd);
 
-  return result;
+  file->etag = etag(st);
+  file->lastModified = httpDate(st.st_mtime);
+  file->modified = st.st_mtime;
+  content->headers = "Content-Type: " + contentType(path) + "\r\n" +
+                     "Content-Length: " + to_string(st.st_size) + "\r\n" +
+                     "Accept-Ranges: bytes\r\n" +
+                     "ETag: " + file->etag + "\r\n" +
+                     "Last-Modified: " + file->lastModified + "\r\n";
+  file->missing = false;
+  file->content = content;
+  file->negotiated = compressible(path, st.st_size);
+  if (file->negotiated) {
+    loadGzip(path, file);
+  }
+  m_cache->insert(path, file, generation);
+  return file;
+}
+
+void FileService::loadGzip(string path, shared_ptr<CachedFile> file) {
+  shared_ptr<SharedBody> content = make_shared<SharedBody>();
+  string tag;
+  time_t modified = file->modified;
+
+  // a .gz next to the file first, like getGzip
+  struct stat st;
+  int fd = open((path + ".gz").c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+      (size_t) st.st_size <= m_cache->maxFileBytes() &&
+      readAll(fd, st.st_size, content->body)) {
+    tag = etag(st);
+    modified = st.st_mtime;
+  } else if (GzipCache::compress(file->content->body, content->body) &&
+             content->body.length() < file->content->body.length()) {
+    tag = gzipEtag(file->etag);
+  } else {
+    // no use, everyone gets the file as it is
+    content->body.clear();
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (tag.empty()) {
+    return;
+  }
+
+  content->headers = "Content-Type: " + contentType(path) + "\r\n" +
+                     "Content-Length: " +
+                     to_string(content->body.length()) + "\r\n" +
+                     "Content-Encoding: gzip\r\n" +
+                     "ETag: " + tag + "\r\n" +
+                     "Last-Modified: " + httpDate(modified) + "\r\n";
+  file->gzipEtag = tag;
+  file->gzipContent = content;
+}
+
+// parses a whole number, at most 18 digits so it cannot overflow
+static bool parseOffset(const string &digits, off_t &value) {
+  if (digits.empty() || digits.length() > 18) {
+    return false;
+  }
+  value = 0;
+  for (size_t idx = 0; idx < digits.length(); idx++) {
+    if (!isdigit((unsigned char) digits[idx])) {
+      return false;
+    }
+    value = value * 10 + (digits[idx] - '0');
+  }
+  return true;
+}
+
+int FileService::parseRange(string value, off_t size, off_t &start,
+                            off_t &length) {
+  // a single "bytes=first-last", "bytes=first-" or "bytes=-suffix", we
+  // are allowed to ignore anything else and send the whole file
+  if (value.compare(0, 6, "bytes=") != 0) {
+    return RANGE_IGNORED;
+  }
+  string spec = value.substr(6);
+  size_t dash = spec.find('-');
+  if (dash == string::npos || spec.find(',') != string::npos) {
+    return RANGE_IGNORED;
+  }
+  string first = spec.substr(0, dash);
+  string last = spec.substr(dash + 1);
+
+  off_t from, to;
+  if (first.empty()) {
+    off_t suffix;
+    if (!parseOffset(last, suffix)) {
+      return RANGE_IGNORED;
+    }
+    if (suffix == 0 || size == 0) {
+      return RANGE_UNSATISFIABLE;
+    }
+    from = suffix < size ? size - suffix : 0;
+    to = size - 1;
+  } else {
+    if (!parseOffset(first, from)) {
+      return RANGE_IGNORED;
+    }
+    if (last.empty()) {
+      to = size - 1;
+    } else if (!parseOffset(last, to) || to < from) {
+      return RANGE_IGNORED;
+    }
+    if (from >= size) {
+      return RANGE_UNSATISFIABLE;
+    }
+    if (to >= size) {
+      to = size - 1;
+    }
+  }
+
+  start = from;
+  length = to - from + 1;
+  return RANGE_PARTIAL;
 }
 
 void FileService::head(HTTPRequest *request, HTTPResponse *response) {
-  // HEAD is the same as get but with no body
-  this->get(request, response);
-  response->setBody("");
+  // the same headers as get. Range is only for GET, so HEAD always
+  // describes the whole file. Small files are loaded into the cache like
+  // get would, that settles whether they have a gzip encoding, larger
+  // ones are answered from one stat without opening the file
+  string path = this->m_basedir + request->getPath();
+  if (path.find("..") != string::npos) {
+    response->setStatus(403);
+    return;
+  }
+
+  bool gzip = acceptsGzip(request);
+  if (m_cache != NULL && getCached(request, path, response, gzip)) {
+    response->omitBody();
+    return;
+  }
+
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) {
+    response->setStatus(errno == EACCES ? 403 : 404);
+    return;
+  }
+  if (!S_ISREG(st.st_mode)) {
+    response->setStatus(404);
+    return;
+  }
+
+  bool negotiated = compressible(path, st.st_size);
+  if (negotiated) {
+    response->setHeader("Vary", "Accept-Encoding");
+  }
+  if (negotiated && gzip && getGzip(request, path, -1, st, response)) {
+    return;
+  }
+
+  string tag = etag(st);
+  string lastModified = httpDate(st.st_mtime);
+  if (notModified(request, tag, st.st_mtime)) {
+    setNotModified(response, tag, lastModified);
+    return;
+  }
+
+  response->setContentType(contentType(path));
+  response->setHeader("Accept-Ranges", "bytes");
+  response->setHeader("ETag", tag);
+  response->setHeader("Last-Modified", lastModified);
+  response->omitBody(st.st_size);
 }
@@ -0,0 +1,266 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "GzipCache.h"
+#include "dthread.h"
+
+using namespace std;
+
+// what gzip -6 does, a fair trade of time for size
+#define GZIP_LEVEL 6
+// 15 bits of window plus 16 asks zlib for a gzip header and trailer
+#define GZIP_WINDOW (15 + 16)
+#define CHUNK_BYTES (64 * 1024)
+
+GzipCache::GzipCache(size_t budget) {
+  m_budget = budget;
+  m_bytes = 0;
+  pthread_mutex_init(&m_mutex, NULL);
+}
+
+bool GzipCache::current(const Entry &entry, const struct stat &st) {
+  return entry.dev == st.st_dev && entry.ino == st.st_ino &&
+         entry.size == st.st_size &&
+         entry.mtime.tv_sec == st.st_mtim.tv_sec &&
+         entry.mtime.tv_nsec == st.st_mtim.tv_nsec;
+}
+
+void GzipCache::remove(EntryIter entry) {
+  // requests still sending it have their own descriptor
+  if (entry->fd >= 0) {
+    close(entry->fd);
+  }
+  m_bytes -= entry->length;
+  m_index.erase(entry->path);
+  m_lru.erase(entry);
+}
+
+bool GzipCache::find(const string &path, const struct stat &st,
+                     size_t &length) {
+  bool found = false;
+  dthread_mutex_lock(&m_mutex);
+  unordered_map<string, EntryIter>::iterator entry = m_index.find(path);
+  if (entry != m_index.end() && current(*entry->second, st) &&
+      entry->second->fd >= 0) {
+    length = entry->second->length;
+    found = true;
+  }
+  dthread_mutex_unlock(&m_mutex);
+  return found;
+}
+
+int GzipCache::get(const string &path, int fd, const struct stat &st,
+                   size_t &length) {
+  dthread_mutex_lock(&m_mutex);
+  unordered_map<string, EntryIter>::iterator found = m_index.find(path);
+  if (found != m_index.end() && current(*found->second, st)) {
+    EntryIter entry = found->second;
+    m_lru.splice(m_lru.begin(), m_lru, entry);
+    // dup under the lock, eviction may close the original right after
+    int copy = entry->fd < 0 ? -1 : fcntl(entry->fd, F_DUPFD_CLOEXEC, 0);
+    length = entry->length;
+    dthread_mutex_unlock(&m_mutex);
+    return copy;
+  }
+  dthread_mutex_unlock(&m_mutex);
+
+  // compressed without the lock, two threads asking for the same new
+  // file both do the work and the last one in wins. A file that did not
+  // fit is remembered too, so it is not tried again until it changes
+  int compressed = compressFile(fd, st.st_size, length);
+  int copy = -1;
+  if (compressed >= 0) {
+    copy = fcntl(compressed, F_DUPFD_CLOEXEC, 0);
+  } else {
+    length = 0;
+  }
+
+  Entry entry;
+  entry.path = path;
+  entry.dev = st.st_dev;
+  entry.ino = st.st_ino;
+  entry.size = st.st_size;
+  entry.mtime = st.st_mtim;
+  entry.fd = compressed;
+  entry.length = length;
+
+  dthread_mutex_lock(&m_mutex);
+  found = m_index.find(path);
+  if (found != m_index.end()) {
+    remove(found->second);
+  }
+  m_lru.push_front(entry);
+  m_index[path] = m_lru.begin();
+  m_bytes += length;
+  while (m_bytes > m_budget) {
+    remove(--m_lru.end());
+  }
+  dthread_mutex_unlock(&m_mutex);
+  return copy;
+}
+
+int GzipCache::compressFile(int fd, off_t size, size_t &length) {
+  // one entry may take a quarter of the budget
+  size_t limit = m_budget / 4;
+  if ((size_t) size / 16 > limit) {
+    // not going to fit even if it compresses very well
+    return -1;
+  }
+
+  int out = memfd_create("gzip", MFD_CLOEXEC);
+  if (out < 0) {
+    return -1;
+  }
+
+  z_stream stream;
+  stream.zalloc = Z_NULL;
+  stream.zfree = Z_NULL;
+  stream.opaque = Z_NULL;
+  if (deflateInit2(&stream, GZIP_LEVEL, Z_DEFLATED, GZIP_WINDOW, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    close(out);
+    return -1;
+  }
+
+  vector<unsigned char> input(CHUNK_BYTES);
+  vector<unsigned char> output(CHUNK_BYTES);
+  off_t offset = 0;
+  length = 0;
+  bool ok = true;
+  int flush = Z_NO_FLUSH;
+  while (ok && flush != Z_FINISH) {
+    ssize_t got = pread(fd, input.data(), input.size(), offset);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got < 0) {
+      ok = false;
+      break;
+    }
+    offset += got;
+    // a file that changes under us gets a new stat, so the entry is
+    // redone on the next request whatever we end up with here
+    flush = got == 0 || offset >= size ? Z_FINISH : Z_NO_FLUSH;
+
+    stream.next_in = input.data();
+    stream.avail_in = got;
+    do {
+      stream.next_out = output.data();
+      stream.avail_out = output.size();
+      deflate(&stream, flush);
+      size_t produced = output.size() - stream.avail_out;
+      length += produced;
+      if (length > limit) {
+        ok = false;
+        break;
+      }
+      size_t written = 0;
+      while (written < produced) {
+        ssize_t ret = write(out, output.data() + written, produced - written);
+        if (ret < 0 && errno == EINTR) {
+          continue;
+        }
+        if (ret < 0) {
+          ok = false;
+          break;
+        }
+        written += ret;
+      }
+    } while (ok && stream.avail_out == 0);
+  }
+  deflateEnd(&stream);
+
+  if (!ok) {
+    close(out);
+    return -1;
+  }
+  return out;
+}
+
+GzipSource::GzipSource(int fd, off_t size) : m_input(CHUNK_BYTES) {
+  m_fd = fd;
+  m_size = size;
+  m_offset = 0;
+  m_finished = false;
+  m_stream.zalloc = Z_NULL;
+  m_stream.zfree = Z_NULL;
+  m_stream.opaque = Z_NULL;
+  m_stream.avail_in = 0;
+  m_ready = deflateInit2(&m_stream, GZIP_LEVEL, Z_DEFLATED, GZIP_WINDOW, 8,
+                         Z_DEFAULT_STRATEGY) == Z_OK;
+}
+
+GzipSource::~GzipSource() {
+  if (m_ready) {
+    deflateEnd(&m_stream);
+  }
+  close(m_fd);
+}
+
+ssize_t GzipSource::read(char *buffer, size_t size) {
+  if (!m_ready) {
+    return -1;
+  }
+  if (m_finished) {
+    return 0;
+  }
+
+  m_stream.next_out = (Bytef *) buffer;
+  m_stream.avail_out = size;
+  // deflate holds on to input until it has a block, feed it until some
+  // output comes out or the stream ends
+  while (m_stream.avail_out == size) {
+    if (m_stream.avail_in == 0 && m_offset < m_size) {
+      size_t want = min((off_t) m_input.size(), m_size - m_offset);
+      ssize_t got = pread(m_fd, m_input.data(), want, m_offset);
+      if (got < 0 && errno == EINTR) {
+        continue;
+      }
+      if (got <= 0) {
+        // it shrank, the body cannot be finished
+        return -1;
+      }
+      m_offset += got;
+      m_stream.next_in = m_input.data();
+      m_stream.avail_in = got;
+    }
+
+    bool last = m_offset >= m_size && m_stream.avail_in == 0;
+    int ret = deflate(&m_stream, last ? Z_FINISH : Z_NO_FLUSH);
+    if (ret == Z_STREAM_END) {
+      m_finished = true;
+      break;
+    }
+    if (ret != Z_OK && ret != Z_BUF_ERROR) {
+      return -1;
+    }
+  }
+  return size - m_stream.avail_out;
+}
+
+bool GzipCache::compress(const string &in, string &out) {
+  z_stream stream;
+  stream.zalloc = Z_NULL;
+  stream.zfree = Z_NULL;
+  stream.opaque = Z_NULL;
+  if (deflateInit2(&stream, GZIP_LEVEL, Z_DEFLATED, GZIP_WINDOW, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    return false;
+  }
+
+  out.resize(deflateBound(&stream, in.length()));
+  stream.next_in = (Bytef *) in.data();
+  stream.avail_in = in.length();
+  stream.next_out = (Bytef *) &out[0];
+  stream.avail_out = out.length();
+  int ret = deflate(&stream, Z_FINISH);
+  out.resize(out.length() - stream.avail_out);
+  deflateEnd(&stream);
+  return ret == Z_STREAM_END;
+}
@@ -1,13 +1,50 @@
 #include "HTTP.h"
 
+#include <algorithm>
 #include <iostream>
 #include <string>
 
 #include <assert.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+
+#include "FastRequestParser.h"
 
 using namespace std;
 
+static HTTP::Engine engine = (HTTP::Engine) HTTP_ENGINE;
+
+// header names are ASCII and compared without regard to case
+static inline char lowerAscii(char c)
+{
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+static bool sameName(string_view a, string_view b)
+{
+    if(a.size() != b.size()) {
+        return false;
+    }
+    for(size_t idx = 0; idx < a.size(); idx++) {
+        if(lowerAscii(a[idx]) != lowerAscii(b[idx])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// FNV-1a over the lower case name
+static size_t nameHash(string_view name)
+{
+    uint32_t hash = 2166136261u;
+    for(size_t idx = 0; idx < name.size(); idx++) {
+        hash ^= (unsigned char) lowerAscii(name[idx]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
 
 /***************************** HTTP Parser callbacks ************************/
 
@@ -22,13 +59,13 @@ int HTTP::message_begin_cb(http_parser *parser)
 int HTTP::path_cb(http_parser *parser, const char *at, size_t length)
 {
     HTTP *http = (HTTP *) parser->data;
-    http->m_path.append(at, length);
+    http->m_path = http->m_arena.append(http->m_path, at, length);
     return 0;
 }
 int HTTP::query_string_cb(http_parser *parser, const char *at, size_t length)
 {
     HTTP *http = (HTTP *) parser->data;
-    http->m_query.append(at, length);
+    http->m_query = http->m_arena.append(http->m_query, at, length);
     return 0;
 }
 
@@ -80,6 +117,8 @@ int HTTP::headers_complete_cb(http_parser *parser)
     HTTP *http = (HTTP *) parser->data;
     http->addHeaderField();
     http->m_headerDone = true;
+    http->m_httpMajor = parser->http_major;
+    http->m_httpMinor = parser->http_minor;
 
     if(http->m_httpType == HTTP_RESPONSE) {
         char buf[64];
@@ -127,10 +166,21 @@ int HTTP::body_cb(http_parser *parser, const char *at, size_t length)
 int HTTP::message_complete_cb(http_parser *parser)
 {
     HTTP *http = (HTTP *) parser->data;
+    // HEADER when the request had no header lines at all (HTTP/1.0)
     assert((http->getState() == HTTP::VALUE) || 
+           (http->getState() == HTTP::HEADER) ||
            (http->getState() == HTTP::BODY));
     http->setState(HTTP::DONE);
     http->messageComplete(parser->method);
+
+    if(http->m_httpType == HTTP_REQUEST) {
+        // Stop at the end of this message so that pipelined bytes are
+        // left for the next request on the connection. The parser
+        // returns without counting the byte it is on.
+        http->m_keepAlive = http_should_keep_alive(parser);
+        http->m_extraParsedBytes = 1;
+        return -1;
+    }
     return 0;
 }
 
@@ -140,12 +190,23 @@ int HTTP::message_complete_cb(http_parser *parser)
 
 /*************************** Public Functions *******************************/
 
+void HTTP::setEngine(Engine newEngine)
+{
+    engine = newEngine;
+}
+
+HTTP::Engine HTTP::getEngine()
+{
+    return engine;
+}
+
 
 HTTP::HTTP(http_parser_type httpType)
 {
     m_state = INIT;
     http_parser_init(&m_parser, httpType);
     m_doneParsing = false;
+    m_keepAlive = false;
     m_httpType = httpType;
     m_headerDone = false;
 
@@ -162,25 +223,24 @@ HTTP::HTTP(http_parser_type httpType)
 
     m_parser.data = this;
 
-    m_field = NULL;
-    m_value = NULL;
+    m_httpMajor = 0;
+    m_httpMinor = 0;
+    m_fast = (httpType == HTTP_REQUEST) && (engine == FAST);
+    m_failed = false;
+    m_bodyLeft = 0;
+
+    m_inField = false;
+    m_headerCount = 0;
+    m_headerCapacity = INITIAL_HEADERS;
+    m_headers = (HttpHeader *) m_arena.allocate(
+        m_headerCapacity * sizeof(HttpHeader), alignof(HttpHeader));
+    memset(m_index, 0, sizeof(m_index));
     m_extraParsedBytes = 0;
 }
 
 HTTP::~HTTP()
 {
-    if(m_field != NULL) {
-        delete m_field;
-    }
-
-    if(m_value != NULL) {
-        delete m_value;
-    }
-
-    for(unsigned int idx = 0; idx < m_headers.size(); idx++) {
-        delete m_headers[idx].first;
-        delete m_headers[idx].second;
-    }
+    // everything we parsed goes with m_arena
 }
 
 int HTTP::addData(const unsigned char *data, int len)
@@ -188,10 +248,10 @@ int HTTP::addData(const unsigned char *data, int len)
     if(m_doneParsing) {
         assert(false);
     }
-    int ret = http_parser_execute(&m_parser, &m_settings, (const char *) data, len);
-    ret += m_extraParsedBytes;
-    m_extraParsedBytes = 0;
-    return ret;
+    if(m_fast) {
+        return fastAddData((const char *) data, len);
+    }
+    return parserAddData((const char *) data, len);
 }
 
 string HTTP::getBody()
@@ -201,17 +261,17 @@ string HTTP::getBody()
 
 string HTTP::getUrl()
 {
-    return m_url;
+    return string(m_url);
 }
 
 string HTTP::getPath()
 {
-    return m_path;
+    return string(m_path);
 }
 
 string HTTP::getHost()
 {
-    string host = (m_method == HTTP_CONNECT) ? m_url : m_host;
+    string host((m_method == HTTP_CONNECT) ? m_url : m_host);
     if(host.find(':') == string::npos) {
         host += ":80";
     }
@@ -228,6 +288,11 @@ bool HTTP::isDone()
     return m_doneParsing;
 }
 
+bool HTTP::shouldKeepAlive()
+{
+    return m_keepAlive;
+}
+
 string HTTP::getReplyHeader()
 {
     string reply;
@@ -238,9 +303,9 @@ string HTTP::getReplyHeader()
     reply = m_statusStr + "\r\n";
 
     bool foundConn = false;
-    for(unsigned int idx = 0; idx < m_headers.size(); idx++) {
-        string field = *(m_headers[idx].first);
-        string value = *(m_headers[idx].second);
+    for(unsigned int idx = 0; idx < m_headerCount; idx++) {
+        string field(m_headers[idx].name);
+        string value(m_headers[idx].value);
 
         if(field == "Connection") {
             value = "close";
@@ -273,13 +338,13 @@ string HTTP::getProxyRequest(const char *userAgent)
             urlPathQuery = m_path;
         }
         if(m_query.size() > 0) {
-            urlPathQuery += "?" + m_query;
+            urlPathQuery += "?" + string(m_query);
         }
-        if(m_url.find(urlPathQuery) == string::npos) {
+        if(m_url.find(urlPathQuery) == string_view::npos) {
             // this is a hack to get around buggy HTML from taobao
             assert(m_query.size() > 0);
-            urlPathQuery = m_path + "??" + m_query;
-            if(m_url.find(urlPathQuery) == string::npos) {
+            urlPathQuery = string(m_path) + "??" + string(m_query);
+            if(m_url.find(urlPathQuery) == string_view::npos) {
                 cout << "url path mismatch " << m_url << endl << urlPathQuery << endl;
             }
         }
@@ -288,7 +353,7 @@ string HTTP::getProxyRequest(const char *userAgent)
     if(m_method == HTTP_GET) {
         reply = "GET " + urlPathQuery + " HTTP/1.1\r\n";
     } else if(m_method == HTTP_CONNECT) {
-        reply = "CONNECT " + m_url + " HTTP/1.1\r\n";
+        reply = "CONNECT " + string(m_url) + " HTTP/1.1\r\n";
     } else if(m_method == HTTP_POST) {
         reply = "POST " + urlPathQuery + " HTTP/1.1\r\n";
     } else if(m_method == HTTP_HEAD) {
@@ -297,9 +362,9 @@ string HTTP::getProxyRequest(const char *userAgent)
         assert(false);
     }
 
-    for(unsigned int idx = 0; idx < m_headers.size(); idx++) {
-        string field = *(m_headers[idx].first);
-        string value = *(m_headers[idx].second);
+    for(unsigned int idx = 0; idx < m_headerCount; idx++) {
+        string field(m_headers[idx].name);
+        string value(m_headers[idx].value);
 
         if((userAgent != NULL) && (field == "User-Agent")) {
             value = string(userAgent);
@@ -347,42 +412,207 @@ void HTTP::setState(HttpState newState)
 
 void HTTP::appendUrl(const char *at, size_t len)
 {
-    m_url.append(at, len);
+    m_url = m_arena.append(m_url, at, len);
 }
 
 void HTTP::addHeaderField()
 {
-    if(m_field != NULL) {
-        assert(m_value != NULL);
-        if(*m_field == "Host") {
-            m_host = *m_value;
+    if(!m_inField) {
+        return;
+    }
+    m_inField = false;
+    if(sameName(m_field, "Host") && m_host.empty()) {
+        m_host = m_value;
+    }
+    if(m_field == "Eoh") {
+        cout << "got the Eoh header" << endl;
+    }
+
+    if(m_headerCount == m_headerCapacity) {
+        // the old array stays in the arena, it is only a few hundred bytes
+        HttpHeader *headers = (HttpHeader *) m_arena.allocate(
+            2 * m_headerCapacity * sizeof(HttpHeader), alignof(HttpHeader));
+        memcpy(headers, m_headers, m_headerCount * sizeof(HttpHeader));
+        m_headers = headers;
+        m_headerCapacity *= 2;
+    }
+    m_headers[m_headerCount].name = m_field;
+    m_headers[m_headerCount].value = m_value;
+    indexHeader(m_headerCount);
+    m_headerCount++;
+}
+
+void HTTP::indexHeader(size_t idx)
+{
+    if(idx >= INDEXED_HEADERS) {
+        return;
+    }
+    // at most half full, so a probe always ends at a free slot
+    size_t slot = nameHash(m_headers[idx].name) & (INDEX_SLOTS - 1);
+    while(m_index[slot] != 0) {
+        if(sameName(m_headers[m_index[slot] - 1].name, m_headers[idx].name)) {
+            // a repeated header, lookups keep finding the first one
+            return;
         }
-        if(*m_field == "Eoh") {
-            cout << "got the Eoh header" << endl;
+        slot = (slot + 1) & (INDEX_SLOTS - 1);
+    }
+    m_index[slot] = idx + 1;
+}
+
+const HttpHeader *HTTP::findHeader(string_view name)
+{
+    size_t slot = nameHash(name) & (INDEX_SLOTS - 1);
+    while(m_index[slot] != 0) {
+        const HttpHeader *header = &m_headers[m_index[slot] - 1];
+        if(sameName(header->name, name)) {
+            return header;
+        }
+        slot = (slot + 1) & (INDEX_SLOTS - 1);
+    }
+    for(size_t idx = INDEXED_HEADERS; idx < m_headerCount; idx++) {
+        if(sameName(m_headers[idx].name, name)) {
+            return &m_headers[idx];
         }
-        m_headers.insert(m_headers.end(), pair<string *, string *>(m_field, m_value));
-        m_field = NULL;
-        m_value = NULL;
-    } else {
-        assert(m_value == NULL);
     }
+    return NULL;
 }
 
 void HTTP::newHeaderField(const char *at, size_t len)
 {
     addHeaderField();
-    m_field = new string(at, len);
-    m_value = new string();
+    m_inField = true;
+    m_field = m_arena.copy(at, len);
+    m_value = string_view();
 }
 void HTTP::appendHeaderField(const char *at, size_t len)
 {
-    assert(m_field != NULL);
-    m_field->append(at, len);
+    assert(m_inField);
+    m_field = m_arena.append(m_field, at, len);
 }
 
 void HTTP::appendHeaderValue(const char *at, size_t len)
 {
-    m_value->append(at, len);
+    m_value = m_arena.append(m_value, at, len);
+}
+
+int HTTP::parserAddData(const char *data, int len)
+{
+    int ret = http_parser_execute(&m_parser, &m_settings, data, len);
+    ret += m_extraParsedBytes;
+    m_extraParsedBytes = 0;
+    return ret;
+}
+
+int HTTP::fastAddData(const char *data, int len)
+{
+    if(m_failed) {
+        return 0;
+    }
+
+    int used = 0;
+    if(!m_headerDone) {
+        if(m_head.empty()) {
+            // http_parser skips blank lines before a request too
+            while(used < len && (data[used] == '\r' || data[used] == '\n')) {
+                used++;
+            }
+            if(used == len) {
+                return used;
+            }
+            // not a method, so not a request. Let http_parser say so now
+            // rather than wait for a blank line that may never come
+            if(data[used] < 'A' || data[used] > 'Z') {
+                m_fast = false;
+                return used + parserAddData(data + used, len - used);
+            }
+        }
+
+        // gather the head in the arena, where it is parsed in one go once
+        // the blank line turns up, and leave whatever follows it
+        size_t end = FastRequestParser::findEnd(m_head, data + used, len - used);
+        size_t take = (end == string_view::npos) ? len - used : end;
+        if(m_head.size() + take > HTTP_MAX_HEADER_SIZE) {
+            // too long for http_parser as well
+            m_failed = true;
+            return used;
+        }
+        m_head = m_arena.append(m_head, data + used, take);
+        used += take;
+        if(end == string_view::npos) {
+            return used;
+        }
+
+        if(!parseHead()) {
+            return replayHead(data, len, used);
+        }
+    }
+
+    int take = (int) min((int64_t) (len - used), m_bodyLeft);
+    if(take > 0) {
+        m_body.append(data + used, take);
+        used += take;
+        m_bodyLeft -= take;
+    }
+    if(m_bodyLeft == 0) {
+        setState(HTTP::DONE);
+        messageComplete(m_method);
+    }
+    return used;
+}
+
+bool HTTP::parseHead()
+{
+    FastRequestParser::Head head;
+    FastRequestParser::Result result;
+    while((result = FastRequestParser::parse(m_head, head, m_headers,
+                                             m_headerCapacity)) ==
+          FastRequestParser::NO_ROOM) {
+        m_headerCapacity *= 2;
+        m_headers = (HttpHeader *) m_arena.allocate(
+            m_headerCapacity * sizeof(HttpHeader), alignof(HttpHeader));
+    }
+    if(result != FastRequestParser::PARSED) {
+        return false;
+    }
+
+    m_method = head.method;
+    m_url = head.url;
+    m_path = head.path;
+    m_query = head.query;
+    m_httpMajor = head.httpMajor;
+    m_httpMinor = head.httpMinor;
+    m_keepAlive = head.keepAlive;
+    m_headerCount = head.headerCount;
+    for(size_t idx = 0; idx < m_headerCount; idx++) {
+        if(m_host.empty() && sameName(m_headers[idx].name, "Host")) {
+            m_host = m_headers[idx].value;
+        }
+        indexHeader(idx);
+    }
+    m_bodyLeft = head.contentLength > 0 ? head.contentLength : 0;
+    m_headerDone = true;
+    setState(HTTP::BODY);
+    return true;
+}
+
+int HTTP::replayHead(const char *data, int len, int used)
+{
+    // not one for FastRequestParser, give http_parser the whole head from
+    // the start and let it carry on from there
+    m_fast = false;
+    m_headerCount = 0;
+    memset(m_index, 0, sizeof(m_index));
+    m_url = m_path = m_query = m_host = string_view();
+
+    int replayed = parserAddData(m_head.data(), m_head.size());
+    if(m_doneParsing) {
+        // it can finish before the blank line we saw, on a stray CR
+        return max(0, used - ((int) m_head.size() - replayed));
+    }
+    if(replayed < (int) m_head.size()) {
+        return 0;
+    }
+    return used + parserAddData(data + used, len - used);
 }
 
 void HTTP::messageComplete(unsigned char method)
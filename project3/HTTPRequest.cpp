@@ -48,34 +48,21 @@ string HTTPRequest::getPath() {
   return m_http->getPath();
 }
 
-string HTTPRequest::getHeader(string key) {
-  vector<pair<string *, string *> >::iterator iter;
-  vector<pair<string *, string *> > headers = m_http->getHeaders();
-  for (iter = headers.begin(); iter != headers.end(); iter++) {
-    string header_key = *(iter->first);
-    if (header_key == key) {
-      return *(iter->second);
-    }
-  }
+string_view HTTPRequest::getHeader(string_view name) {
+  const HttpHeader *header = m_http->findHeader(name);
+  return header == NULL ? string_view() : header->value;
+}
 
-  throw "could not find header";
+bool HTTPRequest::hasHeader(string_view name) {
+  return m_http->findHeader(name) != NULL;
 }
 
 bool HTTPRequest::hasAuthToken() {
-  try {
-    getHeader("x-auth-token");
-    return true;
-  } catch (...) {
-    return false;
-  }
+  return hasHeader("x-auth-token");
 }
 
 string HTTPRequest::getAuthToken() {
-  try {
-    return getHeader("x-auth-token");
-  } catch (...) {
-    return "";
-  }
+  return string(getHeader("x-auth-token"));
 }
 
 vector<string> HTTPRequest::getPathComponents() {
@@ -95,6 +82,19 @@ bool HTTPRequest::readRequest()
     return true;
 }
 
+int HTTPRequest::addData(const char *buffer, unsigned int len)
+{
+    assert(!m_http->isDone());
+    m_totalBytesRead += len;
+
+    int ret = m_http->addData((const unsigned char *) buffer, len);
+    if(!m_http->isDone() && ret < (int) len) {
+        // the parser stops short of the input only on an error
+        return -1;
+    }
+    return ret;
+}
+
 void HTTPRequest::onRead(const char *buffer, unsigned int len)
 {
     m_totalBytesRead += len;
@@ -108,16 +108,11 @@ void HTTPRequest::onRead(const char *buffer, unsigned int len)
         assert(ret > 0);
         bytesRead += ret;
         
-        // This is a workaround for a parsing bug that sometimes
-        // crops up with connect commands.  The parser will think
-        // it is done before it reads the last newline of some
-        // properly formatted connect requests
+        // Anything after the end of this request belongs to the next
+        // one on a keep-alive connection, hand it back to the socket
         if(m_http->isDone() && (bytesRead < len)) {
-            if(m_http->isConnect() && ((len-bytesRead) == 1) && (buffer[bytesRead] == '\n')) {
-                break;
-            } else {
-                assert(false);
-            }
+            m_sock->unread(buffer + bytesRead, len - bytesRead);
+            break;
         }
     }
 }
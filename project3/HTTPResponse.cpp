@@ -1,4 +1,5 @@
-#include <sstream>
+#include <stdio.h>
+#include <unistd.h>
 
 #include "HTTPResponse.h"
 
@@ -6,9 +7,23 @@ using namespace std;
 
 HTTPResponse::HTTPResponse() {
   this->streaming = false;
+  this->closeDelimited = false;
   this->contentType = "text/html; charset=ISO-8859-1";
   this->headers["Server"] = "Gunrock Web";
   this->status = 200;
+  this->bodyOmitted = false;
+  this->fileFd = -1;
+  this->fileOffset = 0;
+  this->fileLength = 0;
+  this->source = NULL;
+  this->sourceLength = -1;
+}
+
+HTTPResponse::~HTTPResponse() {
+  if (fileFd >= 0) {
+    close(fileFd);
+  }
+  delete source;
 }
 
 void HTTPResponse::withStreaming() {
@@ -23,6 +38,84 @@ void HTTPResponse::setBody(string data) {
   body = data;
 }
 
+void HTTPResponse::setFileBody(int fd, off_t offset, size_t length) {
+  if (fileFd >= 0) {
+    close(fileFd);
+  }
+  body = "";
+  fileFd = fd;
+  fileOffset = offset;
+  fileLength = length;
+}
+
+void HTTPResponse::setSharedBody(shared_ptr<const SharedBody> shared) {
+  body = "";
+  this->shared = shared;
+}
+
+shared_ptr<const SharedBody> HTTPResponse::getSharedBody() {
+  return shared;
+}
+
+string HTTPResponse::releaseBody() {
+  string data;
+  data.swap(body);
+  return data;
+}
+
+const char *HTTPResponse::getBodyData() {
+  return shared ? shared->body.data() : body.data();
+}
+
+size_t HTTPResponse::getBodyLength() {
+  // HEAD, a 304 and chunked bodies send nothing after the headers here
+  if (bodyOmitted || streaming || status == 304) {
+    return 0;
+  }
+  return shared ? shared->body.size() : body.size();
+}
+
+void HTTPResponse::setBodySource(BodySource *source, ssize_t length) {
+  delete this->source;
+  body = "";
+  this->source = source;
+  sourceLength = length;
+  streaming = length < 0;
+}
+
+BodySource *HTTPResponse::releaseBodySource() {
+  BodySource *released = source;
+  source = NULL;
+  return released;
+}
+
+void HTTPResponse::endWithConnection() {
+  closeDelimited = true;
+}
+
+int HTTPResponse::releaseFile() {
+  int fd = fileFd;
+  fileFd = -1;
+  return fd;
+}
+
+void HTTPResponse::omitBody() {
+  bodyOmitted = true;
+  if (fileFd >= 0) {
+    // Content-Length still comes from fileLength
+    close(fileFd);
+    fileFd = -1;
+  }
+  delete source;
+  source = NULL;
+}
+
+void HTTPResponse::omitBody(size_t length) {
+  omitBody();
+  body = "";
+  fileLength = length;
+}
+
 int HTTPResponse::getStatus() {
   return status;
 }
@@ -35,34 +128,67 @@ void HTTPResponse::setStatus(int status) {
   this->status = status;
 }
 
-string HTTPResponse::statusToString() {
-  if (status == 200) {
-    return "OK";
-  } else {
-    return "Unknown";
+const char *HTTPResponse::statusToString() {
+  switch (status) {
+  case 200: return "OK";
+  case 206: return "Partial Content";
+  case 304: return "Not Modified";
+  case 400: return "Bad Request";
+  case 403: return "Forbidden";
+  case 404: return "Not Found";
+  case 405: return "Method Not Allowed";
+  case 416: return "Range Not Satisfiable";
+  case 500: return "Internal Server Error";
+  case 501: return "Not Implemented";
+  default: return "Unknown";
   }
 }
 
-string HTTPResponse::response() {
-  stringstream out;
-  setHeader("Content-Type", contentType);
-  if (streaming) {
-    setHeader("Transfer-Encoding", "chunked");
-  } else {
-    stringstream len;
-    len << body.size();
-    setHeader("Content-Length", len.str());
+static void appendHeader(string &out, const char *name,
+                         const string &value) {
+  out.append(name).append(": ").append(value).append("\r\n");
+}
+
+void HTTPResponse::renderHeaders(string &out) {
+  char number[32];
+  snprintf(number, sizeof(number), "%d ", status);
+  out.append("HTTP/1.1 ").append(number).append(statusToString());
+  out.append("\r\n");
+
+  // a 304 has no body to describe, a shared body brings its own
+  // Content-Type and Content-Length
+  if (!shared && status != 304) {
+    appendHeader(out, "Content-Type", contentType);
+    if (streaming) {
+      // a close-delimited body has no length header at all
+      if (!closeDelimited) {
+        appendHeader(out, "Transfer-Encoding", "chunked");
+      }
+    } else {
+      size_t length = body.size();
+      if (sourceLength >= 0) {
+        length = sourceLength;
+      } else if (fileLength > 0) {
+        length = fileLength;
+      }
+      snprintf(number, sizeof(number), "%zu", length);
+      appendHeader(out, "Content-Length", number);
+    }
   }
 
-  out << "HTTP/1.1 " << status << " " << statusToString() << "\r\n";
   map<string, string>::iterator iter;
   for(iter = headers.begin(); iter != headers.end(); iter++) {
-    out << iter->first << ": " << iter->second << "\r\n";
+    appendHeader(out, iter->first.c_str(), iter->second);
   }
-  out << "\r\n";
-  if (body.size() > 0 && !streaming) {
-    out << body;
+  if (shared && status != 304) {
+    out.append(shared->headers);
   }
+  out.append("\r\n");
+}
 
-  return out.str();
+string HTTPResponse::response() {
+  string out;
+  renderHeaders(out);
+  out.append(getBodyData(), getBodyLength());
+  return out;
 }
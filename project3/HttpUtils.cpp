@@ -1,9 +1,14 @@
 #include <assert.h>
 
+#include <algorithm>
+
 #include "HttpUtils.h"
 
 using namespace std;
 
+// how much of a body source goes into one chunk
+#define SOURCE_CHUNK_BYTES (32 * 1024)
+
 map<string, string> HttpUtils::params(string query) {
   map<string, string> paramMap;
 
@@ -30,18 +35,60 @@ void HttpUtils::writeChunk(MySocket *client,
 				      const void *buf, int numBytes) {
 
   char chunkHeader[256];
-  snprintf(chunkHeader, sizeof(chunkHeader), "%x\r\n", numBytes);
-  client->write(chunkHeader);
-  if (buf != NULL && numBytes > 0) {
-    client->write(string((const char *) buf, numBytes));
-  }
-  client->write("\r\n");
+  int headerLength = snprintf(chunkHeader, sizeof(chunkHeader), "%x\r\n",
+                              numBytes);
+  // size line, data and CRLF in one go, without copying the data
+  struct iovec iov[3];
+  iov[0].iov_base = chunkHeader;
+  iov[0].iov_len = headerLength;
+  iov[1].iov_base = (void *) buf;
+  iov[1].iov_len = buf != NULL && numBytes > 0 ? numBytes : 0;
+  iov[2].iov_base = (void *) "\r\n";
+  iov[2].iov_len = 2;
+  client->writeGather(iov, 3);
 }
 
 void HttpUtils::writeLastChunk(MySocket *client) {
   writeChunk(client, NULL, 0);
 }
 
+size_t HttpUtils::writeSource(MySocket *client, BodySource *source,
+                              bool chunked, ssize_t length) {
+  char buffer[SOURCE_CHUNK_BYTES];
+  size_t total = 0;
+  while (true) {
+    size_t want = sizeof(buffer);
+    if (length >= 0) {
+      // never more than the Content-Length we promised
+      want = min(want, (size_t) length - total);
+      if (want == 0) {
+        break;
+      }
+    }
+    ssize_t got = source->read(buffer, want);
+    if (got < 0) {
+      throw SocketWriteError();
+    }
+    if (got == 0) {
+      break;
+    }
+    if (chunked) {
+      writeChunk(client, buffer, got);
+    } else {
+      client->writeResponse("", buffer, got);
+    }
+    total += got;
+  }
+
+  if (length >= 0 && total != (size_t) length) {
+    throw SocketWriteError();
+  }
+  if (chunked) {
+    writeLastChunk(client);
+  }
+  return total;
+}
+
 
 // split lifted from stackoverflow
 // http://stackoverflow.com/questions/236129/split-a-string-in-c
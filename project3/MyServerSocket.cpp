@@ -3,48 +3,83 @@
 #include <sys/socket.h>
 #include <unistd.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-MyServerSocket::MyServerSocket(int port)
+MyServerSocket::MyServerSocket(int port, int backlog, bool reusePort,
+                               int deferAccept)
 {
     struct sockaddr_in server;
     int one = 1;
-  
+    noDelay = false;
+
     // set up the server socket
-    serverFd = socket(AF_INET,SOCK_STREAM,0);
-    
+    serverFd = socket(AF_INET,SOCK_STREAM | SOCK_CLOEXEC,0);
+    if (serverFd < 0) {
+      throw SocketError("could not create socket");
+    }
+
     server.sin_family = AF_INET;
     server.sin_addr.s_addr = INADDR_ANY;
     server.sin_port = htons((short) port);
-    
+
     if (setsockopt(serverFd,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(int)) == -1) {
       throw SocketError("error with set socket opts");
     }
-    
+
+    if (reusePort &&
+        setsockopt(serverFd,SOL_SOCKET,SO_REUSEPORT,&one,sizeof(int)) == -1) {
+      throw SocketError("could not set SO_REUSEPORT");
+    }
+
+    if (deferAccept > 0 &&
+        setsockopt(serverFd,IPPROTO_TCP,TCP_DEFER_ACCEPT,&deferAccept,sizeof(int)) == -1) {
+      throw SocketError("could not set TCP_DEFER_ACCEPT");
+    }
+
     if( bind(serverFd,(struct sockaddr *) &server, sizeof(server)) ==-1){
         char str[1024];
         snprintf(str, 1023, "could not bind to port %d",port);
         throw SocketError(str);
-    }	
-    
-    //set up a listen queue
-    listen(serverFd, 10);
+    }
+
+    //set up a listen queue, the kernel caps it at net.core.somaxconn
+    if (listen(serverFd, backlog) == -1) {
+      throw SocketError("listen error");
+    }
+}
+
+int MyServerSocket::acceptFd(int flags)
+{
+    int clientFd = ::accept4(serverFd, NULL, NULL, flags | SOCK_CLOEXEC);
+    if (clientFd >= 0 && noDelay) {
+      int one = 1;
+      setsockopt(clientFd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(int));
+    }
+    return clientFd;
 }
 
 MySocket *MyServerSocket::accept()
 {
     //check that the sockFd is valid
-    
-    struct sockaddr_in client;
-    socklen_t len = sizeof(client);
-    int clientFd = ::accept(serverFd, (struct sockaddr *) &client, &len);
-    
+
+    int clientFd;
+    do {
+      clientFd = acceptFd(0);
+    } while (clientFd < 0 && (errno == EINTR || errno == ECONNABORTED));
+
     if(clientFd<0) {
       throw SocketError("accept error");
     }
-    
+
     return new MySocket(clientFd);
 }
+
+int MyServerSocket::acceptNonBlocking()
+{
+    return acceptFd(SOCK_NONBLOCK);
+}
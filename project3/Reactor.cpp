@@ -0,0 +1,746 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+#include <list>
+#include <string>
+#include <vector>
+
+#include "Reactor.h"
+#include "dthread.h"
+
+using namespace std;
+
+// requests larger than this are dropped instead of buffered forever
+#define MAX_REQUEST_BYTES (1 << 20)
+#define READ_CHUNK 16384
+#define MAX_EVENTS 256
+#define ACCEPT_BATCH 64
+#define WRITEV_MAX 64
+// how much of a body source goes into one chunk
+#define SOURCE_CHUNK_BYTES (32 * 1024)
+// pieces of output, one to three per response and each maybe holding a
+// file or a source, queued on a connection before parsing stops
+#define MAX_QUEUED_OUTPUTS 16
+
+static void fatal(string what) {
+  cerr << what << ": " << strerror(errno) << endl;
+  exit(1);
+}
+
+static void pinToCore(int id) {
+  // pick the id-th CPU we are allowed to run on, wrapping around
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+    return;
+  }
+  int count = CPU_COUNT(&allowed);
+  if (count == 0) {
+    return;
+  }
+
+  int target = id % count;
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (!CPU_ISSET(cpu, &allowed)) {
+      continue;
+    }
+    if (target-- == 0) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpu, &set);
+      pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+      return;
+    }
+  }
+}
+
+static void raiseFileLimit() {
+  // each connection is an fd, so take everything the hard limit allows
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+}
+
+/******************************* Connection *********************************/
+
+Connection::Connection(int fd, EventLoop *loop) {
+  m_fd = fd;
+  m_loop = loop;
+  m_state = READING;
+  m_closed = false;
+  m_failed = false;
+  m_requests = 0;
+  m_started = 0;
+  m_sock = new MySocket(fd);
+  m_request = new HTTPRequest(m_sock, 0);
+  m_response = new HTTPResponse();
+  m_outOffset = 0;
+  m_lastActive = 0;
+}
+
+Connection::~Connection() {
+  dropOutput();
+  delete m_request;
+  delete m_response;
+  // closes m_fd
+  delete m_sock;
+}
+
+void Connection::reset() {
+  delete m_request;
+  delete m_response;
+  m_request = new HTTPRequest(m_sock, 0);
+  m_response = new HTTPResponse();
+  m_state = READING;
+}
+
+void Connection::dropOutput() {
+  for (size_t idx = 0; idx < m_out.size(); idx++) {
+    if (m_out[idx].file >= 0) {
+      close(m_out[idx].file);
+    }
+    delete m_out[idx].source;
+  }
+  m_out.clear();
+  m_outOffset = 0;
+}
+
+/******************************* EventLoop **********************************/
+
+static time_t monotonicSeconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return now.tv_sec;
+}
+
+EventLoop::EventLoop(int id, MyServerSocket *server, bool shared,
+                     Reactor *reactor) {
+  m_id = id;
+  m_server = server;
+  m_listenFd = server->getFd();
+  m_reactor = reactor;
+  m_now = monotonicSeconds();
+  pthread_mutex_init(&m_completedMutex, NULL);
+
+  m_epollFd = epoll_create1(EPOLL_CLOEXEC);
+  if (m_epollFd < 0) {
+    fatal("epoll_create1");
+  }
+  m_eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (m_eventFd < 0) {
+    fatal("eventfd");
+  }
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+  // wake only one of the loops sharing the socket per incoming connection
+  if (shared) {
+    ev.events |= EPOLLEXCLUSIVE;
+  }
+#endif
+  ev.data.ptr = &m_listenFd;
+  if (epoll_ctl(m_epollFd, EPOLL_CTL_ADD, m_listenFd, &ev) != 0) {
+    fatal("epoll_ctl listen");
+  }
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = &m_eventFd;
+  if (epoll_ctl(m_epollFd, EPOLL_CTL_ADD, m_eventFd, &ev) != 0) {
+    fatal("epoll_ctl eventfd");
+  }
+}
+
+EventLoop::~EventLoop() {
+  list<Connection *>::iterator iter;
+  for (iter = m_connections.begin(); iter != m_connections.end(); iter++) {
+    delete *iter;
+  }
+  for (size_t idx = 0; idx < m_dead.size(); idx++) {
+    delete m_dead[idx];
+  }
+  close(m_eventFd);
+  close(m_epollFd);
+  pthread_mutex_destroy(&m_completedMutex);
+}
+
+void EventLoop::run() {
+  struct epoll_event events[MAX_EVENTS];
+
+  pinToCore(m_id);
+
+  while (true) {
+    // wake up once a second to expire idle connections
+    int timeout = m_reactor->idleTimeout() > 0 ? 1000 : -1;
+    int ready = epoll_wait(m_epollFd, events, MAX_EVENTS, timeout);
+    if (ready < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fatal("epoll_wait");
+    }
+    m_now = monotonicSeconds();
+
+    for (int idx = 0; idx < ready; idx++) {
+      void *ptr = events[idx].data.ptr;
+      uint32_t mask = events[idx].events;
+
+      if (ptr == &m_listenFd) {
+        acceptConnections();
+        continue;
+      }
+      if (ptr == &m_eventFd) {
+        onCompletions();
+        continue;
+      }
+
+      Connection *conn = (Connection *) ptr;
+      if (conn->m_fd < 0) {
+        // closed earlier in this round
+        continue;
+      }
+      if (mask & (EPOLLERR | EPOLLHUP)) {
+        if (conn->m_state == Connection::PROCESSING) {
+          // a worker still owns the request, finish up when it returns
+          conn->m_closed = true;
+        } else {
+          closeConnection(conn);
+        }
+        continue;
+      }
+      if (mask & (EPOLLIN | EPOLLRDHUP)) {
+        if (!onReadable(conn)) {
+          continue;
+        }
+      }
+      if (mask & EPOLLOUT) {
+        // writes, then answers requests held back while output was queued
+        parseInput(conn);
+      }
+    }
+
+    closeIdle();
+
+    for (size_t idx = 0; idx < m_dead.size(); idx++) {
+      delete m_dead[idx];
+    }
+    m_dead.clear();
+  }
+}
+
+void EventLoop::complete(Connection *conn) {
+  pthread_mutex_lock(&m_completedMutex);
+  bool wake = m_completed.empty();
+  m_completed.push_back(conn);
+  pthread_mutex_unlock(&m_completedMutex);
+
+  // the loop drains the whole batch, so only the first completion signals
+  if (wake) {
+    uint64_t one = 1;
+    if (write(m_eventFd, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN) {
+      fatal("eventfd write");
+    }
+  }
+}
+
+void EventLoop::acceptConnections() {
+  for (int idx = 0; idx < ACCEPT_BATCH; idx++) {
+    int fd = m_server->acceptNonBlocking();
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        cerr << "accept error: " << strerror(errno) << endl;
+      }
+      return;
+    }
+
+    Connection *conn = new Connection(fd, this);
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    // edge triggered: a connection is registered once and never modified
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = conn;
+    if (epoll_ctl(m_epollFd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+      cerr << "epoll_ctl client: " << strerror(errno) << endl;
+      delete conn;
+      continue;
+    }
+    conn->m_position = m_connections.insert(m_connections.end(), conn);
+    conn->m_lastActive = m_now;
+  }
+}
+
+bool EventLoop::onReadable(Connection *conn) {
+  char buffer[READ_CHUNK];
+  bool peerClosed = false;
+
+  // edge triggered, so drain the socket completely
+  while (true) {
+    ssize_t ret = read(conn->m_fd, buffer, sizeof(buffer));
+    if (ret > 0) {
+      conn->m_in.append(buffer, ret);
+      if (conn->m_in.size() > MAX_REQUEST_BYTES) {
+        peerClosed = true;
+        conn->m_closed = true;
+        break;
+      }
+      continue;
+    }
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    peerClosed = true;
+    break;
+  }
+  touch(conn);
+
+  if (peerClosed) {
+    conn->m_closed = true;
+  }
+  // answers any complete requests, including one sent just before a
+  // half-close
+  return parseInput(conn);
+}
+
+bool EventLoop::onWritable(Connection *conn) {
+  while (!conn->m_out.empty()) {
+    Connection::Output &front = conn->m_out.front();
+    if (front.source != NULL) {
+      // everything queued before it is out, so there is room for more
+      if (!pull(conn)) {
+        return failConnection(conn);
+      }
+      continue;
+    }
+    bool isFile = front.file >= 0;
+    ssize_t ret;
+    if (isFile) {
+      // advances front.offset
+      ret = sendfile(conn->m_fd, front.file, &front.offset, front.length);
+    } else {
+      // every data piece up to the next file, MSG_MORE holds a header
+      // back until its file body joins it
+      struct iovec iov[WRITEV_MAX];
+      int count = 0;
+      bool fileNext = false;
+      deque<Connection::Output>::iterator iter;
+      for (iter = conn->m_out.begin();
+           iter != conn->m_out.end() && count < WRITEV_MAX; iter++) {
+        if (iter->source != NULL) {
+          break;
+        }
+        if (iter->file >= 0) {
+          fileNext = true;
+          break;
+        }
+        size_t skip = (count == 0) ? conn->m_outOffset : 0;
+        iov[count].iov_base = (void *) (iter->bytes() + skip);
+        iov[count].iov_len = iter->size() - skip;
+        count++;
+      }
+
+      struct msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = iov;
+      msg.msg_iovlen = count;
+      ret = sendmsg(conn->m_fd, &msg, fileNext ? MSG_MORE : 0);
+    }
+
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        // wait for the next EPOLLOUT edge
+        return true;
+      }
+      return failConnection(conn);
+    }
+    if (ret == 0 && isFile) {
+      // the file shrank, we cannot deliver the Content-Length we promised
+      return failConnection(conn);
+    }
+    touch(conn);
+
+    if (isFile) {
+      front.length -= ret;
+      if (front.length == 0) {
+        close(front.file);
+        conn->m_out.pop_front();
+      }
+      continue;
+    }
+
+    // retire fully written buffers
+    size_t written = ret;
+    while (written > 0) {
+      size_t left = conn->m_out.front().size() - conn->m_outOffset;
+      if (written < left) {
+        conn->m_outOffset += written;
+        break;
+      }
+      written -= left;
+      conn->m_out.pop_front();
+      conn->m_outOffset = 0;
+    }
+  }
+
+  if (conn->m_state == Connection::CLOSING) {
+    closeConnection(conn);
+    return false;
+  }
+  return true;
+}
+
+bool EventLoop::pull(Connection *conn) {
+  Connection::Output &front = conn->m_out.front();
+  char buffer[SOURCE_CHUNK_BYTES];
+  size_t want = sizeof(buffer);
+  if (front.remaining >= 0) {
+    // never more than the Content-Length we promised
+    want = min(want, (size_t) front.remaining);
+  }
+  ssize_t got = want > 0 ? front.source->read(buffer, want) : 0;
+  if (got < 0 || (got == 0 && front.remaining > 0)) {
+    // the body is cut short, only closing tells the client
+    return false;
+  }
+
+  string piece;
+  if (got == 0) {
+    bool chunked = front.chunked;
+    delete front.source;
+    conn->m_out.pop_front();
+    if (chunked) {
+      conn->m_out.push_front(Connection::Output(string("0\r\n\r\n")));
+    }
+    return true;
+  }
+
+  if (front.chunked) {
+    char size[32];
+    snprintf(size, sizeof(size), "%zx\r\n", (size_t) got);
+    piece.reserve(strlen(size) + got + 2);
+    piece.append(size).append(buffer, got).append("\r\n");
+  } else {
+    piece.assign(buffer, got);
+  }
+  if (front.remaining >= 0) {
+    front.remaining -= got;
+  }
+  // goes out ahead of the source, which is asked again once it has
+  conn->m_out.push_front(Connection::Output(std::move(piece)));
+  return true;
+}
+
+void EventLoop::onCompletions() {
+  uint64_t count;
+  if (read(m_eventFd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    fatal("eventfd read");
+  }
+
+  vector<Connection *> completed;
+  pthread_mutex_lock(&m_completedMutex);
+  completed.swap(m_completed);
+  pthread_mutex_unlock(&m_completedMutex);
+
+  for (size_t idx = 0; idx < completed.size(); idx++) {
+    Connection *conn = completed[idx];
+    queueResponse(conn);
+    // pipelined requests may already be waiting in m_in
+    parseInput(conn);
+  }
+}
+
+bool EventLoop::parseInput(Connection *conn) {
+  // Requests on a connection are answered strictly in order, so at most
+  // one is with a worker at a time. Without workers the complete requests
+  // in m_in are answered here and written out in one go, but only while
+  // m_out has room: a client that pipelines and never reads leaves the
+  // rest in m_in, bounded by MAX_REQUEST_BYTES, until its output drains.
+  while (true) {
+    while (conn->m_state == Connection::READING && !conn->m_in.empty() &&
+           conn->m_out.size() < MAX_QUEUED_OUTPUTS) {
+      int ret = conn->m_request->addData(conn->m_in.data(),
+                                         conn->m_in.size());
+      if (ret < 0) {
+        // malformed request, nothing sensible to answer with
+        closeConnection(conn);
+        return false;
+      }
+      conn->m_in.erase(0, ret);
+
+      if (!conn->m_request->isDone()) {
+        break;
+      }
+      dispatch(conn);
+    }
+
+    // requests left unanswered for want of room in m_out
+    bool held = conn->m_state == Connection::READING && !conn->m_in.empty() &&
+                conn->m_out.size() >= MAX_QUEUED_OUTPUTS;
+    if (conn->m_state == Connection::READING && conn->m_closed && !held) {
+      // the peer is gone and no request is in flight, send what is left
+      conn->m_state = Connection::CLOSING;
+    }
+    if (!onWritable(conn)) {
+      return false;
+    }
+    if (!held || conn->m_out.size() >= MAX_QUEUED_OUTPUTS) {
+      // nothing more to answer, or the next EPOLLOUT carries on
+      return true;
+    }
+  }
+}
+
+void EventLoop::dispatch(Connection *conn) {
+  conn->m_state = Connection::PROCESSING;
+  conn->m_started = AccessLog::now();
+  if (m_reactor->hasWorkers()) {
+    m_reactor->submit(conn);
+    return;
+  }
+
+  m_reactor->handle(conn);
+  queueResponse(conn);
+}
+
+void EventLoop::queueResponse(Connection *conn) {
+  if (conn->m_failed) {
+    // an earlier response was cut short, this one would be read as its
+    // remainder
+    conn->m_state = Connection::CLOSING;
+    return;
+  }
+  conn->m_requests++;
+  bool keepAlive = conn->m_request->isKeepAlive() && !conn->m_closed &&
+                   conn->m_requests < m_reactor->maxRequests();
+  HTTPResponse *response = conn->m_response;
+  // HTTP/1.0 has no chunks, a body of unknown length ends with the
+  // connection
+  if (response->isChunked() && !conn->m_request->isHttp11()) {
+    response->endWithConnection();
+    keepAlive = false;
+  }
+  response->setHeader("Connection", keepAlive ? "keep-alive" : "close");
+  // the headers get a buffer of their own since they may wait for the
+  // socket, the body is shared or moved over and goes out with them in
+  // one sendmsg
+  conn->m_out.push_back(Connection::Output(string()));
+  response->renderHeaders(conn->m_out.back().data);
+  size_t bytes = conn->m_out.back().data.length();
+  size_t bodyLength = response->getBodyLength();
+  if (bodyLength > 0) {
+    shared_ptr<const SharedBody> shared = response->getSharedBody();
+    if (shared) {
+      conn->m_out.push_back(Connection::Output(shared));
+    } else {
+      conn->m_out.push_back(Connection::Output(response->releaseBody()));
+    }
+    bytes += bodyLength;
+  }
+  if (response->hasFileBody()) {
+    size_t length = response->getFileLength();
+    off_t offset = response->getFileOffset();
+    int file = response->releaseFile();
+    if (length > 0) {
+      conn->m_out.push_back(Connection::Output(file, offset, length));
+      bytes += length;
+    } else {
+      close(file);
+    }
+  }
+  if (response->getBodySource() != NULL) {
+    // produced as the socket drains, the log only counts a known length
+    ssize_t length = response->getSourceLength();
+    bool chunked = response->isChunked();
+    conn->m_out.push_back(
+      Connection::Output(response->releaseBodySource(), chunked, length));
+    if (length > 0) {
+      bytes += length;
+    }
+  }
+
+  AccessLog *accessLog = m_reactor->accessLog();
+  if (accessLog != NULL) {
+    accessLog->log(conn->m_request->getMethod(), conn->m_request->getPath(),
+                   response->getStatus(), bytes,
+                   AccessLog::now() - conn->m_started);
+  }
+
+  if (keepAlive) {
+    conn->reset();
+  } else {
+    conn->m_state = Connection::CLOSING;
+  }
+}
+
+void EventLoop::touch(Connection *conn) {
+  // move to the back of the list, which stays sorted by activity
+  conn->m_lastActive = m_now;
+  m_connections.splice(m_connections.end(), m_connections, conn->m_position);
+}
+
+void EventLoop::closeIdle() {
+  int idleTimeout = m_reactor->idleTimeout();
+  if (idleTimeout <= 0) {
+    return;
+  }
+
+  while (!m_connections.empty()) {
+    Connection *conn = m_connections.front();
+    if (m_now - conn->m_lastActive < idleTimeout) {
+      break;
+    }
+    if (conn->m_state == Connection::PROCESSING) {
+      // a worker is busy with it, that is not idle
+      touch(conn);
+      continue;
+    }
+    closeConnection(conn);
+  }
+}
+
+bool EventLoop::failConnection(Connection *conn) {
+  if (conn->m_state != Connection::PROCESSING) {
+    closeConnection(conn);
+    return false;
+  }
+  // a worker still owns the next request and will hand the connection
+  // back through complete(), queueResponse closes it then
+  conn->m_closed = true;
+  conn->m_failed = true;
+  conn->dropOutput();
+  return true;
+}
+
+void EventLoop::closeConnection(Connection *conn) {
+  // closing the fd also removes it from the epoll set, the object itself
+  // lives until the end of this round since later events may name it
+  m_connections.erase(conn->m_position);
+  conn->m_sock->close();
+  conn->m_fd = -1;
+  m_dead.push_back(conn);
+}
+
+/******************************** Reactor ***********************************/
+
+Reactor::Reactor(vector<MyServerSocket *> servers, int numLoops,
+                 int numWorkers, RequestHandler handler) {
+  m_servers = servers;
+  m_numLoops = numLoops > 0 ? numLoops : 1;
+  m_numWorkers = numWorkers > 0 ? numWorkers : 0;
+  m_handler = handler;
+  m_maxRequests = 100;
+  m_idleTimeout = 5;
+  m_accessLog = NULL;
+  pthread_mutex_init(&m_jobMutex, NULL);
+  pthread_cond_init(&m_jobCond, NULL);
+}
+
+void Reactor::setKeepAlive(int maxRequests, int idleTimeout) {
+  m_maxRequests = maxRequests;
+  m_idleTimeout = idleTimeout;
+}
+
+void Reactor::run() {
+  for (size_t idx = 0; idx < m_servers.size(); idx++) {
+    int listenFd = m_servers[idx]->getFd();
+    int flags = fcntl(listenFd, F_GETFL, 0);
+    if (flags < 0 || fcntl(listenFd, F_SETFL, flags | O_NONBLOCK) < 0) {
+      fatal("fcntl listen");
+    }
+  }
+  raiseFileLimit();
+
+  // either one socket shared by every loop or one SO_REUSEPORT socket each
+  bool shared = m_servers.size() == 1;
+  for (int idx = 0; idx < m_numLoops; idx++) {
+    MyServerSocket *server = m_servers[idx % m_servers.size()];
+    m_loops.push_back(new EventLoop(idx, server, shared, this));
+  }
+
+  for (int idx = 0; idx < m_numWorkers; idx++) {
+    pthread_t thread;
+    if (dthread_create(&thread, NULL, &Reactor::workerThread, this) != 0 ||
+        dthread_detach(thread) != 0) {
+      cerr << "Error creating worker thread" << endl;
+      exit(1);
+    }
+  }
+
+  for (int idx = 1; idx < m_numLoops; idx++) {
+    pthread_t thread;
+    if (dthread_create(&thread, NULL, &Reactor::loopThread, m_loops[idx]) != 0 ||
+        dthread_detach(thread) != 0) {
+      cerr << "Error creating event loop thread" << endl;
+      exit(1);
+    }
+  }
+
+  m_loops[0]->run();
+}
+
+void *Reactor::loopThread(void *arg) {
+  EventLoop *loop = (EventLoop *) arg;
+  loop->run();
+  return NULL;
+}
+
+void *Reactor::workerThread(void *arg) {
+  Reactor *reactor = (Reactor *) arg;
+  reactor->workerLoop();
+  return NULL;
+}
+
+void Reactor::submit(Connection *conn) {
+  dthread_mutex_lock(&m_jobMutex);
+  m_jobs.push_back(conn);
+  dthread_cond_signal(&m_jobCond);
+  dthread_mutex_unlock(&m_jobMutex);
+}
+
+void Reactor::handle(Connection *conn) {
+  try {
+    m_handler(conn->m_request, conn->m_response);
+  } catch (...) {
+    conn->m_response->setStatus(500);
+  }
+}
+
+void Reactor::workerLoop() {
+  while (true) {
+    dthread_mutex_lock(&m_jobMutex);
+    while (m_jobs.empty()) {
+      dthread_cond_wait(&m_jobCond, &m_jobMutex);
+    }
+    Connection *conn = m_jobs.front();
+    m_jobs.pop_front();
+    dthread_mutex_unlock(&m_jobMutex);
+
+    handle(conn);
+    conn->m_loop->complete(conn);
+  }
+}
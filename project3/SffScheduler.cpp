@@ -0,0 +1,100 @@
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "SffScheduler.h"
+#include "dthread.h"
+
+using namespace std;
+
+// how long the acceptor waits for a request line before giving up on it
+#define PEEK_TIMEOUT_MS 10
+#define PEEK_BYTES 1024
+// bytes of priority a waiting request gains per later arrival
+#define AGING_BYTES (64 * 1024)
+
+SffScheduler::SffScheduler(int capacity, string basedir) {
+  m_capacity = capacity > 0 ? capacity : 1;
+  m_basedir = basedir;
+  m_seq = 0;
+  pthread_mutex_init(&m_mutex, NULL);
+  pthread_cond_init(&m_waitCond, NULL);
+  pthread_cond_init(&m_fullCond, NULL);
+}
+
+SffScheduler::~SffScheduler() {
+  pthread_mutex_destroy(&m_mutex);
+  pthread_cond_destroy(&m_waitCond);
+  pthread_cond_destroy(&m_fullCond);
+}
+
+void SffScheduler::push(MySocket *client) {
+  // peek and stat outside the lock, workers keep popping meanwhile
+  off_t size = requestSize(client);
+
+  dthread_mutex_lock(&m_mutex);
+  while (static_cast<int>(m_heap.size()) >= m_capacity) {
+    dthread_cond_wait(&m_fullCond, &m_mutex);
+  }
+
+  Entry entry;
+  entry.seq = m_seq++;
+  entry.key = size + entry.seq * AGING_BYTES;
+  entry.client = client;
+  m_heap.push(entry);
+
+  dthread_cond_signal(&m_waitCond);
+  dthread_mutex_unlock(&m_mutex);
+}
+
+MySocket *SffScheduler::pop(int /*worker*/) {
+  dthread_mutex_lock(&m_mutex);
+  while (m_heap.empty()) {
+    dthread_cond_wait(&m_waitCond, &m_mutex);
+  }
+
+  MySocket *client = m_heap.top().client;
+  m_heap.pop();
+
+  dthread_cond_signal(&m_fullCond);
+  dthread_mutex_unlock(&m_mutex);
+  return client;
+}
+
+off_t SffScheduler::requestSize(MySocket *client) {
+  // Anything we cannot size (slow client, odd request, missing file) is
+  // treated as empty and served right away, FileService sorts it out.
+  struct pollfd pfd;
+  pfd.fd = client->getFd();
+  pfd.events = POLLIN;
+  if (poll(&pfd, 1, PEEK_TIMEOUT_MS) <= 0) {
+    return 0;
+  }
+
+  char buffer[PEEK_BYTES];
+  ssize_t len = recv(client->getFd(), buffer, sizeof(buffer), MSG_PEEK);
+  if (len <= 0) {
+    return 0;
+  }
+
+  // request line: METHOD SP target SP version
+  string line(buffer, len);
+  size_t start = line.find(' ');
+  if (start == string::npos) {
+    return 0;
+  }
+  size_t end = line.find_first_of(" ?#\r\n", start + 1);
+  if (end == string::npos) {
+    return 0;
+  }
+  string path = line.substr(start + 1, end - start - 1);
+  if (path.find("..") != string::npos) {
+    return 0;
+  }
+
+  struct stat st;
+  if (stat((m_basedir + path).c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+    return 0;
+  }
+  return st.st_size;
+}
@@ -0,0 +1,109 @@
+#include "WorkStealingPool.h"
+#include "dthread.h"
+
+using namespace std;
+
+// futex(2) works on the int inside the atomic
+static int *futexWord(atomic<int> *word) {
+  return reinterpret_cast<int *>(word);
+}
+
+WorkStealingPool::WorkStealingPool(int numWorkers, int capacity) {
+  m_numWorkers = numWorkers > 0 ? numWorkers : 1;
+  m_capacity = capacity > 0 ? capacity : 1;
+  m_next = 0;
+  m_queued = 0;
+  m_workSeq = 0;
+  m_idle = 0;
+  m_spaceSeq = 0;
+  m_acceptorWaiting = 0;
+
+  int ringSize = (m_capacity + m_numWorkers - 1) / m_numWorkers;
+  for (int idx = 0; idx < m_numWorkers; idx++) {
+    m_queues.push_back(new MpmcRing<MySocket *>(ringSize));
+  }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+  for (int idx = 0; idx < m_numWorkers; idx++) {
+    delete m_queues[idx];
+  }
+}
+
+void WorkStealingPool::push(MySocket *client) {
+  // wait for the workers to drain the pool below the -b bound
+  while (m_queued.load() >= m_capacity) {
+    int seq = m_spaceSeq.load();
+    m_acceptorWaiting = 1;
+    if (m_queued.load() < m_capacity) {
+      m_acceptorWaiting = 0;
+      break;
+    }
+    dthread_futex_wait(futexWord(&m_spaceSeq), seq);
+    m_acceptorWaiting = 0;
+  }
+  m_queued++;
+
+  // The rings hold at least the -b bound between them, so one of them
+  // has room. A ring can also look full for an instant while a consumer
+  // finishes taking a slot, then we just move on to the next one.
+  while (!m_queues[m_next++ % m_numWorkers]->tryPush(client)) {
+  }
+
+  // any parked worker will do, it steals if the queue is not its own
+  m_workSeq++;
+  if (m_idle.load() > 0) {
+    dthread_futex_wake(futexWord(&m_workSeq), 1);
+  }
+}
+
+MySocket *WorkStealingPool::pop(int worker) {
+  while (true) {
+    MySocket *client = tryPop(worker);
+    if (client == NULL) {
+      client = trySteal(worker);
+    }
+    if (client != NULL) {
+      taken();
+      return client;
+    }
+
+    // Park. Announce ourselves before the last check so a push that
+    // lands in between either sees m_idle or changes m_workSeq.
+    int seq = m_workSeq.load();
+    m_idle++;
+    if (m_queued.load() > 0) {
+      m_idle--;
+      continue;
+    }
+    dthread_futex_wait(futexWord(&m_workSeq), seq);
+    m_idle--;
+  }
+}
+
+MySocket *WorkStealingPool::tryPop(int worker) {
+  MySocket *client;
+  if (m_queues[worker % m_numWorkers]->tryPop(client)) {
+    return client;
+  }
+  return NULL;
+}
+
+MySocket *WorkStealingPool::trySteal(int worker) {
+  for (int offset = 1; offset < m_numWorkers; offset++) {
+    MpmcRing<MySocket *> *queue = m_queues[(worker + offset) % m_numWorkers];
+    MySocket *client;
+    if (!queue->empty() && queue->tryPop(client)) {
+      return client;
+    }
+  }
+  return NULL;
+}
+
+void WorkStealingPool::taken() {
+  m_queued--;
+  m_spaceSeq++;
+  if (m_acceptorWaiting.load()) {
+    dthread_futex_wake(futexWord(&m_spaceSeq), 1);
+  }
+}
@@ -0,0 +1,138 @@
+// Request parsing benchmark: parses a few kinds of request the way the
+// server does, a new HTTP for each, on one core, and reports requests per
+// second for
+//
+//   http_parser: the callback parser, which is what HTTP used to be
+//   fast/<isa>:  FastRequestParser with each instruction set the CPU has
+//
+// for the whole request arriving in one read and for its head split over
+// two, where the fast parser has to pick up where it left off.
+//
+//   $ make parse_bench
+//   $ ./parse_bench [-n requests]
+
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <string>
+
+#include "FastRequestParser.h"
+#include "HTTP.h"
+
+using namespace std;
+
+struct Corpus {
+  const char *name;
+  const char *request;
+};
+
+static const Corpus corpora[] = {
+  {"curl",
+   "GET /hello_world.html HTTP/1.1\r\nHost: localhost:8080\r\n"
+   "User-Agent: curl/7.88.1\r\nAccept: */*\r\n\r\n"},
+  {"browser",
+   "GET /static/css/bootstrap.min.css?v=5.3.2 HTTP/1.1\r\n"
+   "Host: localhost:8080\r\nConnection: keep-alive\r\n"
+   "sec-ch-ua: \"Chromium\";v=\"120\", \"Not?A_Brand\";v=\"24\"\r\n"
+   "sec-ch-ua-mobile: ?0\r\n"
+   "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+   "(KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+   "sec-ch-ua-platform: \"Linux\"\r\nAccept: text/css,*/*;q=0.1\r\n"
+   "Sec-Fetch-Site: same-origin\r\nSec-Fetch-Mode: no-cors\r\n"
+   "Sec-Fetch-Dest: style\r\n"
+   "Referer: http://localhost:8080/bootstrap.html\r\n"
+   "Accept-Encoding: gzip, deflate, br\r\n"
+   "Accept-Language: en-US,en;q=0.9\r\n"
+   "Cookie: session=0123456789abcdef0123456789abcdef; theme=dark\r\n"
+   "If-None-Match: \"ce806a-18df9dbfaf3d589e-235ed\"\r\n"
+   "If-Modified-Since: Sun, 18 Oct 2026 11:57:19 GMT\r\n\r\n"},
+  {"api",
+   "POST /auth-tokens HTTP/1.1\r\nHost: localhost:8080\r\n"
+   "User-Agent: python-requests/2.31.0\r\nAccept-Encoding: gzip, deflate\r\n"
+   "Accept: */*\r\nConnection: keep-alive\r\nx-auth-token: "
+   "5b2f0c3e9d8a4b1c8e7f6a5d4c3b2a19\r\n"
+   "Content-Type: application/x-www-form-urlencoded\r\n"
+   "Content-Length: 26\r\n\r\nusername=sam&password=1234"},
+};
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double run(HTTP::Engine engine, const char *request, bool split,
+                  long requests) {
+  HTTP::setEngine(engine);
+  size_t len = strlen(request);
+  // the first read ends in the middle of the headers
+  size_t first = split ? len / 2 : len;
+  double start = now();
+  for (long idx = 0; idx < requests; idx++) {
+    HTTP *http = new HTTP();
+    int used = http->addData((const unsigned char *) request, first);
+    if (!http->isDone()) {
+      used += http->addData((const unsigned char *) request + used,
+                            len - used);
+    }
+    if (!http->isDone() || used != (int) len) {
+      cerr << "parse failed" << endl;
+      exit(1);
+    }
+    delete http;
+  }
+  return requests / (now() - start);
+}
+
+int main(int argc, char *argv[]) {
+  long requests = 200000;
+  int option;
+
+  while ((option = getopt(argc, argv, "n:")) != -1) {
+    switch (option) {
+    case 'n':
+      requests = atol(optarg);
+      break;
+    default:
+      cerr << "usage: " << argv[0] << " [-n requests]" << endl;
+      exit(1);
+    }
+  }
+
+  // one core, so the numbers are per core
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(0, &cpus);
+  sched_setaffinity(0, sizeof(cpus), &cpus);
+
+  FastRequestParser::Isa isas[] = {FastRequestParser::SCALAR,
+                                   FastRequestParser::SSE42,
+                                   FastRequestParser::AVX2};
+  cout << "request\treads\tbytes\thttp_parser/s";
+  for (size_t isa = 0; isa < sizeof(isas) / sizeof(isas[0]); isa++) {
+    if (FastRequestParser::setIsa(isas[isa])) {
+      cout << "\tfast/" << FastRequestParser::isaName(isas[isa]) << "/s";
+    }
+  }
+  cout << endl;
+
+  for (size_t idx = 0; idx < sizeof(corpora) / sizeof(corpora[0]); idx++) {
+    for (int split = 0; split < 2; split++) {
+      const char *request = corpora[idx].request;
+      cout << corpora[idx].name << "\t" << (split ? 2 : 1) << "\t"
+           << strlen(request) << "\t"
+           << (long) run(HTTP::HTTP_PARSER, request, split, requests);
+      for (size_t isa = 0; isa < sizeof(isas) / sizeof(isas[0]); isa++) {
+        if (FastRequestParser::setIsa(isas[isa])) {
+          cout << "\t" << (long) run(HTTP::FAST, request, split, requests);
+        }
+      }
+      cout << endl;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,170 @@
+// Connection hand-off benchmark: one acceptor thread pushes fake
+// connections, N workers pop them and do no work, and we report hand-offs
+// per second for
+//
+//   deque: the original global deque + req_queue_mutex + wait_cond /
+//          buf_full_cond from gunrock.cpp
+//   pool:  WorkStealingPool, per-worker lock-free rings and futex parking
+//
+// Both go through the dthread wrappers exactly like the server does, so
+// the numbers include the instrumentation cost.
+//
+//   $ make queue_bench
+//   $ ./queue_bench [-n handoffs] [-b buffers] [-w max_workers]
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <deque>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "MySocket.h"
+#include "WorkStealingPool.h"
+#include "dthread.h"
+
+using namespace std;
+
+// workers exit when they pop this
+static MySocket *const STOP = (MySocket *) 1;
+
+class HandOff {
+ public:
+  virtual ~HandOff() {}
+  virtual void push(MySocket *client) = 0;
+  virtual MySocket *pop(int worker) = 0;
+};
+
+class DequeHandOff : public HandOff {
+ public:
+  DequeHandOff(int capacity) {
+    m_capacity = capacity;
+    pthread_mutex_init(&m_mutex, NULL);
+    pthread_cond_init(&m_waitCond, NULL);
+    pthread_cond_init(&m_fullCond, NULL);
+  }
+
+  void push(MySocket *client) {
+    dthread_mutex_lock(&m_mutex);
+    while (static_cast<int>(m_queue.size()) >= m_capacity) {
+      dthread_cond_wait(&m_fullCond, &m_mutex);
+    }
+    m_queue.push_back(client);
+    dthread_cond_signal(&m_waitCond);
+    dthread_mutex_unlock(&m_mutex);
+  }
+
+  MySocket *pop(int /*worker*/) {
+    dthread_mutex_lock(&m_mutex);
+    while (m_queue.size() == 0) {
+      dthread_cond_wait(&m_waitCond, &m_mutex);
+    }
+    MySocket *client = m_queue.front();
+    m_queue.pop_front();
+    dthread_cond_signal(&m_fullCond);
+    dthread_mutex_unlock(&m_mutex);
+    return client;
+  }
+
+ private:
+  int m_capacity;
+  pthread_mutex_t m_mutex;
+  pthread_cond_t m_waitCond;
+  pthread_cond_t m_fullCond;
+  deque<MySocket *> m_queue;
+};
+
+class PoolHandOff : public HandOff {
+ public:
+  PoolHandOff(int workers, int capacity) : m_pool(workers, capacity) {}
+  void push(MySocket *client) { m_pool.push(client); }
+  MySocket *pop(int worker) { return m_pool.pop(worker); }
+
+ private:
+  WorkStealingPool m_pool;
+};
+
+struct WorkerArgs {
+  HandOff *handOff;
+  int worker;
+};
+
+static void *worker(void *arg) {
+  WorkerArgs *args = (WorkerArgs *) arg;
+  while (args->handOff->pop(args->worker) != STOP) {
+  }
+  return NULL;
+}
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double run(HandOff *handOff, int workers, long handOffs) {
+  vector<pthread_t> threads(workers);
+  vector<WorkerArgs> args(workers);
+
+  double start = now();
+  for (int idx = 0; idx < workers; idx++) {
+    args[idx].handOff = handOff;
+    args[idx].worker = idx;
+    pthread_create(&threads[idx], NULL, worker, &args[idx]);
+  }
+  for (long idx = 0; idx < handOffs; idx++) {
+    // any non-NULL pointer will do, nobody dereferences it
+    handOff->push((MySocket *) (intptr_t) (16 + (idx << 4)));
+  }
+  for (int idx = 0; idx < workers; idx++) {
+    handOff->push(STOP);
+  }
+  for (int idx = 0; idx < workers; idx++) {
+    pthread_join(threads[idx], NULL);
+  }
+  return handOffs / (now() - start);
+}
+
+int main(int argc, char *argv[]) {
+  long handOffs = 200000;
+  int buffers = 64;
+  int maxWorkers = 64;
+  int option;
+
+  while ((option = getopt(argc, argv, "n:b:w:")) != -1) {
+    switch (option) {
+    case 'n':
+      handOffs = atol(optarg);
+      break;
+    case 'b':
+      buffers = atoi(optarg);
+      break;
+    case 'w':
+      maxWorkers = atoi(optarg);
+      break;
+    default:
+      cerr << "usage: " << argv[0] << " [-n handoffs] [-b buffers]"
+           << " [-w max_workers]" << endl;
+      exit(1);
+    }
+  }
+
+  // same as the server's default log
+  set_log_file("/dev/null");
+
+  cout << "workers\tdeque/s\tpool/s\tspeedup" << endl;
+  for (int workers = 1; workers <= maxWorkers; workers *= 2) {
+    DequeHandOff deque(buffers);
+    PoolHandOff pool(workers, buffers);
+
+    double dequeRate = run(&deque, workers, handOffs);
+    double poolRate = run(&pool, workers, handOffs);
+    cout << workers << "\t" << (long) dequeRate << "\t" << (long) poolRate
+         << "\t" << poolRate / dequeRate << endl;
+  }
+  return 0;
+}
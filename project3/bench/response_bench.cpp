@@ -0,0 +1,165 @@
+// Response serialization benchmark: builds the response FileService would
+// for a small, a medium and a large body and writes it to /dev/null, on
+// one core, and reports responses per second for
+//
+//   legacy: the serializer HTTPResponse::response() used to be, headers
+//           in a map, Content-Type and Content-Length inserted into it,
+//           everything streamed through a stringstream and the result
+//           handed to a write(std::string) that takes it by value
+//   gather: renderHeaders into a reused buffer and writeResponse, one
+//           writev(2) of the headers and the body where it already is
+//
+// -x leaves out the write, so only building and serializing is measured.
+//
+//   $ make response_bench
+//   $ ./response_bench [-n responses] [-x]
+
+#include <fcntl.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+
+#include "HTTPResponse.h"
+#include "MySocket.h"
+
+using namespace std;
+
+class LegacyResponse {
+ public:
+  LegacyResponse() {
+    m_contentType = "text/html; charset=ISO-8859-1";
+    m_headers["Server"] = "Gunrock Web";
+    m_status = 200;
+  }
+
+  void setHeader(string name, string value) { m_headers[name] = value; }
+  void setContentType(string contentType) { m_contentType = contentType; }
+  void setBody(string data) { m_body = data; }
+
+  string response() {
+    stringstream out;
+    setHeader("Content-Type", m_contentType);
+    stringstream len;
+    len << m_body.size();
+    setHeader("Content-Length", len.str());
+
+    out << "HTTP/1.1 " << m_status << " OK\r\n";
+    map<string, string>::iterator iter;
+    for (iter = m_headers.begin(); iter != m_headers.end(); iter++) {
+      out << iter->first << ": " << iter->second << "\r\n";
+    }
+    out << "\r\n";
+    out << m_body;
+    return out.str();
+  }
+
+ private:
+  int m_status;
+  map<string, string> m_headers;
+  string m_contentType;
+  string m_body;
+};
+
+// what MySocket::write used to look like
+static void legacyWrite(int fd, string data, bool send) {
+  if (send && write(fd, data.data(), data.size()) < 0) {
+    cerr << "write failed" << endl;
+    exit(1);
+  }
+}
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double runLegacy(int fd, const string &body, long responses,
+                        bool send) {
+  double start = now();
+  for (long idx = 0; idx < responses; idx++) {
+    LegacyResponse response;
+    response.setContentType("text/css");
+    response.setHeader("Connection", "keep-alive");
+    response.setHeader("Accept-Ranges", "bytes");
+    response.setHeader("ETag", "\"ce806a-18df9dbfaf3d589e-235ed\"");
+    response.setBody(body);
+    legacyWrite(fd, response.response(), send);
+  }
+  return responses / (now() - start);
+}
+
+static double runGather(MySocket *sink, shared_ptr<const SharedBody> body,
+                        long responses, bool send) {
+  string header;
+  double start = now();
+  for (long idx = 0; idx < responses; idx++) {
+    HTTPResponse response;
+    response.setHeader("Connection", "keep-alive");
+    response.setSharedBody(body);
+    header.clear();
+    response.renderHeaders(header);
+    if (send) {
+      sink->writeResponse(header, response.getBodyData(),
+                          response.getBodyLength());
+    }
+  }
+  return responses / (now() - start);
+}
+
+int main(int argc, char *argv[]) {
+  long responses = 100000;
+  bool send = true;
+  int option;
+
+  while ((option = getopt(argc, argv, "n:x")) != -1) {
+    switch (option) {
+    case 'n':
+      responses = atol(optarg);
+      break;
+    case 'x':
+      send = false;
+      break;
+    default:
+      cerr << "usage: " << argv[0] << " [-n responses] [-x]" << endl;
+      exit(1);
+    }
+  }
+
+  // one core, so the numbers are per core
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(0, &cpus);
+  sched_setaffinity(0, sizeof(cpus), &cpus);
+
+  int fd = open("/dev/null", O_WRONLY);
+  if (fd < 0) {
+    cerr << "could not open /dev/null" << endl;
+    exit(1);
+  }
+  MySocket sink(fd);
+
+  size_t sizes[] = {12, 4096, 65536};
+  cout << "body\tlegacy/s\tgather/s\tspeedup" << endl;
+  for (size_t idx = 0; idx < sizeof(sizes) / sizeof(sizes[0]); idx++) {
+    // the headers ContentCache renders for a cached file
+    shared_ptr<SharedBody> body = make_shared<SharedBody>();
+    body->body.assign(sizes[idx], 'x');
+    body->headers = "Content-Type: text/css\r\nContent-Length: " +
+                    to_string(sizes[idx]) + "\r\nAccept-Ranges: bytes\r\n" +
+                    "ETag: \"ce806a-18df9dbfaf3d589e-235ed\"\r\n";
+
+    double legacyRate = runLegacy(fd, body->body, responses, send);
+    double gatherRate = runGather(&sink, body, responses, send);
+    cout << sizes[idx] << "\t" << (long) legacyRate << "\t"
+         << (long) gatherRate << "\t" << gatherRate / legacyRate << endl;
+  }
+  return 0;
+}
@@ -1,12 +1,25 @@
 #include "dthread.h"
+#include "dtrace.h"
+#include "lockprof.h"
+#include <algorithm>
+#include <atomic>
 #include <iostream>
 #include <string>
 #include <vector>
 #include <sstream>
 
+#include <errno.h>
 #include <fcntl.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 
+#if DTHREAD_TRACE == DTHREAD_TRACE_TEXT
+
 pthread_mutex_t print_lock = PTHREAD_MUTEX_INITIALIZER;
 std::vector<pthread_t> thread_list;
 int logFd = -1;
@@ -19,6 +32,9 @@ void set_log_file(std::string file_name) {
   }
 }
 
+void flush_log() {
+}
+
 void sync_print(std::string function, std::string payload) {
   int ret = pthread_mutex_lock(&print_lock);
   if (ret != 0) {
@@ -57,12 +73,216 @@ void sync_print(std::string function, std::string payload) {
   }
 }
 
-void sync_print_thread(std::string function, pthread_mutex_t *mutex, pthread_cond_t *cond) {
-  std::stringstream payload;
-  payload << " mutex: " << (void *) mutex << " cond: " << (void *) cond;
-  sync_print(function, payload.str());
+static void trace(int event, const void *first, const void *second) {
+  sync_print(DTRACE_NAMES[event], dtrace_payload(event, first, second));
+}
+
+#elif DTHREAD_TRACE == DTHREAD_TRACE_BINARY
+
+// records per thread, a power of two
+#define RING_SIZE 8192
+// longest sync_print() text we keep, in records
+#define MAX_TEXT_RECORDS 32
+// how long the drain thread sleeps when every ring is empty
+#define DRAIN_INTERVAL_NS 1000000
+
+// Single producer (the traced thread), single consumer (whoever holds
+// drain_lock). head and tail only grow, slots are index % RING_SIZE.
+struct TraceRing {
+  alignas(64) std::atomic<uint64_t> head;
+  alignas(64) std::atomic<uint64_t> tail;
+  uint32_t tid;
+  DtraceRecord records[RING_SIZE];
+};
+
+static int logFd = -1;
+static std::atomic<uint32_t> next_tid(0);
+// guards rings, only taken when a thread traces its first event. Never
+// destroyed, the drain thread may still be running during exit.
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<TraceRing *> &rings = *new std::vector<TraceRing *>;
+// one consumer at a time, the drain thread or flush_log()
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static thread_local TraceRing *my_ring = NULL;
+
+static TraceRing *ring_for_thread() {
+  if (my_ring == NULL) {
+    // rings outlive their thread so the drain thread never sees one go
+    // away, there is one per thread the server ever started
+    TraceRing *ring = new TraceRing;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->tid = next_tid++;
+    pthread_mutex_lock(&rings_lock);
+    rings.push_back(ring);
+    pthread_mutex_unlock(&rings_lock);
+    my_ring = ring;
+  }
+  return my_ring;
+}
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Appends a record and count - 1 records of text. The caller fills
+// everything but the header's timestamp and tid.
+static void push(const DtraceRecord &header, const char *text, size_t count) {
+  TraceRing *ring = ring_for_thread();
+  uint64_t head = ring->head.load(std::memory_order_relaxed);
+
+  // the drain thread keeps up unless something is badly wrong, wait for
+  // it rather than drop events the autograder needs
+  while (head + count - ring->tail.load(std::memory_order_acquire) > RING_SIZE) {
+    sched_yield();
+  }
+
+  DtraceRecord *slot = &ring->records[head % RING_SIZE];
+  *slot = header;
+  slot->timestamp = now_ns();
+  slot->tid = ring->tid;
+  for (size_t idx = 1; idx < count; idx++) {
+    memcpy(&ring->records[(head + idx) % RING_SIZE],
+           text + (idx - 1) * sizeof(DtraceRecord), sizeof(DtraceRecord));
+  }
+  ring->head.store(head + count, std::memory_order_release);
+}
+
+static void write_all(const void *buffer, size_t length) {
+  const char *data = (const char *) buffer;
+  while (length > 0) {
+    ssize_t ret = write(logFd, data, length);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      std::cerr << "log file write error, ret = " << ret << std::endl;
+      exit(1);
+    }
+    data += ret;
+    length -= ret;
+  }
 }
 
+// Moves whatever is in the rings to the log file, returns the number of
+// records written.
+static size_t drain() {
+  pthread_mutex_lock(&rings_lock);
+  std::vector<TraceRing *> snapshot = rings;
+  pthread_mutex_unlock(&rings_lock);
+
+  size_t drained = 0;
+  pthread_mutex_lock(&drain_lock);
+  for (size_t idx = 0; idx < snapshot.size(); idx++) {
+    TraceRing *ring = snapshot[idx];
+    uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+    uint64_t head = ring->head.load(std::memory_order_acquire);
+    if (head == tail) {
+      continue;
+    }
+
+    // at most two pieces, the end of the array and its start
+    uint64_t first = tail % RING_SIZE;
+    uint64_t count = head - tail;
+    uint64_t firstCount = std::min(count, (uint64_t) RING_SIZE - first);
+    write_all(&ring->records[first], firstCount * sizeof(DtraceRecord));
+    if (firstCount < count) {
+      write_all(&ring->records[0], (count - firstCount) * sizeof(DtraceRecord));
+    }
+    ring->tail.store(head, std::memory_order_release);
+    drained += count;
+  }
+  pthread_mutex_unlock(&drain_lock);
+  return drained;
+}
+
+static void *drain_thread(void *) {
+  // sleeps only when there was nothing to do
+  while (true) {
+    if (drain() == 0) {
+      struct timespec ts = {0, DRAIN_INTERVAL_NS};
+      nanosleep(&ts, NULL);
+    }
+  }
+  return NULL;
+}
+
+void set_log_file(std::string file_name) {
+  logFd = open(file_name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (logFd < 0) {
+    std::cerr << "Could not open log file: " << file_name << std::endl;
+    exit(1);
+  }
+  write_all(DTRACE_MAGIC, DTRACE_MAGIC_LEN);
+
+  // a plain pthread, the drain thread must not trace itself. It blocks
+  // every signal so they go to threads that handle them.
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  pthread_t thread;
+  int ret = pthread_create(&thread, NULL, drain_thread, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (ret != 0) {
+    std::cerr << "Could not start the log drain thread" << std::endl;
+    exit(1);
+  }
+  pthread_detach(thread);
+  atexit(flush_log);
+}
+
+void flush_log() {
+  if (logFd >= 0) {
+    drain();
+  }
+}
+
+void sync_print(std::string function, std::string payload) {
+  std::string text = function + payload;
+  size_t maxText = (MAX_TEXT_RECORDS - 1) * sizeof(DtraceRecord);
+  if (text.length() > maxText) {
+    text.resize(maxText);
+  }
+  size_t textRecords =
+    (text.length() + sizeof(DtraceRecord) - 1) / sizeof(DtraceRecord);
+  // push() copies whole records
+  text.resize(textRecords * sizeof(DtraceRecord), '\0');
+
+  DtraceRecord header;
+  header.event = DTRACE_TEXT;
+  header.length = std::min(function.length() + payload.length(), maxText);
+  header.object[0] = std::min(function.length(), maxText);
+  header.object[1] = 0;
+  push(header, text.data(), 1 + textRecords);
+}
+
+static void trace(int event, const void *first, const void *second) {
+  DtraceRecord header;
+  header.event = event;
+  header.length = 0;
+  header.object[0] = (uintptr_t) first;
+  header.object[1] = (uintptr_t) second;
+  push(header, NULL, 1);
+}
+
+#else
+
+void set_log_file(std::string) {
+}
+
+void flush_log() {
+}
+
+void sync_print(std::string, std::string) {
+}
+
+static inline void trace(int, const void *, const void *) {
+}
+
+#endif
+
 struct DthreadArgs {
   void *callerArg;
   void *(*start_routine)(void *);
@@ -71,9 +291,9 @@ struct DthreadArgs {
 void *my_start_routine(void *arg) {
   struct DthreadArgs *dthreadArgs = (struct DthreadArgs *) arg;
 
-  sync_print_thread("my_start_routine_enter", NULL, NULL);
+  trace(DTRACE_START_ROUTINE_ENTER, NULL, NULL);
   void *ret = dthreadArgs->start_routine(dthreadArgs->callerArg);
-  sync_print_thread("my_start_routine_return", NULL, NULL);
+  trace(DTRACE_START_ROUTINE_RETURN, NULL, NULL);
 
   delete dthreadArgs;
   return ret;
@@ -88,49 +308,80 @@ int dthread_create(pthread_t *thread, const pthread_attr_t *attr,
 }
 
 int dthread_detach(pthread_t thread) {
-  sync_print_thread("dthread_detach_enter", NULL, NULL);
+  trace(DTRACE_DETACH_ENTER, NULL, NULL);
   int ret = pthread_detach(thread);
-  sync_print_thread("dthread_detach_return", NULL, NULL);
+  trace(DTRACE_DETACH_RETURN, NULL, NULL);
 
   return ret;
 }
 
 int dthread_mutex_lock(pthread_mutex_t *mutex) {
-  sync_print_thread("dthread_mutex_lock_enter", mutex, NULL);
+  trace(DTRACE_MUTEX_LOCK_ENTER, mutex, NULL);
+  uint64_t start = lockprof_start();
   int ret = pthread_mutex_lock(mutex);
-  sync_print_thread("dthread_mutex_lock_return", mutex, NULL);
+  lockprof_acquired(mutex, start);
+  trace(DTRACE_MUTEX_LOCK_RETURN, mutex, NULL);
 
   return ret;
 }
 
 int dthread_mutex_unlock(pthread_mutex_t *mutex) {
-  sync_print_thread("dthread_mutex_unlock_enter", mutex, NULL);
+  trace(DTRACE_MUTEX_UNLOCK_ENTER, mutex, NULL);
+  lockprof_releasing(mutex);
   int ret = pthread_mutex_unlock(mutex);
-  sync_print_thread("dthread_mutex_unlock_return", mutex, NULL);
+  trace(DTRACE_MUTEX_UNLOCK_RETURN, mutex, NULL);
 
   return ret;
 }
 
 int dthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex) {
-  sync_print_thread("dthread_cond_wait_enter", mutex, cond);
+  trace(DTRACE_COND_WAIT_ENTER, mutex, cond);
+  lockprof_releasing(mutex);
+  uint64_t start = lockprof_start();
   int ret = pthread_cond_wait(cond, mutex);
-  sync_print_thread("dthread_cond_wait_return", mutex, cond);
+  lockprof_woken(cond, mutex, start);
+  trace(DTRACE_COND_WAIT_RETURN, mutex, cond);
 
   return ret;
 }
 
 int dthread_cond_signal(pthread_cond_t *cond) {
-  sync_print_thread("dthread_cond_signal_enter", NULL, cond);
+  trace(DTRACE_COND_SIGNAL_ENTER, NULL, cond);
+  lockprof_signalled(cond);
   int ret = pthread_cond_signal(cond);
-  sync_print_thread("dthread_cond_signal_return", NULL, cond);
+  trace(DTRACE_COND_SIGNAL_RETURN, NULL, cond);
 
   return ret;
 }
 
 int dthread_cond_broadcast(pthread_cond_t *cond) {
-  sync_print_thread("dthread_cond_broadcast_enter", NULL, cond);
+  trace(DTRACE_COND_BROADCAST_ENTER, NULL, cond);
+  lockprof_signalled(cond);
   int ret = pthread_cond_broadcast(cond);
-  sync_print_thread("dthread_cond_broadcast_return", NULL, cond);
+  trace(DTRACE_COND_BROADCAST_RETURN, NULL, cond);
 
   return ret;
 }
+
+int dthread_futex_wait(int *addr, int expected) {
+  trace(DTRACE_FUTEX_WAIT_ENTER, addr, NULL);
+  uint64_t start = lockprof_start();
+  int ret = syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+  lockprof_woken(addr, NULL, start);
+  // the word changing before we slept and signals are normal wakeups
+  if (ret != 0 && (errno == EAGAIN || errno == EINTR)) {
+    ret = 0;
+  }
+  trace(DTRACE_FUTEX_WAIT_RETURN, addr, NULL);
+
+  return ret;
+}
+
+int dthread_futex_wake(int *addr, int count) {
+  trace(DTRACE_FUTEX_WAKE_ENTER, addr, NULL);
+  lockprof_signalled(addr);
+  int ret = syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+  trace(DTRACE_FUTEX_WAKE_RETURN, addr, NULL);
+
+  return ret < 0 ? ret : 0;
+}
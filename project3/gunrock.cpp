@@ -1,24 +1,33 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 
-#include <deque>
 #include <iostream>
 #include <memory>
 #include <sstream>
 #include <string>
 #include <vector>
 
+#include "AccessLog.h"
+#include "ContentCache.h"
 #include "FileService.h"
+#include "GzipCache.h"
+#include "HTTP.h"
 #include "HTTPRequest.h"
 #include "HTTPResponse.h"
 #include "HttpService.h"
 #include "HttpUtils.h"
 #include "MyServerSocket.h"
 #include "MySocket.h"
+#include "Reactor.h"
+#include "Scheduler.h"
+#include "SffScheduler.h"
+#include "WorkStealingPool.h"
 #include "dthread.h"
+#include "lockprof.h"
 
 using namespace std;
 
@@ -29,6 +38,36 @@ string BASEDIR = "static";
 string SCHEDALG = "FIFO";
 string LOGFILE = "/dev/null";
 int MODE = 1;
+// event loops for the reactor (-m 2), 0 means one per core
+int EVENT_LOOPS = 0;
+// requests served on one connection before it is closed, 1 disables
+// keep-alive. 0 picks per mode: 100 for the reactor, 1 for modes 0 and 1,
+// where an idle connection would hold a thread until the timeout
+int KEEPALIVE_MAX = 0;
+// seconds an idle keep-alive connection is held open, 0 means forever
+int KEEPALIVE_TIMEOUT = 5;
+// listen(2) backlog
+int LISTEN_BACKLOG = SOMAXCONN;
+// one SO_REUSEPORT listening socket per event loop instead of a shared one
+bool REUSEPORT = false;
+// TCP_DEFER_ACCEPT seconds, 0 is off
+int DEFER_ACCEPT = 0;
+// TCP_NODELAY on accepted connections
+bool NODELAY = false;
+// lock contention profile on SIGUSR1 and at exit
+bool LOCKPROF = false;
+// access log file, "-" is stdout
+string ACCESSLOG = "-";
+// rotate the access log past this many MiB, 0 never
+int ACCESSLOG_ROTATE_MB = 0;
+// MiB of small files FileService keeps in memory, 0 turns the cache off
+int CACHE_MB = 64;
+// MiB of gzipped copies of larger files, 0 only sends existing .gz files
+int GZIP_MB = 32;
+// request parser, FAST or HTTP_PARSER, the build picks the default
+string PARSER = HTTP::getEngine() == HTTP::FAST ? "FAST" : "HTTP_PARSER";
+
+AccessLog *accessLog = NULL;
 
 vector<HttpService *> services;
 
@@ -61,7 +100,20 @@ void invoke_service_method(HttpService *service, HTTPRequest *request,
   }
 }
 
-void handle_request(MySocket *client) {
+void serve_request(HTTPRequest *request, HTTPResponse *response) {
+  HttpService *service = find_service(request);
+  invoke_service_method(service, request, response);
+}
+
+void reactor_request(HTTPRequest *request, HTTPResponse *response) {
+  // runs on a reactor worker, the event loop writes the response and
+  // the access log line
+  serve_request(request, response);
+}
+
+// Reads and answers one request on client, returns true if the
+// connection should stay open for another one
+bool handle_one_request(MySocket *client, int served) {
   HTTPRequest *request = new HTTPRequest(client, PORT);
   HTTPResponse *response = new HTTPResponse();
   stringstream payload;
@@ -78,15 +130,28 @@ void handle_request(MySocket *client) {
   }
 
   if (!readResult) {
-    // there was a problem reading in the request, bail
+    // a keep-alive client closing or going quiet between requests is the
+    // normal end of a connection, anything else is a problem reading in
+    // the request
+    bool idle = served > 0 && request->isEmpty();
     delete response;
     delete request;
-    sync_print("read_request_error", payload.str());
-    return;
+    sync_print(idle ? "read_request_idle" : "read_request_error",
+               payload.str());
+    return false;
   }
 
-  HttpService *service = find_service(request);
-  invoke_service_method(service, request, response);
+  uint64_t started = AccessLog::now();
+  serve_request(request, response);
+
+  bool keepAlive = request->isKeepAlive() && served + 1 < KEEPALIVE_MAX;
+  // HTTP/1.0 has no chunks, a body of unknown length ends with the
+  // connection
+  if (response->isChunked() && !request->isHttp11()) {
+    response->endWithConnection();
+    keepAlive = false;
+  }
+  response->setHeader("Connection", keepAlive ? "keep-alive" : "close");
 
   // send data back to the client and clean up
   payload.str("");
@@ -94,14 +159,49 @@ void handle_request(MySocket *client) {
   payload << " RESPONSE " << response->getStatus()
           << " client: " << (void *)client;
   sync_print("write_response", payload.str());
-  cout << payload.str() << endl;
-  client->write(response->response());
+  // the headers go into a buffer this thread keeps, the body is sent
+  // from where it already is
+  static thread_local string header;
+  header.clear();
+  response->renderHeaders(header);
+  size_t bytes = header.length();
+  try {
+    if (response->hasFileBody()) {
+      client->sendFile(header, response->getFileFd(),
+                       response->getFileOffset(), response->getFileLength());
+      bytes += response->getFileLength();
+    } else if (response->getBodySource() != NULL) {
+      // the headers go out before the first byte of the body exists
+      client->write(header);
+      bytes += HttpUtils::writeSource(client, response->getBodySource(),
+                                      response->isChunked(),
+                                      response->getSourceLength());
+    } else {
+      client->writeResponse(header, response->getBodyData(),
+                            response->getBodyLength());
+      bytes += response->getBodyLength();
+    }
+  } catch (...) {
+    keepAlive = false;
+  }
+  accessLog->log(request->getMethod(), request->getPath(),
+                 response->getStatus(), bytes, AccessLog::now() - started);
 
   delete response;
   delete request;
+  return keepAlive;
+}
+
+void handle_request(MySocket *client) {
+  stringstream payload;
+
+  // an idle keep-alive connection gives its thread back after the timeout
+  client->setReadTimeout(KEEPALIVE_TIMEOUT);
+  int served = 0;
+  while (handle_one_request(client, served)) {
+    served++;
+  }
 
-  payload.str("");
-  payload.clear();
   payload << " client: " << (void *)client;
   sync_print("close_connection", payload.str());
   client->close();
@@ -109,36 +209,19 @@ void handle_request(MySocket *client) {
 }
 
 // Shared variables
-pthread_mutex_t req_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-pthread_cond_t wait_cond = PTHREAD_COND_INITIALIZER;
-pthread_cond_t buf_full_cond = PTHREAD_COND_INITIALIZER;
+Scheduler *scheduler = NULL;
 
-deque<MySocket *> req_queue = deque<MySocket *>();
-
-void *worker_job(void *emily) {
+void *worker_job(void *arg) {
   /*
    * Worker thread function
    * Waits for a connection then handles request
    */
+  int worker = (int) (intptr_t) arg;
+
   // Worker loop
   while (true) {
-    // Wait for a request
-    dthread_mutex_lock(&req_queue_mutex);
-    while (req_queue.size() == 0) {
-      if (dthread_cond_wait(&wait_cond, &req_queue_mutex) != 0) {
-        cerr << "Wait on wait condition failed\n";
-        return NULL;
-      }
-    }
-    // Process request
-    // Get request at front of the queue
-    MySocket *client = req_queue.front();
-    req_queue.pop_front();
-    // Signal that a request was processed (buffer shrunk by 1)
-    dthread_cond_signal(&buf_full_cond);
-
-    dthread_mutex_unlock(&req_queue_mutex);
+    // Wait for the connection the scheduler picks for us
+    MySocket *client = scheduler->pop(worker);
 
     // Handle request
     handle_request(client);
@@ -151,7 +234,7 @@ int main(int argc, char *argv[]) {
   signal(SIGPIPE, SIG_IGN);
   int option;
 
-  while ((option = getopt(argc, argv, "d:p:t:b:s:l:m:")) != -1) {
+  while ((option = getopt(argc, argv, "d:p:t:b:s:l:m:e:k:i:q:ra:nco:z:C:g:P:")) != -1) {
     switch (option) {
     case 'd':
       BASEDIR = string(optarg);
@@ -174,28 +257,138 @@ int main(int argc, char *argv[]) {
     case 'm':
       MODE = atoi(optarg);
       break;
+    case 'e':
+      EVENT_LOOPS = atoi(optarg);
+      break;
+    case 'k':
+      KEEPALIVE_MAX = atoi(optarg);
+      break;
+    case 'i':
+      KEEPALIVE_TIMEOUT = atoi(optarg);
+      break;
+    case 'q':
+      LISTEN_BACKLOG = atoi(optarg);
+      break;
+    case 'r':
+      REUSEPORT = true;
+      break;
+    case 'a':
+      DEFER_ACCEPT = atoi(optarg);
+      break;
+    case 'n':
+      NODELAY = true;
+      break;
+    case 'c':
+      LOCKPROF = true;
+      break;
+    case 'o':
+      ACCESSLOG = string(optarg);
+      break;
+    case 'z':
+      ACCESSLOG_ROTATE_MB = atoi(optarg);
+      break;
+    case 'C':
+      CACHE_MB = atoi(optarg);
+      break;
+    case 'g':
+      GZIP_MB = atoi(optarg);
+      break;
+    case 'P':
+      PARSER = string(optarg);
+      break;
     default:
       cerr << "usage: " << argv[0] << " [-p port] [-t threads] [-b buffers]"
+           << " [-s FIFO|SFF] [-m mode] [-e event_loops] [-k keepalive_max]"
+           << " [-i idle_timeout] [-q backlog] [-r] [-a defer_secs] [-n] [-c]"
+           << " [-o access_log] [-z rotate_mb] [-C cache_mb]"
+           << " [-g gzip_mb] [-P FAST|HTTP_PARSER]"
            << endl;
       exit(1);
     }
   }
 
+  if (SCHEDALG != "FIFO" && SCHEDALG != "SFF") {
+    cerr << "unknown scheduling algorithm " << SCHEDALG
+         << ", use FIFO or SFF" << endl;
+    exit(1);
+  }
+  if (KEEPALIVE_MAX <= 0) {
+    KEEPALIVE_MAX = MODE == 2 ? 100 : 1;
+  }
+  if (PARSER == "FAST") {
+    HTTP::setEngine(HTTP::FAST);
+  } else if (PARSER == "HTTP_PARSER") {
+    HTTP::setEngine(HTTP::HTTP_PARSER);
+  } else {
+    cerr << "unknown parser " << PARSER << ", use FAST or HTTP_PARSER"
+         << endl;
+    exit(1);
+  }
+
   set_log_file(LOGFILE);
+  if (LOCKPROF) {
+    // before any thread exists so they all inherit its signal mask
+    lockprof_enable(cerr);
+  }
+  accessLog = new AccessLog(ACCESSLOG,
+                            (size_t) ACCESSLOG_ROTATE_MB * 1024 * 1024);
+  accessLog->start();
 
   sync_print("init", "");
-  auto server = make_unique<MyServerSocket>(PORT);
+  auto server = make_unique<MyServerSocket>(PORT, LISTEN_BACKLOG,
+                                            REUSEPORT && MODE == 2,
+                                            DEFER_ACCEPT);
+  server->setNoDelay(NODELAY);
   MySocket *client;
 
   // The order that you push services dictates the search order
   // for path prefix matching
-  services.push_back(new FileService(BASEDIR));
+  ContentCache *cache = NULL;
+  if (CACHE_MB > 0) {
+    cache = new ContentCache(BASEDIR, (size_t) CACHE_MB * 1024 * 1024);
+    if (!cache->start()) {
+      cerr << "could not watch " << BASEDIR << ", content cache off" << endl;
+      delete cache;
+      cache = NULL;
+    }
+  }
+  GzipCache *gzip = NULL;
+  if (GZIP_MB > 0) {
+    gzip = new GzipCache((size_t) GZIP_MB * 1024 * 1024);
+  }
+  services.push_back(new FileService(BASEDIR, cache, gzip));
 
-  if (MODE) {
+  if (MODE == 2) {
+    // Reactor: event loops own the sockets, -t workers run the services
+    int loops = EVENT_LOOPS;
+    if (loops <= 0) {
+      loops = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    // with -r every loop gets its own socket and the kernel balances
+    // new connections between them
+    vector<MyServerSocket *> listeners;
+    listeners.push_back(server.get());
+    for (int i = 1; REUSEPORT && i < loops; i++) {
+      MyServerSocket *listener =
+          new MyServerSocket(PORT, LISTEN_BACKLOG, true, DEFER_ACCEPT);
+      listener->setNoDelay(NODELAY);
+      listeners.push_back(listener);
+    }
+    Reactor reactor(listeners, loops, THREAD_POOL_SIZE, &reactor_request);
+    reactor.setKeepAlive(KEEPALIVE_MAX, KEEPALIVE_TIMEOUT);
+    reactor.setAccessLog(accessLog);
+    reactor.run();
+  } else if (MODE) {
     pthread_t thread_pool[THREAD_POOL_SIZE];
+    if (SCHEDALG == "SFF") {
+      scheduler = new SffScheduler(BUFFER_SIZE, BASEDIR);
+    } else {
+      scheduler = new WorkStealingPool(THREAD_POOL_SIZE, BUFFER_SIZE);
+    }
     // Create workers
     for (int i = 0; i < THREAD_POOL_SIZE; i++) {
-      if (dthread_create(&thread_pool[i], NULL, &worker_job, NULL) != 0) {
+      if (dthread_create(&thread_pool[i], NULL, &worker_job,
+                         (void *) (intptr_t) i) != 0) {
         cerr << "Error creating thread\n";
         return 1;
       }
@@ -213,20 +406,8 @@ int main(int argc, char *argv[]) {
       client = server->accept();
       sync_print("client_accepted", "");
 
-      // Wait for buffer to clear up
-      dthread_mutex_lock(&req_queue_mutex);
-      while (static_cast<int>(req_queue.size()) >= BUFFER_SIZE) {
-        if (dthread_cond_wait(&buf_full_cond, &req_queue_mutex) != 0) {
-          cerr << "Wait on buffer full condition failed\n";
-          exit(1);
-        }
-      }
-
-      req_queue.push_back(client);
-      // Signal new request
-      dthread_cond_signal(&wait_cond);
-
-      dthread_mutex_unlock(&req_queue_mutex);
+      // Blocks while -b connections are already waiting
+      scheduler->push(client);
     }
   } else {
     // Single-threaded web server logic
@@ -0,0 +1,91 @@
+#ifndef _ACCESSLOG_H_
+#define _ACCESSLOG_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+/**
+ * One line per response, written off the request path. Each thread
+ * formats its entries into its own buffer and a background thread
+ * collects the buffers every FLUSH_INTERVAL_MS and writes them out in one
+ * go. A thread whose buffer is full because the writer fell behind drops
+ * the entry and counts it instead of waiting; the writer notes drops in
+ * the log itself.
+ *
+ * Lines look like
+ *
+ *   2024-05-01T17:03:12Z GET /hello_world.html 200 1532 87
+ *
+ * with the UTC time the response was sent, method, path, status,
+ * response bytes and latency in microseconds from the request being read
+ * to the response being handed to the socket.
+ *
+ * There is one buffer per thread per process, so create a single
+ * AccessLog.
+ */
+class AccessLog {
+ public:
+  /**
+   * @param file where to append, "-" for stdout
+   * @param rotateBytes once the file grows past this it is renamed to
+   *        file.1 (file.1 to file.2 and so on, KEEP_FILES in total) and a
+   *        new one is started. 0 never rotates, stdout never rotates.
+   */
+  AccessLog(std::string file, size_t rotateBytes);
+
+  /**
+   * Starts the writer thread. Call before the threads that log exist so
+   * it does not steal their signals.
+   */
+  void start();
+
+  void log(const char *method, const std::string &path, int status,
+           size_t bytes, uint64_t latencyUs);
+
+  /**
+   * Writes out every buffer right away, also runs at exit.
+   */
+  void flush();
+
+  unsigned long dropped() { return m_dropped.load(); }
+
+  /**
+   * Monotonic clock in microseconds, for measuring latencies to log.
+   */
+  static uint64_t now();
+
+ private:
+  struct Buffer {
+    pthread_mutex_t mutex;
+    std::string data;
+    // formatted time of the last entry, rebuilt once per second
+    time_t second;
+    std::string stamp;
+  };
+
+  Buffer *threadBuffer();
+  void openFile();
+  void rotate();
+  void writeOut(const std::string &data);
+  static void *writerThread(void *arg);
+
+  std::string m_file;
+  size_t m_rotateBytes;
+  int m_fd;
+  size_t m_written;
+
+  pthread_mutex_t m_buffersMutex;
+  std::vector<Buffer *> m_buffers;
+  // one writer at a time, the background thread or flush()
+  pthread_mutex_t m_writeMutex;
+
+  std::atomic<unsigned long> m_dropped;
+  unsigned long m_reportedDrops;
+};
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+#include <string_view>
+
+/**
+ * Bump allocator for memory that lives exactly as long as its owner, one
+ * request. The first INLINE_BYTES are part of the arena itself, so a
+ * request whose head fits in them never calls malloc. Past that it takes
+ * blocks of BLOCK_BYTES or more, and frees them all at once when it goes.
+ * Nothing is freed on its own.
+ */
+class Arena {
+ public:
+  Arena();
+  ~Arena();
+
+  /**
+   * @return size bytes at a multiple of align, a power of two
+   */
+  char *allocate(size_t size, size_t align = 1);
+
+  std::string_view copy(const char *data, size_t len);
+
+  /**
+   * view with len more bytes of data after it, for strings that arrive in
+   * pieces. view must come from this arena (or be empty). It grows in
+   * place when it is the last thing allocated, which is the usual case of
+   * one piece right after another, or in the room left after the last few
+   * strings that were copied; otherwise both are copied to new space with
+   * as much again kept free after them.
+   */
+  std::string_view append(std::string_view view, const char *data,
+                          size_t len);
+
+ private:
+  static const size_t INLINE_BYTES = 4096;
+  static const size_t BLOCK_BYTES = 16384;
+
+  // strings append() gave room to grow, one per string arriving in pieces
+  static const size_t SPARES = 4;
+
+  struct Block {
+    Block *next;
+  };
+
+  // where a string ends and how far it may grow
+  struct Spare {
+    char *end;
+    char *limit;
+  };
+
+  Arena(const Arena &);
+  Arena &operator=(const Arena &);
+
+  char *m_top;
+  char *m_end;
+  // taken from malloc, newest first
+  Block *m_blocks;
+  Spare m_spares[SPARES];
+  size_t m_nextSpare;
+  alignas(16) char m_inline[INLINE_BYTES];
+};
+
+#endif
@@ -0,0 +1,124 @@
+#ifndef _CONTENTCACHE_H_
+#define _CONTENTCACHE_H_
+
+#include <pthread.h>
+#include <time.h>
+
+#include <atomic>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "HTTPResponse.h"
+
+/**
+ * What FileService remembers about one path: the file with its headers
+ * rendered, or that there is no such file.
+ */
+struct CachedFile {
+  // no regular file at this path, a 404
+  bool missing;
+  std::shared_ptr<const SharedBody> content;
+  // validators for conditional requests, also rendered in content
+  std::string etag;
+  std::string lastModified;
+  time_t modified;
+  // responses vary by Accept-Encoding, and if gzipContent is set it is
+  // the gzip encoding with its own tag
+  bool negotiated;
+  std::shared_ptr<const SharedBody> gzipContent;
+  std::string gzipEtag;
+};
+
+/**
+ * Small static files kept in memory so FileService can answer repeat
+ * requests with no system calls at all. Entries live in SHARDS LRU lists,
+ * each with its own lock and a slice of the byte budget, so threads
+ * serving different files rarely meet.
+ *
+ * An inotify thread watches the base directory and every directory under
+ * it, and drops the entry for any path that is written, created, removed,
+ * renamed or has its attributes changed, and the one for "x" when "x.gz"
+ * changes. Directory changes and inotify queue overflows drop everything.
+ * Changes behind a symlink that leads out of basedir go unnoticed.
+ */
+class ContentCache {
+ public:
+  /**
+   * @param basedir the directory FileService serves from
+   * @param budget bytes of file data and headers to keep, in total
+   */
+  ContentCache(std::string basedir, size_t budget);
+
+  /**
+   * Starts watching basedir. Without inotify (start returns false) the
+   * cache stays empty and FileService goes to disk every time.
+   */
+  bool start();
+
+  /**
+   * Takes a snapshot to hand to insert() later. Read it before going to
+   * disk so a change that lands while the file is being read keeps the
+   * stale copy out.
+   */
+  unsigned long generation() { return m_generation.load(); }
+
+  /**
+   * @return the entry for path, or NULL
+   */
+  std::shared_ptr<const CachedFile> lookup(const std::string &path);
+
+  /**
+   * Adds an entry unless something changed since generation was taken.
+   */
+  void insert(const std::string &path, std::shared_ptr<const CachedFile> file,
+              unsigned long generation);
+
+  /**
+   * Files larger than this are never cached, they go out with sendfile.
+   */
+  size_t maxFileBytes() { return m_maxFileBytes; }
+
+  /**
+   * Turns "static//css/./a.css" into "static/css/a.css", so every
+   * spelling of a path shares one entry and one invalidation.
+   */
+  static std::string normalize(const std::string &path);
+
+ private:
+  struct Node {
+    std::string path;
+    std::shared_ptr<const CachedFile> file;
+    size_t bytes;
+  };
+
+  struct Shard {
+    pthread_mutex_t mutex;
+    size_t bytes;
+    // most recently used first
+    std::list<Node> lru;
+    std::unordered_map<std::string, std::list<Node>::iterator> index;
+  };
+
+  Shard &shardFor(const std::string &path);
+  void invalidate(const std::string &path);
+  void invalidateAll();
+  void addWatches(const std::string &dir);
+  void watch();
+  static void *watchThread(void *arg);
+
+  std::string m_basedir;
+  size_t m_shardBudget;
+  size_t m_maxFileBytes;
+  std::atomic<bool> m_enabled;
+  std::atomic<unsigned long> m_generation;
+  Shard *m_shards;
+
+  int m_inotifyFd;
+  // only touched by the watch thread
+  std::map<int, std::string> m_watches;
+};
+
+#endif
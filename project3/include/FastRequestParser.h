@@ -0,0 +1,73 @@
+#ifndef _FASTREQUESTPARSER_H_
+#define _FASTREQUESTPARSER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string_view>
+
+#include "HTTP.h"
+
+/**
+ * Request head parser in the style of picohttpparser. Instead of feeding
+ * http_parser a byte at a time and collecting what its callbacks hand
+ * over, HTTP buffers the head until the blank line that ends it and this
+ * parses it in one pass, with the request line and header values scanned
+ * 16 or 32 bytes at a time (SSE4.2 or AVX2, whichever the CPU has, picked
+ * at startup) and everything it returns pointing into the head.
+ *
+ * It only takes the requests this server serves: GET, HEAD, POST, PUT and
+ * DELETE of an origin-form URL without a fragment, HTTP/d.d, CRLF or LF
+ * line ends, and a body given by Content-Length or none. Anything else,
+ * Transfer-Encoding, Upgrade, CONNECT, odd spacing, comes back as
+ * UNSUPPORTED and HTTP hands the head to http_parser instead, so between
+ * them they accept exactly what http_parser alone does.
+ */
+class FastRequestParser {
+ public:
+  typedef enum {SCALAR, SSE42, AVX2} Isa;
+  typedef enum {PARSED, UNSUPPORTED, NO_ROOM} Result;
+
+  struct Head {
+    // an enum http_method
+    unsigned char method;
+    std::string_view url;
+    std::string_view path;
+    std::string_view query;
+    unsigned short httpMajor;
+    unsigned short httpMinor;
+    // -1 without a Content-Length
+    int64_t contentLength;
+    // what http_should_keep_alive would say
+    bool keepAlive;
+    size_t headerCount;
+  };
+
+  /**
+   * Looks for the end of a head in the next len bytes of it, given the
+   * part that came before.
+   *
+   * @return the number of bytes of data that finish the head, or
+   *         std::string_view::npos if they do not
+   */
+  static size_t findEnd(std::string_view head, const char *data,
+                        size_t len);
+
+  /**
+   * Parses a complete head, as findEnd delimits it, into out and headers.
+   *
+   * @return NO_ROOM if there are more than capacity headers
+   */
+  static Result parse(std::string_view head, Head &out, HttpHeader *headers,
+                      size_t capacity);
+
+  /**
+   * The instruction set the scanners use. setIsa is for benchmarks and
+   * fails if the CPU does not have isa.
+   */
+  static Isa getIsa();
+  static bool setIsa(Isa isa);
+  static const char *isaName(Isa isa);
+};
+
+#endif
@@ -1,23 +1,85 @@
 #ifndef _FILESERVICE_H_
 #define _FILESERVICE_H_
 
+#include "ContentCache.h"
+#include "GzipCache.h"
 #include "HttpService.h"
 
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include <memory>
 #include <string>
 
 class FileService : public HttpService {
  public:
-  FileService(std::string basedir);
+  /**
+   * @param basedir the directory to serve
+   * @param cache keeps small files in memory, NULL to always go to disk
+   * @param gzip keeps compressed copies of larger files, NULL to only
+   *        send the .gz files that are already there
+   */
+  FileService(std::string basedir, ContentCache *cache = NULL,
+              GzipCache *gzip = NULL);
   ~FileService();
 
   virtual void get(HTTPRequest *request, HTTPResponse *response);
   virtual void head(HTTPRequest *request, HTTPResponse *response);
 
 private:
+  typedef enum {RANGE_IGNORED, RANGE_PARTIAL, RANGE_UNSATISFIABLE} RangeResult;
+
   bool endswith(std::string str, std::string suffix);
-  std::string readFile(std::string path);
+  std::string contentType(std::string path);
+  std::string etag(const struct stat &st);
+  std::string gzipEtag(const std::string &etag);
+  /**
+   * Whether path is text worth compressing, which also means responses
+   * for it vary by Accept-Encoding.
+   */
+  bool compressible(std::string path, off_t size);
+  bool acceptsGzip(HTTPRequest *request);
+  /**
+   * An RFC 7231 date, as Last-Modified and If-Modified-Since use.
+   */
+  std::string httpDate(time_t when);
+  /**
+   * Whether the client's copy is current, from If-None-Match or, without
+   * it, If-Modified-Since.
+   */
+  bool notModified(HTTPRequest *request, const std::string &etag,
+                   time_t modified);
+  void setNotModified(HTTPResponse *response, const std::string &etag,
+                      const std::string &lastModified);
+  /**
+   * Answers from the cache, with the gzip encoding if gzip is set and
+   * there is one. On a miss it reads the file into the cache. Returns
+   * false when the file cannot be cached and has to come from disk.
+   */
+  bool getCached(HTTPRequest *request, std::string path,
+                 HTTPResponse *response, bool gzip);
+  std::shared_ptr<const CachedFile> loadFile(std::string path);
+  void loadGzip(std::string path, std::shared_ptr<CachedFile> file);
+  /**
+   * Answers with the gzip encoding of path, open as fd with status st,
+   * from a .gz sibling or m_gzip. fd is -1 for HEAD. Returns false when
+   * there is none and the file goes out as it is.
+   */
+  bool getGzip(HTTPRequest *request, const std::string &path, int fd,
+               const struct stat &st, HTTPResponse *response);
+  /**
+   * Works out which bytes of a size byte file a Range header asks for.
+   *
+   * @return RANGE_PARTIAL with start and length filled in, RANGE_IGNORED
+   *         when the header should be ignored and the whole file sent,
+   *         or RANGE_UNSATISFIABLE for a 416
+   */
+  int parseRange(std::string value, off_t size, off_t &start, off_t &length);
 
   std::string m_basedir;
+  ContentCache *m_cache;
+  GzipCache *m_gzip;
 };
 
 #endif
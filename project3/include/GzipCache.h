@@ -0,0 +1,108 @@
+#ifndef _GZIPCACHE_H_
+#define _GZIPCACHE_H_
+
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "HTTPResponse.h"
+
+/**
+ * gzip encodings of files too large for ContentCache, compressed once and
+ * kept in anonymous memory files (memfd_create) so they go out with
+ * sendfile(2) like any other file. Entries remember the inode, size and
+ * modification time they were made from and are redone when the file
+ * changes; the least recently used are closed once the budget is spent.
+ * Files that do not compress to a quarter of the budget are remembered
+ * as such and sent as they are.
+ */
+class GzipCache {
+ public:
+  /**
+   * @param budget bytes of compressed data to keep, in total
+   */
+  GzipCache(size_t budget);
+
+  /**
+   * The gzip encoding of path, open as fd with status st, compressing it
+   * first if there is no current entry.
+   *
+   * @param length set to the compressed size
+   * @return a new descriptor the caller owns, or -1 if the file could not
+   *         be compressed or is too large to keep
+   */
+  int get(const std::string &path, int fd, const struct stat &st,
+          size_t &length);
+
+  /**
+   * Like get but never compresses, for HEAD.
+   *
+   * @return whether there is a current entry, with length set
+   */
+  bool find(const std::string &path, const struct stat &st, size_t &length);
+
+  /**
+   * gzips in into out in one go, for bodies already in memory.
+   */
+  static bool compress(const std::string &in, std::string &out);
+
+ private:
+  struct Entry {
+    std::string path;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    // -1 when it could not be compressed
+    int fd;
+    size_t length;
+  };
+
+  typedef std::list<Entry>::iterator EntryIter;
+
+  bool current(const Entry &entry, const struct stat &st);
+  // with m_mutex held
+  void remove(EntryIter entry);
+  int compressFile(int fd, off_t size, size_t &length);
+
+  size_t m_budget;
+  size_t m_bytes;
+  pthread_mutex_t m_mutex;
+  // most recently used first
+  std::list<Entry> m_lru;
+  std::unordered_map<std::string, EntryIter> m_index;
+};
+
+/**
+ * Compresses a file while it is being sent, for files too large for
+ * GzipCache to keep. Memory use does not depend on the file: zlib's state
+ * plus one buffer of input.
+ */
+class GzipSource : public BodySource {
+ public:
+  /**
+   * @param fd the file, which the source owns and closes
+   * @param size bytes of it to compress
+   */
+  GzipSource(int fd, off_t size);
+  ~GzipSource();
+
+  ssize_t read(char *buffer, size_t size);
+
+ private:
+  int m_fd;
+  off_t m_size;
+  off_t m_offset;
+  z_stream m_stream;
+  bool m_ready;
+  bool m_finished;
+  std::vector<unsigned char> m_input;
+};
+
+#endif
@@ -1,15 +1,47 @@
 #ifndef _HTTP_H_
 #define _HTTP_H_
 
+#include "Arena.h"
 #include "http_parser.h"
 
 #include <string>
+#include <string_view>
 #include <vector>
 #include <map>
 
+// Which parser reads requests, picked at build time with
+// make PARSER=FAST|HTTP_PARSER and changed at run time with
+// HTTP::setEngine.
+//
+//   FAST:        FastRequestParser, handing whatever it does not take to
+//                http_parser
+//   HTTP_PARSER: http_parser for everything, the original behaviour
+#define HTTP_ENGINE_HTTP_PARSER 0
+#define HTTP_ENGINE_FAST 1
+
+#ifndef HTTP_ENGINE
+#define HTTP_ENGINE HTTP_ENGINE_FAST
+#endif
+
+/**
+ * One header line, both halves pointing into the request's arena.
+ */
+struct HttpHeader {
+    std::string_view name;
+    std::string_view value;
+};
+
 class HTTP {
  public:
     typedef enum {INIT, HEADER, FIELD, VALUE, BODY, DONE} HttpState;
+    typedef enum {
+        HTTP_PARSER = HTTP_ENGINE_HTTP_PARSER,
+        FAST = HTTP_ENGINE_FAST
+    } Engine;
+
+    // for requests parsed from now on, responses always use http_parser
+    static void setEngine(Engine engine);
+    static Engine getEngine();
 
     HTTP(http_parser_type httpType = HTTP_REQUEST);
     ~HTTP();
@@ -17,6 +49,8 @@ class HTTP {
     int addData(const unsigned char *data, int len);
     bool isDone();
     bool isHeaderDone();
+    // valid once isDone(), follows the Connection header and HTTP version
+    bool shouldKeepAlive();
     std::string getProxyRequest(const char *userAgent = NULL);
     std::string getReplyHeader();
     std::string getHost();
@@ -24,15 +58,26 @@ class HTTP {
     std::string getPath();
     bool isConnect() {return m_method == HTTP_CONNECT;}
     bool isHead() {return m_method == HTTP_HEAD;}
+    // HTTP/1.1 or later, which knows chunked bodies
+    bool isHttp11() {
+      return m_httpMajor > 1 || (m_httpMajor == 1 && m_httpMinor >= 1);
+    }
     bool isGet() {return m_method == HTTP_GET;}
     bool isPut() {return m_method == HTTP_PUT;}
     bool isPost() {return m_method == HTTP_POST;}
     bool isDelete() {return m_method == HTTP_DELETE;}
+    const char *getMethod() {return http_method_str((enum http_method) m_method);}
     std::string getBody();
-    std::string getQuery() {return m_query;}
-    std::vector< std::pair< std::string *, std::string *> > getHeaders() {
-      return m_headers;
-    }
+    std::string getQuery() {return std::string(m_query);}
+    size_t getHeaderCount() {return m_headerCount;}
+    const HttpHeader &getHeader(size_t idx) {return m_headers[idx];}
+    /**
+     * Looks a header up by name, whatever its case, in constant time for
+     * the first INDEXED_HEADERS of them.
+     *
+     * @return the first header with that name, or NULL
+     */
+    const HttpHeader *findHeader(std::string_view name);
   
  private:
     static int message_begin_cb(http_parser *parser);
@@ -53,25 +98,52 @@ class HTTP {
     void appendHeaderField(const char *at, size_t len);
     void appendHeaderValue(const char *at, size_t len);
     void addHeaderField();
+    void indexHeader(size_t idx);
     void messageComplete(unsigned char method);
+    int parserAddData(const char *data, int len);
+    int fastAddData(const char *data, int len);
+    bool parseHead();
+    int replayHead(const char *data, int len, int used);
 
     http_parser_settings m_settings;
     http_parser m_parser;
     HttpState m_state;
     bool m_doneParsing;
     bool m_headerDone;
+    bool m_keepAlive;
+
+    // headers past this many are found by a scan
+    static const size_t INDEXED_HEADERS = 32;
+    static const size_t INDEX_SLOTS = 2 * INDEXED_HEADERS;
+    static const size_t INITIAL_HEADERS = 16;
 
-    std::string m_url;
-    std::string m_path;
-    std::string m_query;
-    std::string m_host;
-    std::string *m_field;
-    std::string *m_value;
-    std::vector< std::pair< std::string *, std::string *> > m_headers;
+    // the request line and headers, everything below points into it
+    Arena m_arena;
+    std::string_view m_url;
+    std::string_view m_path;
+    std::string_view m_query;
+    std::string_view m_host;
+    // the header being parsed, if m_inField
+    bool m_inField;
+    std::string_view m_field;
+    std::string_view m_value;
+    HttpHeader *m_headers;
+    size_t m_headerCount;
+    size_t m_headerCapacity;
+    // open addressing by name, header index plus one, 0 for a free slot
+    unsigned char m_index[INDEX_SLOTS];
     std::string m_body;
     std::string m_statusStr;
     unsigned char m_method;
+    unsigned short m_httpMajor;
+    unsigned short m_httpMinor;
     http_parser_type m_httpType;
+    // FastRequestParser's state: the head so far, and once it is parsed
+    // the body bytes still to come
+    bool m_fast;
+    bool m_failed;
+    std::string_view m_head;
+    int64_t m_bodyLeft;
     int m_extraParsedBytes;
 };
 
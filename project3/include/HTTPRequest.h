@@ -10,6 +10,7 @@
 
 #include <map>
 #include <string>
+#include <string_view>
 #include <vector>
 
 class HTTPRequest {
@@ -19,20 +20,40 @@ public:
   
   bool readRequest();
 
+  /**
+   * Feeds bytes from a non-blocking socket to the parser, for callers
+   * that do their own reads.
+   *
+   * @return the number of bytes consumed, or -1 for a malformed request
+   */
+  int addData(const char *buffer, unsigned int len);
+  bool isDone() {return m_http->isDone();}
+  bool isKeepAlive() {return m_http->shouldKeepAlive();}
+  // nothing has arrived yet, so a failed read is the peer going away
+  bool isEmpty() {return m_totalBytesRead == 0;}
+
   std::string getHost();
   std::string getRequest();
   std::string getUrl();
   std::string getPath();
   std::vector<std::string> getPathComponents();
-  std::string getHeader(std::string key);
+  /**
+   * A header's value, "" if the request does not have it. Names match
+   * whatever their case and a repeated header gives its first value. The
+   * view points into the request and is good for as long as it is.
+   */
+  std::string_view getHeader(std::string_view name);
+  bool hasHeader(std::string_view name);
   bool hasAuthToken();
   std::string getAuthToken();
   bool isConnect();
   bool isGet() {return m_http->isGet();}
   bool isHead() {return m_http->isHead();}
+  bool isHttp11() {return m_http->isHttp11();}
   bool isPut() {return m_http->isPut();}
   bool isPost() {return m_http->isPost();}
   bool isDelete() {return m_http->isDelete();}
+  const char *getMethod() {return m_http->getMethod();}
   std::map<std::string, std::string> getParams();
   WwwFormEncodedDict formEncodedBody();
   std::string getBody() {return m_http->getBody();}
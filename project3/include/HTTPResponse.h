@@ -1,28 +1,154 @@
 #ifndef HTTP_RESPONSE_H_
 #define HTTP_RESPONSE_H_
 
+#include <sys/types.h>
+
 #include <map>
+#include <memory>
 #include <string>
 
+/**
+ * A body kept around between requests, with its header lines already
+ * rendered. headers holds complete "Name: value\r\n" lines and takes the
+ * place of Content-Type and Content-Length.
+ */
+struct SharedBody {
+  std::string headers;
+  std::string body;
+};
+
+/**
+ * A body produced while it is being sent, for responses too large to
+ * build up front. The server asks for the next piece only once the
+ * socket has taken the previous one, so a slow client slows the producer
+ * down instead of the body piling up in memory. read() runs on the thread
+ * sending the response, an event loop in mode 2, so it should not block
+ * for long.
+ */
+class BodySource {
+ public:
+  virtual ~BodySource() {}
+
+  /**
+   * Fills buffer with up to size more bytes of the body.
+   *
+   * @return the number of bytes, 0 at the end of the body, or -1 to give
+   *         up, which cuts the body short and closes the connection
+   */
+  virtual ssize_t read(char *buffer, size_t size) = 0;
+};
+
 class HTTPResponse {
  public:
   HTTPResponse();
+  ~HTTPResponse();
   void withStreaming();
   void setHeader(std::string name, std::string value);
   void setBody(std::string data);
   void setContentType(std::string contentType);
   void setStatus(int status);
   int getStatus();
+
+  /**
+   * Makes length bytes of fd, starting at offset, the body. They go
+   * straight from the page cache to the socket with sendfile(2), see
+   * MySocket::sendFile. The response owns fd from here on.
+   */
+  void setFileBody(int fd, off_t offset, size_t length);
+  bool hasFileBody() {return fileFd >= 0;}
+  int getFileFd() {return fileFd;}
+  off_t getFileOffset() {return fileOffset;}
+  size_t getFileLength() {return fileLength;}
+  /**
+   * Hands fd over to the caller, who now has to close it.
+   */
+  int releaseFile();
+
+  /**
+   * Sends a body that outlives the response, such as a cache entry, so
+   * it is neither read nor rendered again.
+   */
+  void setSharedBody(std::shared_ptr<const SharedBody> shared);
+  std::shared_ptr<const SharedBody> getSharedBody();
+
+  /**
+   * Hands the body set with setBody over to the caller without copying
+   * it, leaving the response with none.
+   */
+  std::string releaseBody();
+
+  /**
+   * Makes source the body, the response owns it from here on. With a
+   * length it goes out with that Content-Length and has to produce
+   * exactly that many bytes. Without one (-1) the body is chunked, see
+   * endWithConnection for HTTP/1.0.
+   */
+  void setBodySource(BodySource *source, ssize_t length = -1);
+  BodySource *getBodySource() {return source;}
+  /**
+   * Hands the source over to the caller, who now has to delete it.
+   */
+  BodySource *releaseBodySource();
+  bool isChunked() {return streaming && !closeDelimited;}
+  ssize_t getSourceLength() {return sourceLength;}
+
+  /**
+   * Sends a streaming body without chunked encoding and ends it by
+   * closing the connection, for HTTP/1.0 clients that do not know chunks.
+   */
+  void endWithConnection();
+
+  /**
+   * Keeps the headers, Content-Length included, but sends no body, for
+   * HEAD requests.
+   */
+  void omitBody();
+
+  /**
+   * Sends no body but the Content-Length of a length byte one, for
+   * answering HEAD without opening the file.
+   */
+  void omitBody(size_t length);
+
+  /**
+   * Appends the status line and headers to out. Pass a buffer that is
+   * cleared and reused between responses and rendering allocates nothing
+   * once it has grown to fit.
+   */
+  void renderHeaders(std::string &out);
+
+  /**
+   * The bytes that follow the headers, which stay in the response (or its
+   * shared body) and are valid as long as it is. Empty for file bodies,
+   * body sources, HEAD, 304s and streaming.
+   */
+  const char *getBodyData();
+  size_t getBodyLength();
+
+  /**
+   * The status line and headers followed by the body, or only the status
+   * line and headers for a file body, which the caller sends after them.
+   * Copies the body, servers send renderHeaders and getBodyData with
+   * MySocket::writeResponse instead.
+   */
   std::string response();
 
  private:
-  std::string statusToString();
+  const char *statusToString();
 
   int status;
   bool streaming;
+  bool closeDelimited;
+  bool bodyOmitted;
   std::map<std::string, std::string> headers;
   std::string body;
   std::string contentType;
+  int fileFd;
+  off_t fileOffset;
+  size_t fileLength;
+  std::shared_ptr<const SharedBody> shared;
+  BodySource *source;
+  ssize_t sourceLength;
 };
 
 #endif
@@ -7,6 +7,7 @@
 #include <vector>
 #include <map>
 
+#include "HTTPResponse.h"
 #include "MySocket.h"
 
 class MalformedQueryString : public std::runtime_error {
@@ -20,6 +21,17 @@ class HttpUtils {
   static void writeChunk(MySocket *client, const void *buf, int numBytes);
   static void writeLastChunk(MySocket *client);
 
+  /**
+   * Sends everything source produces, as chunks if chunked is set and as
+   * it is otherwise. With a length of 0 or more it stops there and throws
+   * SocketWriteError if the source ends early. Throws SocketWriteError
+   * when the source gives up too.
+   *
+   * @return the body bytes sent, not counting chunk framing
+   */
+  static size_t writeSource(MySocket *client, BodySource *source,
+                            bool chunked, ssize_t length);
+
   static std::vector<std::string> split(const std::string &s, char delim);
 
  private:
@@ -0,0 +1,119 @@
+#ifndef _MPMCRING_H_
+#define _MPMCRING_H_
+
+#include <stddef.h>
+
+#include <atomic>
+
+/**
+ * Bounded lock-free multi-producer multi-consumer queue (Dmitry Vyukov's
+ * design). Every cell carries a sequence number that says whether it is
+ * ready to be written for lap n or read for lap n, so producers and
+ * consumers each claim a slot with one CAS on their own index and never
+ * touch a lock. Neither call blocks; callers park on a futex when they
+ * see the ring empty or full.
+ */
+template <typename T>
+class MpmcRing {
+ public:
+  /**
+   * @param capacity rounded up to a power of two
+   */
+  MpmcRing(size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    m_mask = size - 1;
+    m_cells = new Cell[size];
+    for (size_t idx = 0; idx < size; idx++) {
+      m_cells[idx].seq.store(idx, std::memory_order_relaxed);
+    }
+    m_head.store(0, std::memory_order_relaxed);
+    m_tail.store(0, std::memory_order_relaxed);
+  }
+
+  ~MpmcRing() {
+    delete[] m_cells;
+  }
+
+  /**
+   * @return false if the ring is full
+   */
+  bool tryPush(T item) {
+    size_t pos = m_tail.load(std::memory_order_relaxed);
+    Cell *cell;
+    while (true) {
+      cell = &m_cells[pos & m_mask];
+      size_t seq = cell->seq.load(std::memory_order_acquire);
+      long diff = (long) seq - (long) pos;
+      if (diff == 0) {
+        // free for this lap, claim it
+        if (m_tail.compare_exchange_weak(pos, pos + 1,
+                                         std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        // still holds the item from the previous lap
+        return false;
+      } else {
+        // another producer got here first
+        pos = m_tail.load(std::memory_order_relaxed);
+      }
+    }
+    cell->item = item;
+    cell->seq.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * @return false if the ring is empty
+   */
+  bool tryPop(T &item) {
+    size_t pos = m_head.load(std::memory_order_relaxed);
+    Cell *cell;
+    while (true) {
+      cell = &m_cells[pos & m_mask];
+      size_t seq = cell->seq.load(std::memory_order_acquire);
+      long diff = (long) seq - (long) (pos + 1);
+      if (diff == 0) {
+        if (m_head.compare_exchange_weak(pos, pos + 1,
+                                         std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        // not written yet for this lap
+        return false;
+      } else {
+        pos = m_head.load(std::memory_order_relaxed);
+      }
+    }
+    item = cell->item;
+    // ready for the producer one lap later
+    cell->seq.store(pos + m_mask + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * A racy hint, cheap enough to poll before trying to pop.
+   */
+  bool empty() {
+    return m_head.load(std::memory_order_relaxed) ==
+           m_tail.load(std::memory_order_relaxed);
+  }
+
+ private:
+  struct Cell {
+    std::atomic<size_t> seq;
+    T item;
+  };
+
+  // head and tail on their own cache lines so producers and consumers do
+  // not false-share
+  alignas(64) Cell *m_cells;
+  size_t m_mask;
+  alignas(64) std::atomic<size_t> m_head;
+  alignas(64) std::atomic<size_t> m_tail;
+};
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef MYSERVERSOCKET_H
 #define MYSERVERSOCKET_H
 
+#include <sys/socket.h>
+
 #include <stdexcept>
 #include <string>
 
@@ -13,9 +15,17 @@ class MyServerSocket {
    * if it cannot bind, it will throw a socket exception.
    *
    * @param port the port to bind to
+   * @param backlog length of the kernel's queue of connections that
+   *        have not been accepted yet
+   * @param reusePort set SO_REUSEPORT so several sockets, one per
+   *        accepting thread, can bind the same port and the kernel
+   *        spreads new connections across them
+   * @param deferAccept if > 0, TCP_DEFER_ACCEPT: only wake accept once
+   *        the client has sent data, waiting up to this many seconds
    */
-  MyServerSocket(int port);
-  MyServerSocket() { serverFd = -1; }
+  MyServerSocket(int port, int backlog = SOMAXCONN, bool reusePort = false,
+                 int deferAccept = 0);
+  MyServerSocket() { serverFd = -1; noDelay = false; }
   
   /**
    * this function will accept incoming requests to connect and
@@ -23,9 +33,26 @@ class MyServerSocket {
    */
   MySocket *accept();
 
+  /**
+   * accepts one connection as a non-blocking, close-on-exec fd for
+   * event loops.
+   *
+   * @return the fd, or -1 with errno set (EAGAIN when none are pending)
+   */
+  int acceptNonBlocking();
+
+  /**
+   * set TCP_NODELAY on every accepted socket, so small responses are not
+   * held back by Nagle's algorithm
+   */
+  void setNoDelay(bool enabled) { noDelay = enabled; }
+
   int getFd() { return serverFd; }
  protected:
+  int acceptFd(int flags);
+
   int serverFd;
+  bool noDelay;
 
 };
 
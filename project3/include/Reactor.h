@@ -0,0 +1,239 @@
+#ifndef _REACTOR_H_
+#define _REACTOR_H_
+
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <time.h>
+
+#include <deque>
+#include <list>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "AccessLog.h"
+#include "HTTPRequest.h"
+#include "HTTPResponse.h"
+#include "MyServerSocket.h"
+#include "MySocket.h"
+
+/**
+ * Runs a request through the registered services and fills in the
+ * response. Called on a worker thread (or on the event loop when the
+ * reactor has no workers).
+ */
+typedef void (*RequestHandler)(HTTPRequest *request, HTTPResponse *response);
+
+class EventLoop;
+
+/**
+ * Per-connection state owned by the event loop that accepted it.
+ */
+class Connection {
+ public:
+  // CLOSING: no more requests are read, close once m_out drains
+  typedef enum {READING, PROCESSING, CLOSING} ConnectionState;
+
+  Connection(int fd, EventLoop *loop);
+  ~Connection();
+
+  /**
+   * Starts a fresh request and response for the next request on a
+   * keep-alive connection.
+   */
+  void reset();
+
+  /**
+   * Throws away every queued piece of output, closing files and
+   * deleting sources.
+   */
+  void dropOutput();
+
+  int m_fd;
+  EventLoop *m_loop;
+  ConnectionState m_state;
+  // the peer hung up or errored, do not keep the connection alive
+  bool m_closed;
+  // a response could not be sent in full, nothing more may follow it
+  bool m_failed;
+  int m_requests;
+  // AccessLog::now() when the current request was read
+  uint64_t m_started;
+
+  MySocket *m_sock;
+  HTTPRequest *m_request;
+  HTTPResponse *m_response;
+
+  // bytes read from the socket that the parser has not consumed yet,
+  // including any pipelined requests
+  std::string m_in;
+  // A piece of a response still to be sent: bytes in data, a body
+  // shared with a cache entry, length bytes of file from offset, sent
+  // with sendfile(2), or a source the body is pulled from once the
+  // pieces before it are out. The connection owns file and source.
+  struct Output {
+    Output(std::string data)
+        : data(std::move(data)), file(-1), offset(0), length(0),
+          source(NULL) {}
+    Output(std::shared_ptr<const SharedBody> shared)
+        : shared(shared), file(-1), offset(0), length(0), source(NULL) {}
+    Output(int file, off_t offset, size_t length)
+        : file(file), offset(offset), length(length), source(NULL) {}
+    // remaining is the Content-Length left to produce, -1 if unknown
+    Output(BodySource *source, bool chunked, ssize_t remaining)
+        : file(-1), offset(0), length(0), source(source), chunked(chunked),
+          remaining(remaining) {}
+
+    const char *bytes() const {
+      return shared ? shared->body.data() : data.data();
+    }
+    size_t size() const { return shared ? shared->body.size() : data.size(); }
+
+    std::string data;
+    std::shared_ptr<const SharedBody> shared;
+    int file;
+    off_t offset;
+    size_t length;
+    BodySource *source;
+    bool chunked;
+    ssize_t remaining;
+  };
+
+  // serialized responses waiting for the socket to become writable
+  std::deque<Output> m_out;
+  // bytes of the first data piece already sent
+  size_t m_outOffset;
+
+  // position in the loop's connection list, oldest activity first
+  std::list<Connection *>::iterator m_position;
+  time_t m_lastActive;
+};
+
+/**
+ * One epoll instance pinned to a core. Accepts from its listening
+ * socket, parses requests as bytes arrive and writes responses without
+ * blocking. Requests are handed to the reactor's workers and come back
+ * through an eventfd.
+ */
+class EventLoop {
+ public:
+  /**
+   * @param server the listening socket this loop accepts from
+   * @param shared whether other loops accept from the same socket
+   */
+  EventLoop(int id, MyServerSocket *server, bool shared,
+            class Reactor *reactor);
+  ~EventLoop();
+
+  void run();
+
+  /**
+   * Called by a worker when the response for conn is ready. Safe to call
+   * from any thread.
+   */
+  void complete(Connection *conn);
+
+  int m_id;
+
+ private:
+  void acceptConnections();
+  // these return false once conn has been closed and freed
+  bool onReadable(Connection *conn);
+  bool onWritable(Connection *conn);
+  // turns the next piece of the source at the front of conn's output
+  // into data, false if the source failed
+  bool pull(Connection *conn);
+  bool parseInput(Connection *conn);
+  void dispatch(Connection *conn);
+  void queueResponse(Connection *conn);
+  void onCompletions();
+  void closeConnection(Connection *conn);
+  // closes conn after a failed write, or once its worker is done with
+  // it, false if it was closed now
+  bool failConnection(Connection *conn);
+  void touch(Connection *conn);
+  void closeIdle();
+
+  int m_epollFd;
+  MyServerSocket *m_server;
+  int m_listenFd;
+  int m_eventFd;
+  class Reactor *m_reactor;
+  time_t m_now;
+
+  // every open connection, least recently active first, so idle ones
+  // are found without scanning
+  std::list<Connection *> m_connections;
+  // closed during this round of events, freed once the round is over
+  std::vector<Connection *> m_dead;
+
+  pthread_mutex_t m_completedMutex;
+  std::vector<Connection *> m_completed;
+};
+
+/**
+ * Non-blocking server core: a handful of event loops own every connection
+ * and only the service calls run on worker threads.
+ */
+class Reactor {
+ public:
+  /**
+   * @param servers bound, listening server sockets: a single one shared by
+   *        every loop, or one SO_REUSEPORT socket per loop
+   * @param numLoops number of event loops, each pinned to its own core
+   * @param numWorkers worker threads for service calls, 0 runs services
+   *        on the event loop itself
+   * @param handler invoked for every complete request
+   */
+  Reactor(std::vector<MyServerSocket *> servers, int numLoops,
+          int numWorkers, RequestHandler handler);
+
+  /**
+   * Starts the workers and event loops. Event loop 0 runs on the calling
+   * thread, so this never returns.
+   */
+  void run();
+
+  /**
+   * @param maxRequests requests served per connection, 1 disables
+   *        keep-alive
+   * @param idleTimeout seconds before an idle connection is closed, 0
+   *        keeps it forever
+   */
+  void setKeepAlive(int maxRequests, int idleTimeout);
+  int maxRequests() { return m_maxRequests; }
+  int idleTimeout() { return m_idleTimeout; }
+
+  /**
+   * @param accessLog gets a line per response, NULL (the default) for
+   *        none
+   */
+  void setAccessLog(AccessLog *accessLog) { m_accessLog = accessLog; }
+  AccessLog *accessLog() { return m_accessLog; }
+
+  bool hasWorkers() { return m_numWorkers > 0; }
+  void submit(Connection *conn);
+  void handle(Connection *conn);
+
+ private:
+  static void *loopThread(void *arg);
+  static void *workerThread(void *arg);
+  void workerLoop();
+
+  std::vector<MyServerSocket *> m_servers;
+  int m_numLoops;
+  int m_numWorkers;
+  RequestHandler m_handler;
+  int m_maxRequests;
+  int m_idleTimeout;
+  AccessLog *m_accessLog;
+  std::vector<EventLoop *> m_loops;
+
+  pthread_mutex_t m_jobMutex;
+  pthread_cond_t m_jobCond;
+  std::deque<Connection *> m_jobs;
+};
+
+#endif
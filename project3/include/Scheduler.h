@@ -0,0 +1,29 @@
+#ifndef _SCHEDULER_H_
+#define _SCHEDULER_H_
+
+#include "MySocket.h"
+
+/**
+ * Decides which accepted connection a worker serves next (-s). The
+ * acceptor pushes, workers pop, and both block when the scheduler is
+ * full (-b connections) or empty.
+ */
+class Scheduler {
+ public:
+  virtual ~Scheduler() {}
+
+  /**
+   * Queues a connection, blocking while the scheduler is full. Only one
+   * thread (the acceptor) may push.
+   */
+  virtual void push(MySocket *client) = 0;
+
+  /**
+   * Returns the next connection for worker, blocking until there is one.
+   *
+   * @param worker the caller's index, from 0 to numWorkers - 1
+   */
+  virtual MySocket *pop(int worker) = 0;
+};
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef _SFFSCHEDULER_H_
+#define _SFFSCHEDULER_H_
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include <queue>
+#include <string>
+#include <vector>
+
+#include "MySocket.h"
+#include "Scheduler.h"
+
+/**
+ * Smallest file first. The acceptor peeks at the request line of each new
+ * connection, stats the file it asks for and queues the connection in a
+ * heap ordered by that size, so small assets do not wait behind large
+ * downloads.
+ *
+ * To keep large files from starving, every arrival advances a virtual
+ * clock by AGING_BYTES and a connection's key is its size plus the clock
+ * at arrival. A request is therefore overtaken by at most
+ * size / AGING_BYTES later ones.
+ */
+class SffScheduler : public Scheduler {
+ public:
+  /**
+   * @param capacity connections that may be queued before push() blocks
+   * @param basedir the directory FileService serves from
+   */
+  SffScheduler(int capacity, std::string basedir);
+  ~SffScheduler();
+
+  void push(MySocket *client);
+  MySocket *pop(int worker);
+
+ private:
+  struct Entry {
+    unsigned long long key;
+    unsigned long long seq;
+    MySocket *client;
+  };
+
+  struct LaterFirst {
+    bool operator()(const Entry &a, const Entry &b) const {
+      if (a.key != b.key) {
+        return a.key > b.key;
+      }
+      return a.seq > b.seq;
+    }
+  };
+
+  off_t requestSize(MySocket *client);
+
+  int m_capacity;
+  std::string m_basedir;
+  unsigned long long m_seq;
+
+  pthread_mutex_t m_mutex;
+  pthread_cond_t m_waitCond;
+  pthread_cond_t m_fullCond;
+  std::priority_queue<Entry, std::vector<Entry>, LaterFirst> m_heap;
+};
+
+#endif
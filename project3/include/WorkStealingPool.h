@@ -0,0 +1,53 @@
+#ifndef _WORKSTEALINGPOOL_H_
+#define _WORKSTEALINGPOOL_H_
+
+#include <atomic>
+#include <vector>
+
+#include "MpmcRing.h"
+#include "MySocket.h"
+#include "Scheduler.h"
+
+/**
+ * The FIFO scheduler. Every worker has its own lock-free ring, the
+ * acceptor fills them round-robin and a worker whose ring is empty steals
+ * from the others before it parks on a futex. Hand offs take no lock at
+ * all; threads only sleep when the whole pool is empty (workers) or full
+ * (the acceptor).
+ */
+class WorkStealingPool : public Scheduler {
+ public:
+  /**
+   * @param numWorkers number of workers that will call pop()
+   * @param capacity connections that may be queued across all workers
+   *        before push() blocks (the -b bound)
+   */
+  WorkStealingPool(int numWorkers, int capacity);
+  ~WorkStealingPool();
+
+  void push(MySocket *client);
+  MySocket *pop(int worker);
+
+ private:
+  MySocket *tryPop(int worker);
+  MySocket *trySteal(int worker);
+  void taken();
+
+  int m_numWorkers;
+  int m_capacity;
+  // together sized for the -b bound
+  std::vector<MpmcRing<MySocket *> *> m_queues;
+  // next queue to push to, only touched by the acceptor
+  unsigned int m_next;
+
+  // connections queued across all workers, bounded by m_capacity
+  alignas(64) std::atomic<int> m_queued;
+  // bumped on every push, idle workers sleep on it
+  alignas(64) std::atomic<int> m_workSeq;
+  std::atomic<int> m_idle;
+  // bumped on every pop, a blocked acceptor sleeps on it
+  alignas(64) std::atomic<int> m_spaceSeq;
+  std::atomic<int> m_acceptorWaiting;
+};
+
+#endif
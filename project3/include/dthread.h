@@ -4,6 +4,23 @@
 #include <pthread.h>
 #include <string>
 
+// What the dthread_* wrappers and sync_print() log, picked at build time
+// with make TRACE=BINARY|TEXT|OFF.
+//
+//   BINARY: fixed-size events go to a per-thread lock-free ring and a
+//           background thread appends them to the log file. Decode the
+//           file with dtrace_decode to get the text log.
+//   TEXT:   every event is formatted and written to the log file under a
+//           global lock, the original behaviour and the default.
+//   OFF:    nothing is logged.
+#define DTHREAD_TRACE_OFF 0
+#define DTHREAD_TRACE_TEXT 1
+#define DTHREAD_TRACE_BINARY 2
+
+#ifndef DTHREAD_TRACE
+#define DTHREAD_TRACE DTHREAD_TRACE_TEXT
+#endif
+
 int dthread_create(pthread_t *thread, const pthread_attr_t *attr,
 		   void *(*start_routine)(void *), void *arg);
 int dthread_detach(pthread_t thread);
@@ -15,9 +32,17 @@ int dthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex);
 int dthread_cond_signal(pthread_cond_t *cond);
 int dthread_cond_broadcast(pthread_cond_t *cond);
 
+// futex(2) wait and wake on a 32-bit word, for code that parks threads
+// without a mutex. wait returns once *addr != expected or on a wakeup,
+// which may be spurious.
+int dthread_futex_wait(int *addr, int expected);
+int dthread_futex_wake(int *addr, int count);
+
 
 // don't use these, they're used by the autograder
 void sync_print(std::string function, std::string payload);
 void set_log_file(std::string file_name);
+// writes out everything traced so far, set_log_file() runs it at exit
+void flush_log();
 
 #endif
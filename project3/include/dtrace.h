@@ -0,0 +1,91 @@
+#ifndef _DTRACE_H_
+#define _DTRACE_H_
+
+#include <stdint.h>
+
+#include <sstream>
+#include <string>
+
+/**
+ * On-disk format of the binary dthread log, shared by dthread.cpp, which
+ * writes it, and dtrace_decode, which turns it back into the text log.
+ *
+ * The file starts with DTRACE_MAGIC followed by fixed-size records in
+ * per-thread order. Threads are interleaved in batches, the decoder sorts
+ * by timestamp to recover the global order. A DTRACE_TEXT record (what
+ * sync_print() logs) is followed by ceil(length / sizeof(DtraceRecord))
+ * records worth of raw text: the function name (object[0] bytes) then the
+ * payload.
+ */
+
+#define DTRACE_MAGIC "DTRACE1\n"
+#define DTRACE_MAGIC_LEN 8
+
+enum DtraceEvent {
+  DTRACE_TEXT = 0,
+  DTRACE_START_ROUTINE_ENTER,
+  DTRACE_START_ROUTINE_RETURN,
+  DTRACE_DETACH_ENTER,
+  DTRACE_DETACH_RETURN,
+  DTRACE_MUTEX_LOCK_ENTER,
+  DTRACE_MUTEX_LOCK_RETURN,
+  DTRACE_MUTEX_UNLOCK_ENTER,
+  DTRACE_MUTEX_UNLOCK_RETURN,
+  DTRACE_COND_WAIT_ENTER,
+  DTRACE_COND_WAIT_RETURN,
+  DTRACE_COND_SIGNAL_ENTER,
+  DTRACE_COND_SIGNAL_RETURN,
+  DTRACE_COND_BROADCAST_ENTER,
+  DTRACE_COND_BROADCAST_RETURN,
+  DTRACE_FUTEX_WAIT_ENTER,
+  DTRACE_FUTEX_WAIT_RETURN,
+  DTRACE_FUTEX_WAKE_ENTER,
+  DTRACE_FUTEX_WAKE_RETURN,
+  DTRACE_NUM_EVENTS
+};
+
+struct DtraceRecord {
+  uint64_t timestamp;  // CLOCK_MONOTONIC, ns
+  uint32_t tid;        // order of the thread's first event, like sync_print
+  uint16_t event;      // DtraceEvent
+  uint16_t length;     // DTRACE_TEXT only: bytes of text that follow
+  uint64_t object[2];  // mutex and cond, or the futex word
+};
+
+static const char *const DTRACE_NAMES[DTRACE_NUM_EVENTS] = {
+  "",
+  "my_start_routine_enter",
+  "my_start_routine_return",
+  "dthread_detach_enter",
+  "dthread_detach_return",
+  "dthread_mutex_lock_enter",
+  "dthread_mutex_lock_return",
+  "dthread_mutex_unlock_enter",
+  "dthread_mutex_unlock_return",
+  "dthread_cond_wait_enter",
+  "dthread_cond_wait_return",
+  "dthread_cond_signal_enter",
+  "dthread_cond_signal_return",
+  "dthread_cond_broadcast_enter",
+  "dthread_cond_broadcast_return",
+  "dthread_futex_wait_enter",
+  "dthread_futex_wait_return",
+  "dthread_futex_wake_enter",
+  "dthread_futex_wake_return",
+};
+
+/**
+ * The payload the text log prints for a dthread event.
+ */
+inline std::string dtrace_payload(int event, const void *first,
+                                  const void *second) {
+  std::stringstream payload;
+  if (event >= DTRACE_FUTEX_WAIT_ENTER) {
+    payload << " futex: " << first;
+  } else {
+    payload << " mutex: " << first << " cond: " << second;
+  }
+  return payload.str();
+}
+
+#endif
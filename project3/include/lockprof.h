@@ -0,0 +1,53 @@
+#ifndef _LOCKPROF_H_
+#define _LOCKPROF_H_
+
+#include <stdint.h>
+
+#include <iostream>
+
+/**
+ * Contention profiler behind the dthread wrappers. When enabled, every
+ * thread keeps log-linear histograms per mutex, condition variable and
+ * futex word of
+ *
+ *   wait:   time blocked in dthread_mutex_lock, dthread_cond_wait or
+ *           dthread_futex_wait
+ *   hold:   time between getting a mutex and releasing it (unlock, or
+ *           handing it back in dthread_cond_wait)
+ *   wakeup: time from the latest signal, broadcast or futex wake to the
+ *           waiter running again, for waits that such a call ended
+ *
+ * Threads only touch their own histograms, the report merges them.
+ * Disabled, each hook is a load and a branch.
+ */
+
+/**
+ * Starts profiling. Call it before creating any threads: it blocks
+ * SIGUSR1, SIGINT and SIGTERM in the caller, which every later thread
+ * inherits, and starts a thread that prints the report on SIGUSR1, or
+ * prints it and exits on SIGINT and SIGTERM. The report is also printed
+ * at a normal exit.
+ *
+ * @param out where reports go
+ */
+void lockprof_enable(std::ostream &out);
+
+/**
+ * Prints the hottest primitives by total wait, with count, total, p50,
+ * p99 and max of each histogram.
+ */
+void lockprof_report(std::ostream &out);
+
+// hooks for dthread.cpp
+
+extern bool lockprof_enabled;
+
+// returns 0 when profiling is off, pass it to the matching hook
+uint64_t lockprof_start();
+void lockprof_acquired(void *mutex, uint64_t start);
+void lockprof_releasing(void *mutex);
+// mutex is the one dthread_cond_wait took back, NULL for a futex word
+void lockprof_woken(void *cond, void *mutex, uint64_t start);
+void lockprof_signalled(void *cond);
+
+#endif
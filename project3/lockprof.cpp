@@ -0,0 +1,386 @@
+#include "lockprof.h"
+#include "dthread.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <iomanip>
+#include <map>
+#include <vector>
+
+using namespace std;
+
+// Log-linear buckets: values below SUB get their own bucket, above that
+// every power of two is split into SUB buckets, so a bucket is at most
+// 1/SUB of its value wide.
+#define SUB_BITS 3
+#define SUB (1 << SUB_BITS)
+#define BUCKETS ((64 - SUB_BITS + 1) * SUB)
+// primitives each thread tracks, a power of two
+#define SITES 64
+// mutexes one thread holds at once
+#define MAX_HELD 8
+// conds and futex words whose last signal we remember, a power of two
+#define SIGNAL_SLOTS 256
+// primitives in a report
+#define REPORT_TOP 20
+
+enum Kind { KIND_MUTEX, KIND_COND, KIND_FUTEX };
+static const char *const KIND_NAMES[] = {"mutex", "cond", "futex"};
+
+enum Metric { METRIC_WAIT, METRIC_HOLD, METRIC_WAKEUP, METRICS };
+static const char *const METRIC_NAMES[] = {"wait", "hold", "wakeup"};
+
+// Only the owning thread writes, the report reads concurrently, so
+// relaxed loads and stores are enough and no update needs a locked
+// instruction.
+struct Histogram {
+  atomic<uint32_t> counts[BUCKETS];
+  atomic<uint64_t> total;
+  atomic<uint64_t> max;
+};
+
+struct Site {
+  atomic<uintptr_t> key;
+  atomic<int> kind;
+  Histogram metrics[METRICS];
+};
+
+struct ThreadTable {
+  Site sites[SITES];
+};
+
+struct Held {
+  void *mutex;
+  uint64_t since;
+};
+
+struct SignalSlot {
+  atomic<uintptr_t> key;
+  atomic<uint64_t> at;
+};
+
+bool lockprof_enabled = false;
+
+static ostream *report_out = &cerr;
+// plain pthread mutexes, the profiler must not profile itself
+static pthread_mutex_t tables_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+// never destroyed, threads may still run during exit
+static vector<ThreadTable *> &tables = *new vector<ThreadTable *>;
+static SignalSlot signals[SIGNAL_SLOTS];
+static thread_local ThreadTable *my_table = NULL;
+static thread_local Held held[MAX_HELD];
+static thread_local int num_held = 0;
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bucket_of(uint64_t value) {
+  if (value < SUB) {
+    return value;
+  }
+  int exponent = 63 - __builtin_clzll(value);
+  int sub = (value >> (exponent - SUB_BITS)) & (SUB - 1);
+  return (exponent - SUB_BITS + 1) * SUB + sub;
+}
+
+static uint64_t bucket_floor(int bucket) {
+  if (bucket < SUB) {
+    return bucket;
+  }
+  int exponent = bucket / SUB + SUB_BITS - 1;
+  return (uint64_t) (SUB + bucket % SUB) << (exponent - SUB_BITS);
+}
+
+static void record(Histogram &histogram, uint64_t value) {
+  atomic<uint32_t> &count = histogram.counts[bucket_of(value)];
+  count.store(count.load(memory_order_relaxed) + 1, memory_order_relaxed);
+  histogram.total.store(histogram.total.load(memory_order_relaxed) + value,
+                        memory_order_relaxed);
+  if (value > histogram.max.load(memory_order_relaxed)) {
+    histogram.max.store(value, memory_order_relaxed);
+  }
+}
+
+static Site *site_for(void *primitive, Kind kind) {
+  if (my_table == NULL) {
+    // zeroed, every key starts out empty
+    my_table = new ThreadTable();
+    pthread_mutex_lock(&tables_lock);
+    tables.push_back(my_table);
+    pthread_mutex_unlock(&tables_lock);
+  }
+
+  uintptr_t key = (uintptr_t) primitive;
+  for (int probe = 0; probe < SITES; probe++) {
+    Site *site = &my_table->sites[((key >> 4) + probe) & (SITES - 1)];
+    uintptr_t current = site->key.load(memory_order_relaxed);
+    if (current == key) {
+      return site;
+    }
+    if (current == 0) {
+      site->kind.store(kind, memory_order_relaxed);
+      // publishes kind to the report
+      site->key.store(key, memory_order_release);
+      return site;
+    }
+  }
+  // this thread touched more than SITES primitives, ignore the rest
+  return NULL;
+}
+
+static void record_for(void *primitive, Kind kind, Metric metric,
+                       uint64_t value) {
+  Site *site = site_for(primitive, kind);
+  if (site != NULL) {
+    record(site->metrics[metric], value);
+  }
+}
+
+// lookup only unless insert is set
+static SignalSlot *signal_slot(void *primitive, bool insert) {
+  uintptr_t key = (uintptr_t) primitive;
+  for (int probe = 0; probe < SIGNAL_SLOTS; probe++) {
+    SignalSlot *slot = &signals[((key >> 4) + probe) & (SIGNAL_SLOTS - 1)];
+    uintptr_t current = slot->key.load(memory_order_acquire);
+    if (current == key) {
+      return slot;
+    }
+    if (current == 0) {
+      if (!insert) {
+        return NULL;
+      }
+      if (slot->key.compare_exchange_strong(current, key) || current == key) {
+        return slot;
+      }
+    }
+  }
+  return NULL;
+}
+
+static void held_push(void *mutex, uint64_t since) {
+  if (num_held < MAX_HELD) {
+    held[num_held].mutex = mutex;
+    held[num_held].since = since;
+    num_held++;
+  }
+}
+
+uint64_t lockprof_start() {
+  return lockprof_enabled ? now_ns() : 0;
+}
+
+void lockprof_acquired(void *mutex, uint64_t start) {
+  if (start == 0) {
+    return;
+  }
+  uint64_t now = now_ns();
+  record_for(mutex, KIND_MUTEX, METRIC_WAIT, now - start);
+  held_push(mutex, now);
+}
+
+void lockprof_releasing(void *mutex) {
+  if (!lockprof_enabled) {
+    return;
+  }
+  // usually the most recently taken one
+  for (int idx = num_held - 1; idx >= 0; idx--) {
+    if (held[idx].mutex == mutex) {
+      record_for(mutex, KIND_MUTEX, METRIC_HOLD, now_ns() - held[idx].since);
+      held[idx] = held[--num_held];
+      return;
+    }
+  }
+}
+
+void lockprof_woken(void *cond, void *mutex, uint64_t start) {
+  if (start == 0) {
+    return;
+  }
+  uint64_t now = now_ns();
+  Kind kind = mutex != NULL ? KIND_COND : KIND_FUTEX;
+  record_for(cond, kind, METRIC_WAIT, now - start);
+
+  // a signal after we started waiting is what woke us, anything earlier
+  // was for somebody else
+  SignalSlot *slot = signal_slot(cond, false);
+  if (slot != NULL) {
+    uint64_t at = slot->at.load(memory_order_relaxed);
+    if (at >= start && at <= now) {
+      record_for(cond, kind, METRIC_WAKEUP, now - at);
+    }
+  }
+
+  if (mutex != NULL) {
+    held_push(mutex, now);
+  }
+}
+
+void lockprof_signalled(void *cond) {
+  if (!lockprof_enabled) {
+    return;
+  }
+  SignalSlot *slot = signal_slot(cond, true);
+  if (slot != NULL) {
+    slot->at.store(now_ns(), memory_order_relaxed);
+  }
+}
+
+struct Merged {
+  int kind;
+  uint64_t counts[METRICS][BUCKETS];
+  uint64_t total[METRICS];
+  uint64_t max[METRICS];
+};
+
+static bool hotter(const Merged *a, const Merged *b) {
+  return a->total[METRIC_WAIT] > b->total[METRIC_WAIT];
+}
+
+static uint64_t percentile(const Merged &merged, int metric, uint64_t count,
+                           double fraction) {
+  uint64_t rank = (uint64_t) (fraction * count + 0.5);
+  if (rank == 0) {
+    rank = 1;
+  }
+  uint64_t seen = 0;
+  for (int bucket = 0; bucket < BUCKETS; bucket++) {
+    seen += merged.counts[metric][bucket];
+    if (seen >= rank) {
+      // middle of the bucket, never past the largest value seen
+      uint64_t low = bucket_floor(bucket);
+      uint64_t high = bucket + 1 < BUCKETS ? bucket_floor(bucket + 1) : low;
+      return min(low + (high - low) / 2, merged.max[metric]);
+    }
+  }
+  return merged.max[metric];
+}
+
+static string micros(uint64_t nanos) {
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), "%.1f", nanos / 1000.0);
+  return buffer;
+}
+
+void lockprof_report(ostream &out) {
+  pthread_mutex_lock(&tables_lock);
+  vector<ThreadTable *> snapshot = tables;
+  pthread_mutex_unlock(&tables_lock);
+
+  map<uintptr_t, Merged *> merged;
+  for (size_t idx = 0; idx < snapshot.size(); idx++) {
+    for (int slot = 0; slot < SITES; slot++) {
+      Site &site = snapshot[idx]->sites[slot];
+      uintptr_t key = site.key.load(memory_order_acquire);
+      if (key == 0) {
+        continue;
+      }
+      Merged *&entry = merged[key];
+      if (entry == NULL) {
+        entry = new Merged();
+        entry->kind = site.kind.load(memory_order_relaxed);
+      }
+      for (int metric = 0; metric < METRICS; metric++) {
+        Histogram &histogram = site.metrics[metric];
+        for (int bucket = 0; bucket < BUCKETS; bucket++) {
+          entry->counts[metric][bucket] +=
+            histogram.counts[bucket].load(memory_order_relaxed);
+        }
+        entry->total[metric] += histogram.total.load(memory_order_relaxed);
+        entry->max[metric] = max(entry->max[metric],
+                                 histogram.max.load(memory_order_relaxed));
+      }
+    }
+  }
+
+  vector<Merged *> sorted;
+  map<Merged *, uintptr_t> keys;
+  for (map<uintptr_t, Merged *>::iterator it = merged.begin();
+       it != merged.end(); it++) {
+    sorted.push_back(it->second);
+    keys[it->second] = it->first;
+  }
+  sort(sorted.begin(), sorted.end(), hotter);
+
+  out << "lock profile, times in us, hottest by total wait" << endl;
+  out << left << setw(6) << "kind" << setw(16) << "address" << setw(8)
+      << "metric" << right << setw(10) << "count" << setw(12) << "total"
+      << setw(10) << "p50" << setw(10) << "p99" << setw(12) << "max" << endl;
+  for (size_t idx = 0; idx < sorted.size() && idx < REPORT_TOP; idx++) {
+    Merged &entry = *sorted[idx];
+    for (int metric = 0; metric < METRICS; metric++) {
+      uint64_t count = 0;
+      for (int bucket = 0; bucket < BUCKETS; bucket++) {
+        count += entry.counts[metric][bucket];
+      }
+      if (count == 0) {
+        continue;
+      }
+      out << left << setw(6) << KIND_NAMES[entry.kind] << setw(16)
+          << (void *) keys[sorted[idx]] << setw(8) << METRIC_NAMES[metric]
+          << right << setw(10) << count << setw(12)
+          << micros(entry.total[metric]) << setw(10)
+          << micros(percentile(entry, metric, count, 0.50)) << setw(10)
+          << micros(percentile(entry, metric, count, 0.99)) << setw(12)
+          << micros(entry.max[metric]) << endl;
+    }
+  }
+
+  for (size_t idx = 0; idx < sorted.size(); idx++) {
+    delete sorted[idx];
+  }
+}
+
+static void report_now() {
+  pthread_mutex_lock(&report_lock);
+  lockprof_report(*report_out);
+  pthread_mutex_unlock(&report_lock);
+}
+
+static void *signal_thread(void *arg) {
+  sigset_t *set = (sigset_t *) arg;
+  while (true) {
+    int sig;
+    if (sigwait(set, &sig) != 0) {
+      continue;
+    }
+    report_now();
+    if (sig != SIGUSR1) {
+      // skip the atexit report, but keep the binary log
+      flush_log();
+      _exit(0);
+    }
+  }
+  return NULL;
+}
+
+void lockprof_enable(ostream &out) {
+  report_out = &out;
+  lockprof_enabled = true;
+
+  static sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  sigaddset(&set, SIGINT);
+  sigaddset(&set, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+  // a plain pthread so it stays out of the log and the profile
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, signal_thread, &set) != 0) {
+    cerr << "Could not start the lock profiler thread" << endl;
+    exit(1);
+  }
+  pthread_detach(thread);
+  atexit(report_now);
+}
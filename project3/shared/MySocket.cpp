@@ -1,6 +1,10 @@
 #include "MySocket.h"
 #include <sys/types.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <errno.h>
 #include <unistd.h>
 #include <string.h>
 #include <netdb.h>
@@ -58,10 +62,49 @@ MySocket::~MySocket(void) {
 }
 
 
-void MySocket::write(string buffer) {
+void MySocket::write(const string &buffer) {
     write_bytes(buffer.c_str(), buffer.size());
 }
 
+void MySocket::writeResponse(const string &header, const char *body,
+                             size_t length) {
+    struct iovec iov[2];
+    iov[0].iov_base = (void *) header.data();
+    iov[0].iov_len = header.size();
+    iov[1].iov_base = (void *) body;
+    iov[1].iov_len = length;
+    writeGather(iov, 2);
+}
+
+void MySocket::writeGather(struct iovec *iov, int count) {
+    if (sockFd<0) {
+      throw SocketNotConnected();
+    }
+
+    int first = 0;
+    while(first < count && iov[first].iov_len == 0) {
+        first++;
+    }
+    while(first < count) {
+        ssize_t ret = ::writev(sockFd, iov + first, count - first);
+        if(ret < 0 && errno == EINTR) {
+          continue;
+        }
+        if(ret <= 0) {
+          throw SocketWriteError();
+        }
+        // step past what went out, a short write can end in any piece
+        while(first < count && (size_t) ret >= iov[first].iov_len) {
+          ret -= iov[first].iov_len;
+          first++;
+        }
+        if(first < count) {
+          iov[first].iov_base = (char *) iov[first].iov_base + ret;
+          iov[first].iov_len -= ret;
+        }
+    }
+}
+
 void MySocket::write_bytes(const void *buffer, int len) {
     const unsigned char *buf = (const unsigned char *) buffer;
     int bytesWritten = 0;
@@ -80,11 +123,53 @@ void MySocket::write_bytes(const void *buffer, int len) {
     }
 }
 
+void MySocket::sendFile(const string &header, int fd, off_t offset,
+                        size_t length) {
+    if (sockFd<0) {
+      throw SocketNotConnected();
+    }
+
+    // MSG_MORE keeps a short header from going out as its own packet, it
+    // leaves with the first part of the body
+    const char *buf = header.data();
+    size_t len = header.size();
+    int flags = length > 0 ? MSG_MORE : 0;
+    while(len > 0) {
+        ssize_t ret = ::send(sockFd, buf, len, flags);
+        if(ret < 0 && errno == EINTR) {
+          continue;
+        }
+        if(ret <= 0) {
+          throw SocketWriteError();
+        }
+        buf += ret;
+        len -= ret;
+    }
+
+    while(length > 0) {
+        ssize_t ret = ::sendfile(sockFd, fd, &offset, length);
+        if(ret < 0 && errno == EINTR) {
+          continue;
+        }
+        // 0 means the file shrank under us, Content-Length is a lie now
+        if(ret <= 0) {
+          throw SocketWriteError();
+        }
+        length -= ret;
+    }
+}
+
 string MySocket::read() {
     char buffer[4096];
     if(sockFd<0) {
       throw SocketNotConnected();
     }
+
+    if(!pending.empty()) {
+      string data;
+      data.swap(pending);
+      return data;
+    }
     
     int ret = ::read(sockFd, buffer, sizeof(buffer));
     
@@ -95,6 +180,17 @@ string MySocket::read() {
     return string(buffer, ret);
 }
 
+void MySocket::unread(const char *data, int len) {
+    pending.insert(0, data, len);
+}
+
+void MySocket::setReadTimeout(int seconds) {
+    struct timeval timeout;
+    timeout.tv_sec = seconds;
+    timeout.tv_usec = 0;
+    setsockopt(sockFd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
 void MySocket::close(void) {
     if(sockFd<0) return;
     
@@ -1,4 +1,5 @@
 #include "MySslSocket.h"
+#include <unistd.h>
 
 #include <iostream>
 #include <sstream>
@@ -49,21 +50,31 @@ MySslSocket::MySslSocket(const char *inetAddr, int port, bool debug_print_io) {
   if (res != 1) handleFailure();
 }
 
-void MySslSocket::write(string buffer) {
-  const unsigned char *buf = (const unsigned char *) buffer.c_str();
-  unsigned int len = buffer.size();
-  int bytesWritten = 0;
-
-  if (sockFd<0 || ssl==NULL) {
-    throw SocketNotConnected();
-  }
-
+void MySslSocket::write(const string &buffer) {
   if (debug_print_io) {
     cout << "MySslSocket::write" << endl;
     cout << "------------------" << endl;
     cout << buffer << endl << endl;
   }
 
+  ssl_write_bytes(buffer.c_str(), buffer.size());
+}
+
+void MySslSocket::writeGather(struct iovec *iov, int count) {
+  // records are encrypted one at a time, there is nothing to gather
+  for (int idx = 0; idx < count; idx++) {
+    ssl_write_bytes(iov[idx].iov_base, iov[idx].iov_len);
+  }
+}
+
+void MySslSocket::ssl_write_bytes(const void *buffer, size_t len) {
+  const unsigned char *buf = (const unsigned char *) buffer;
+  int bytesWritten = 0;
+
+  if (sockFd<0 || ssl==NULL) {
+    throw SocketNotConnected();
+  }
+
   while(len > 0) {
     bytesWritten = SSL_write(ssl, buf, len);
     if(bytesWritten <= 0) {
@@ -74,6 +85,23 @@ void MySslSocket::write(string buffer) {
   }
 }
 
+void MySslSocket::sendFile(const string &header, int fd, off_t offset,
+                           size_t length) {
+  write(header);
+
+  char buffer[16384];
+  while (length > 0) {
+    size_t chunk = length < sizeof(buffer) ? length : sizeof(buffer);
+    ssize_t ret = pread(fd, buffer, chunk, offset);
+    if (ret <= 0) {
+      throw SocketWriteError();
+    }
+    ssl_write_bytes(buffer, ret);
+    offset += ret;
+    length -= ret;
+  }
+}
+
 string MySslSocket::read() {
   char buffer[4096];
   if(sockFd<0 || ssl == NULL) {
@@ -1,6 +1,9 @@
 #ifndef MYSOCKET_H
 #define MYSOCKET_H
 
+#include <sys/types.h>
+#include <sys/uio.h>
+
 #include <stdexcept>
 #include <string>
 
@@ -50,13 +53,48 @@ class MySocket {
 
 
   virtual std::string read();
-  virtual void write(std::string data);
+  virtual void write(const std::string &data);
+
+  /*
+   * writes count buffers back to back with writev(2), so none of them is
+   * copied into a combined one and short responses leave in one packet.
+   * Throws SocketWriteError like write(). iov is used up as it goes.
+   */
+  virtual void writeGather(struct iovec *iov, int count);
+
+  /*
+   * writeGather for the usual case of headers and a body
+   */
+  void writeResponse(const std::string &header, const char *body,
+                     size_t length);
   virtual void close(void);
+
+  /*
+   * writes header in one go, then length bytes of fd from offset with
+   * sendfile(2) so the body never passes through user space. Throws
+   * SocketWriteError like write(), also if fd turns out to be short.
+   */
+  virtual void sendFile(const std::string &header, int fd, off_t offset,
+                        size_t length);
+
+  int getFd() { return sockFd; }
+
+  /*
+   * pushes bytes back so the next read() returns them first, used to
+   * carry pipelined requests over to the next parser
+   */
+  void unread(const char *data, int len);
+
+  /*
+   * makes read() fail after seconds of silence instead of blocking forever
+   */
+  void setReadTimeout(int seconds);
   
  protected:
   void call_connect(const char *inetAddr, int port);
   void write_bytes(const void *buffer, int len);
   int sockFd;
+  std::string pending;
 };
 
 #endif
@@ -20,10 +20,15 @@ class MySslSocket: public MySocket {
   MySslSocket(const char *inetAddr, int port, bool debug_print_io=false);
 
   std::string read();
-  void write(std::string data);
+  void write(const std::string &data);
+  void writeGather(struct iovec *iov, int count);
   void close(void);
+  // the kernel cannot encrypt for us, so this reads and writes in chunks
+  void sendFile(const std::string &header, int fd, off_t offset,
+                size_t length);
   
  protected:
+  void ssl_write_bytes(const void *buffer, size_t len);
   SSL_CTX *ctx;
   SSL *ssl;
   bool debug_print_io;
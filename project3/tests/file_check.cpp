@@ -0,0 +1,600 @@
+// Checks for FileService: every request below is parsed the way the
+// server parses one, answered by FileService over a scratch directory and
+// judged by the headers it renders and the body it would send. Body
+// sources are also run through HttpUtils::writeSource into a socket pair.
+//
+//   $ make check
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "ContentCache.h"
+#include "FileService.h"
+#include "GzipCache.h"
+#include "HTTPRequest.h"
+#include "HTTPResponse.h"
+#include "HttpUtils.h"
+#include "MySocket.h"
+
+using namespace std;
+
+// what a client would make of a response
+struct Reply {
+  int status;
+  // names lowercased
+  map<string, string> headers;
+  string body;
+  // the body came from ContentCache
+  bool cached;
+
+  bool has(const string &name) const { return headers.count(name) > 0; }
+  string header(const string &name) const {
+    map<string, string>::const_iterator found = headers.find(name);
+    return found == headers.end() ? "" : found->second;
+  }
+};
+
+static string dir;
+static int checks = 0;
+static int failures = 0;
+
+static void expect(bool ok, const string &what) {
+  checks++;
+  if (!ok) {
+    failures++;
+    cout << "FAIL: " << what << endl;
+  }
+}
+
+static void writeFile(const string &name, const string &content) {
+  string path = dir + "/" + name;
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || write(fd, content.data(), content.size()) !=
+                    (ssize_t) content.size()) {
+    cerr << "could not write " << path << endl;
+    exit(1);
+  }
+  close(fd);
+}
+
+static string gunzip(const string &in) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  // 16 for the gzip wrapper
+  if (inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK) {
+    return "<inflateInit2>";
+  }
+  string out;
+  char buffer[4096];
+  stream.next_in = (Bytef *) in.data();
+  stream.avail_in = in.size();
+  int ret;
+  do {
+    stream.next_out = (Bytef *) buffer;
+    stream.avail_out = sizeof(buffer);
+    ret = inflate(&stream, Z_NO_FLUSH);
+    out.append(buffer, sizeof(buffer) - stream.avail_out);
+  } while (ret == Z_OK);
+  inflateEnd(&stream);
+  return ret == Z_STREAM_END ? out : "<not gzip>";
+}
+
+static string text(size_t size) {
+  string out;
+  for (int line = 0; out.size() < size; line++) {
+    out += "<p>line " + to_string(line) + " of some compressible text</p>\n";
+  }
+  return out.substr(0, size);
+}
+
+// 2023-11-14 22:13:20 GMT, so the dates below are fixed
+#define MTIME 1700000000
+#define MTIME_DATE "Tue, 14 Nov 2023 22:13:20 GMT"
+
+static void setMtime(const string &name) {
+  string path = dir + "/" + name;
+  struct timeval times[2] = {{MTIME, 0}, {MTIME, 0}};
+  if (utimes(path.c_str(), times) != 0) {
+    cerr << "could not touch " << path << endl;
+    exit(1);
+  }
+}
+
+// inotify is asynchronous, give it a second to catch up
+static bool eventually(function<bool()> condition) {
+  for (int tries = 0; tries < 100; tries++) {
+    if (condition()) {
+      return true;
+    }
+    usleep(10 * 1000);
+  }
+  return false;
+}
+
+static string lower(string value) {
+  for (size_t idx = 0; idx < value.size(); idx++) {
+    value[idx] = tolower((unsigned char) value[idx]);
+  }
+  return value;
+}
+
+// everything the response would put on the wire after its headers
+static string body(HTTPResponse &response) {
+  string out(response.getBodyData(), response.getBodyLength());
+  if (response.hasFileBody()) {
+    size_t length = response.getFileLength();
+    string file(length, '\0');
+    if (pread(response.getFileFd(), &file[0], length,
+              response.getFileOffset()) != (ssize_t) length) {
+      return "<short file>";
+    }
+    out += file;
+  }
+  if (response.getBodySource() != NULL) {
+    char buffer[4096];
+    ssize_t got;
+    while ((got = response.getBodySource()->read(buffer, sizeof(buffer))) > 0) {
+      out.append(buffer, got);
+    }
+    if (got < 0) {
+      return "<source failed>";
+    }
+  }
+  return out;
+}
+
+static Reply fetch(FileService &service, const string &method,
+                   const string &path,
+                   const vector<string> &headers = vector<string>()) {
+  string text = method + " " + path + " HTTP/1.1\r\nHost: localhost\r\n";
+  for (size_t idx = 0; idx < headers.size(); idx++) {
+    text += headers[idx] + "\r\n";
+  }
+  text += "\r\n";
+
+  HTTPRequest request(NULL, 0);
+  if (request.addData(text.data(), text.size()) < 0 || !request.isDone()) {
+    cerr << "could not parse " << text << endl;
+    exit(1);
+  }
+  HTTPResponse response;
+  if (method == "HEAD") {
+    service.head(&request, &response);
+  } else {
+    service.get(&request, &response);
+  }
+
+  Reply reply;
+  reply.status = response.getStatus();
+  string rendered;
+  response.renderHeaders(rendered);
+  size_t start = rendered.find("\r\n") + 2;
+  while (start < rendered.size()) {
+    size_t end = rendered.find("\r\n", start);
+    if (end == string::npos || end == start) {
+      break;
+    }
+    string line = rendered.substr(start, end - start);
+    size_t colon = line.find(": ");
+    reply.headers[lower(line.substr(0, colon))] = line.substr(colon + 2);
+    start = end + 2;
+  }
+  reply.body = body(response);
+  reply.cached = response.getSharedBody() != NULL;
+  return reply;
+}
+
+static void checkRanges() {
+  string content;
+  for (int idx = 0; idx < 100; idx++) {
+    content += "0123456789";
+  }
+  writeFile("data.bin", content);
+  FileService service(dir);
+
+  Reply reply = fetch(service, "GET", "/data.bin");
+  expect(reply.status == 200 && reply.body == content,
+         "whole file without Range");
+  expect(reply.header("accept-ranges") == "bytes", "Accept-Ranges: bytes");
+  expect(reply.header("content-length") == "1000", "Content-Length");
+
+  struct {
+    const char *range;
+    int status;
+    const char *contentRange;
+    size_t start;
+    size_t length;
+  } cases[] = {
+    {"bytes=0-9", 206, "bytes 0-9/1000", 0, 10},
+    {"bytes=990-", 206, "bytes 990-999/1000", 990, 10},
+    {"bytes=995-5000", 206, "bytes 995-999/1000", 995, 5},
+    {"bytes=-5", 206, "bytes 995-999/1000", 995, 5},
+    {"bytes=-5000", 206, "bytes 0-999/1000", 0, 1000},
+    {"bytes=-0", 416, "bytes */1000", 0, 0},
+    {"bytes=1000-", 416, "bytes */1000", 0, 0},
+    // ranges we may ignore, and do, sending the whole file
+    {"bytes=0-1,5-6", 200, "", 0, 1000},
+    {"bytes=5-2", 200, "", 0, 1000},
+    {"bytes=x-2", 200, "", 0, 1000},
+    {"items=0-1", 200, "", 0, 1000},
+  };
+  for (size_t idx = 0; idx < sizeof(cases) / sizeof(cases[0]); idx++) {
+    string what = string("Range: ") + cases[idx].range;
+    reply = fetch(service, "GET", "/data.bin",
+                  vector<string>(1, what));
+    expect(reply.status == cases[idx].status, what + " status");
+    expect(reply.header("content-range") == cases[idx].contentRange,
+           what + " Content-Range");
+    expect(reply.body == content.substr(cases[idx].start, cases[idx].length),
+           what + " body");
+    expect(reply.header("content-length") ==
+           to_string(cases[idx].length), what + " Content-Length");
+  }
+
+  // HEAD describes the whole file whatever the Range
+  reply = fetch(service, "HEAD", "/data.bin",
+                vector<string>(1, "Range: bytes=0-9"));
+  expect(reply.status == 200 && reply.body.empty() &&
+         reply.header("content-length") == "1000", "HEAD ignores Range");
+
+  expect(fetch(service, "GET", "/nope.bin").status == 404, "missing file");
+  expect(fetch(service, "GET", "/../etc/passwd").status == 403, "..");
+}
+
+static void checkCache() {
+  // its watch thread runs for good, like the server's
+  ContentCache &cache = *new ContentCache(dir, 16 * 1024 * 1024);
+  if (!cache.start()) {
+    cout << "no inotify, cache checks skipped" << endl;
+    return;
+  }
+  FileService service(dir, &cache);
+
+  writeFile("cached.html", "first");
+  Reply reply = fetch(service, "GET", "/cached.html");
+  expect(reply.status == 200 && reply.body == "first" && reply.cached,
+         "small file from the cache");
+  reply = fetch(service, "GET", "/cached.html",
+                vector<string>(1, "Range: bytes=0-1"));
+  expect(reply.status == 206 && reply.body == "fi" && !reply.cached,
+         "ranges bypass the cache");
+
+  writeFile("cached.html", "second");
+  expect(eventually([&]() {
+           return fetch(service, "GET", "/cached.html").body == "second";
+         }), "rewritten file invalidated");
+
+  // a 404 is remembered, and forgotten once the file shows up
+  string later = ContentCache::normalize(dir + "/later.html");
+  expect(fetch(service, "GET", "/later.html").status == 404,
+         "missing file 404");
+  shared_ptr<const CachedFile> entry = cache.lookup(later);
+  expect(entry && entry->missing, "negative entry");
+  expect(fetch(service, "HEAD", "/later.html").status == 404,
+         "negative entry answers HEAD");
+  writeFile("later.html", "here now");
+  expect(eventually([&]() {
+           Reply reply = fetch(service, "GET", "/later.html");
+           return reply.status == 200 && reply.body == "here now";
+         }), "created file replaces the negative entry");
+
+  string path = dir + "/cached.html";
+  unlink(path.c_str());
+  expect(eventually([&]() {
+           return fetch(service, "GET", "/cached.html").status == 404;
+         }), "removed file invalidated");
+
+  // past a quarter of a shard files go out with sendfile
+  writeFile("large.bin", string(cache.maxFileBytes() + 1, 'x'));
+  reply = fetch(service, "GET", "/large.bin");
+  expect(reply.status == 200 && !reply.cached &&
+         reply.body.size() == cache.maxFileBytes() + 1,
+         "large file bypasses the cache");
+}
+
+static void checkConditional(FileService &service, const string &name,
+                             const string &label) {
+  string content(600, 'c');
+  writeFile(name, content);
+  setMtime(name);
+  string path = "/" + name;
+
+  Reply reply = fetch(service, "GET", path);
+  string tag = reply.header("etag");
+  expect(reply.status == 200 && tag.size() > 2 && tag[0] == '"',
+         label + " ETag");
+  expect(reply.header("last-modified") == MTIME_DATE,
+         label + " Last-Modified");
+
+  struct {
+    const char *header;
+    int status;
+  } cases[] = {
+    {"If-None-Match: <tag>", 304},
+    {"If-None-Match: W/<tag>", 304},
+    {"If-None-Match: \"other\", <tag>", 304},
+    {"If-None-Match: *", 304},
+    {"If-None-Match: \"other\"", 200},
+    {"If-Modified-Since: " MTIME_DATE, 304},
+    {"If-Modified-Since: Wed, 15 Nov 2023 00:00:00 GMT", 304},
+    {"If-Modified-Since: Tue, 14 Nov 2023 22:13:19 GMT", 200},
+    {"If-Modified-Since: yesterday", 200},
+  };
+  for (size_t idx = 0; idx < sizeof(cases) / sizeof(cases[0]); idx++) {
+    string header = cases[idx].header;
+    size_t at = header.find("<tag>");
+    if (at != string::npos) {
+      header.replace(at, 5, tag);
+    }
+    for (int head = 0; head < 2; head++) {
+      string method = head ? "HEAD" : "GET";
+      string what = label + " " + method + " " + header;
+      reply = fetch(service, method, path, vector<string>(1, header));
+      expect(reply.status == cases[idx].status, what + " status");
+      if (cases[idx].status == 304) {
+        expect(reply.body.empty() && !reply.has("content-length") &&
+               reply.header("etag") == tag, what + " bodiless 304");
+      } else {
+        expect(reply.body == (head ? "" : content), what + " body");
+      }
+    }
+  }
+
+  // If-None-Match wins, If-Modified-Since only counts without it
+  vector<string> both;
+  both.push_back("If-None-Match: \"other\"");
+  both.push_back("If-Modified-Since: " MTIME_DATE);
+  expect(fetch(service, "GET", path, both).status == 200,
+         label + " If-None-Match overrides If-Modified-Since");
+
+  // HEAD has GET's headers and no body
+  Reply get = fetch(service, "GET", path);
+  Reply head = fetch(service, "HEAD", path);
+  get.body.clear();
+  expect(head.status == 200 && head.headers == get.headers &&
+         head.body.empty(), label + " HEAD matches GET");
+}
+
+// gzip says whether service has a gzip encoding to give
+static void checkGzip(FileService &service, bool gzip, const string &label) {
+  string content = text(4096);
+  string name = "/" + label + ".html";
+  writeFile(name.substr(1), content);
+
+  // before any GET has compressed it, HEAD has to say what GET will send
+  Reply head = fetch(service, "HEAD", name,
+                     vector<string>(1, "Accept-Encoding: gzip"));
+  Reply get = fetch(service, "GET", name,
+                    vector<string>(1, "Accept-Encoding: gzip"));
+  expect(head.header("content-encoding") == get.header("content-encoding") &&
+         head.header("etag") == get.header("etag"),
+         label + " HEAD before GET has GET's encoding");
+
+  struct {
+    const char *acceptEncoding;
+    bool gzip;
+  } cases[] = {
+    {"gzip", true},
+    {"gzip, deflate, br", true},
+    {"x-gzip", true},
+    {"GZIP;q=0.5", true},
+    {"*", true},
+    {"br;q=1, *;q=0.1", true},
+    {"gzip;q=0", false},
+    {"gzip;q=0, *", false},
+    {"*;q=0", false},
+    {"deflate, br", false},
+    {NULL, false},
+  };
+  for (size_t idx = 0; idx < sizeof(cases) / sizeof(cases[0]); idx++) {
+    vector<string> headers;
+    string what = label + " no Accept-Encoding";
+    if (cases[idx].acceptEncoding != NULL) {
+      headers.push_back(string("Accept-Encoding: ") +
+                        cases[idx].acceptEncoding);
+      what = label + " " + headers[0];
+    }
+    bool expected = gzip && cases[idx].gzip;
+
+    get = fetch(service, "GET", name, headers);
+    expect(get.status == 200 && get.header("vary") == "Accept-Encoding",
+           what + " Vary");
+    expect((get.header("content-encoding") == "gzip") == expected,
+           what + " Content-Encoding");
+    string tag = get.header("etag");
+    expect((tag.size() > 4 && tag.substr(tag.size() - 4) == "-gz\"") ==
+           expected, what + " ETag");
+    expect((expected ? gunzip(get.body) : get.body) == content,
+           what + " body");
+
+    head = fetch(service, "HEAD", name, headers);
+    expect(head.body.empty() &&
+           head.header("content-encoding") == get.header("content-encoding") &&
+           head.header("etag") == tag, what + " HEAD matches GET");
+  }
+
+  // ranges are of the file as it is
+  vector<string> ranged;
+  ranged.push_back("Accept-Encoding: gzip");
+  ranged.push_back("Range: bytes=0-9");
+  get = fetch(service, "GET", name, ranged);
+  expect(get.status == 206 && !get.has("content-encoding") &&
+         get.body == content.substr(0, 10), label + " Range is not gzipped");
+
+  // too small to be worth it, and so not negotiated at all
+  writeFile(label + "-tiny.html", "<p>tiny</p>");
+  get = fetch(service, "GET", "/" + label + "-tiny.html",
+              vector<string>(1, "Accept-Encoding: gzip"));
+  expect(!get.has("content-encoding") && !get.has("vary"),
+         label + " tiny file not negotiated");
+
+  // a .gz next to the file goes out as it is
+  string gz;
+  GzipCache::compress(content, gz);
+  writeFile(label + "-sibling.css", content);
+  writeFile(label + "-sibling.css.gz", gz);
+  get = fetch(service, "GET", "/" + label + "-sibling.css",
+              vector<string>(1, "Accept-Encoding: gzip"));
+  expect(get.header("content-encoding") == "gzip" && get.body == gz,
+         label + " .gz sibling");
+}
+
+// hands out its body in the pieces given, then ends or fails
+class PieceSource : public BodySource {
+ public:
+  PieceSource(vector<string> pieces, bool fail)
+      : m_pieces(pieces), m_next(0), m_fail(fail) {}
+
+  ssize_t read(char *buffer, size_t size) {
+    if (m_next == m_pieces.size()) {
+      return m_fail ? -1 : 0;
+    }
+    string &piece = m_pieces[m_next];
+    size_t count = min(size, piece.size());
+    memcpy(buffer, piece.data(), count);
+    piece.erase(0, count);
+    if (piece.empty()) {
+      m_next++;
+    }
+    return count;
+  }
+
+ private:
+  vector<string> m_pieces;
+  size_t m_next;
+  bool m_fail;
+};
+
+struct Written {
+  bool threw;
+  size_t sent;
+  string wire;
+};
+
+static Written writeSource(BodySource *source, bool chunked, ssize_t length) {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+    cerr << "socketpair: " << strerror(errno) << endl;
+    exit(1);
+  }
+  Written written = {false, 0, ""};
+  // small enough for the socket buffer, so nothing has to read meanwhile
+  MySocket *client = new MySocket(fds[0]);
+  try {
+    written.sent = HttpUtils::writeSource(client, source, chunked, length);
+  } catch (SocketWriteError &) {
+    written.threw = true;
+  }
+  delete client;
+  delete source;
+
+  char buffer[4096];
+  ssize_t got;
+  while ((got = read(fds[1], buffer, sizeof(buffer))) > 0) {
+    written.wire.append(buffer, got);
+  }
+  close(fds[1]);
+  return written;
+}
+
+static void checkSources() {
+  vector<string> pieces;
+  pieces.push_back("hello");
+  pieces.push_back(" world");
+
+  Written written = writeSource(new PieceSource(pieces, false), true, -1);
+  expect(!written.threw && written.sent == 11 &&
+         written.wire == "5\r\nhello\r\n6\r\n world\r\n0\r\n\r\n",
+         "chunked source");
+  written = writeSource(new PieceSource(pieces, false), false, 11);
+  expect(!written.threw && written.wire == "hello world",
+         "source with a Content-Length");
+  written = writeSource(new PieceSource(pieces, false), false, 7);
+  expect(!written.threw && written.wire == "hello w",
+         "source stops at its Content-Length");
+  written = writeSource(new PieceSource(pieces, false), false, 20);
+  expect(written.threw && written.wire == "hello world",
+         "source shorter than its Content-Length");
+  written = writeSource(new PieceSource(pieces, true), true, -1);
+  expect(written.threw && written.wire.find("0\r\n\r\n") == string::npos,
+         "failing source has no last chunk");
+
+  // files too large for GzipCache to keep are compressed on the way out,
+  // a quarter of 64 KiB holds files of up to 256 KiB
+  string content = text(512 * 1024);
+  writeFile("streamed.html", content);
+  FileService service(dir, NULL, new GzipCache(64 * 1024));
+  Reply get = fetch(service, "GET", "/streamed.html",
+                    vector<string>(1, "Accept-Encoding: gzip"));
+  expect(get.header("transfer-encoding") == "chunked" &&
+         !get.has("content-length") &&
+         get.header("content-encoding") == "gzip" &&
+         gunzip(get.body) == content, "GzipSource body");
+  Reply head = fetch(service, "HEAD", "/streamed.html",
+                     vector<string>(1, "Accept-Encoding: gzip"));
+  expect(head.header("transfer-encoding") == "chunked" &&
+         !head.has("content-length") && head.body.empty() &&
+         head.header("etag") == get.header("etag"),
+         "HEAD for a streamed body");
+
+  // what the server does for HTTP/1.0, which has no chunks
+  HTTPResponse response;
+  response.setBodySource(new PieceSource(pieces, false));
+  response.endWithConnection();
+  string rendered;
+  response.renderHeaders(rendered);
+  expect(!response.isChunked() &&
+         rendered.find("Transfer-Encoding") == string::npos &&
+         rendered.find("Content-Length") == string::npos,
+         "close-delimited body has no length");
+}
+
+int main() {
+  char scratch[] = "/tmp/file_check.XXXXXX";
+  if (mkdtemp(scratch) == NULL) {
+    cerr << "mkdtemp: " << strerror(errno) << endl;
+    return 1;
+  }
+  dir = scratch;
+
+  checkRanges();
+  checkCache();
+  FileService plain(dir);
+  checkConditional(plain, "plain.bin", "disk");
+  ContentCache *cache = new ContentCache(dir, 16 * 1024 * 1024);
+  bool watching = cache->start();
+  if (watching) {
+    FileService cached(dir, cache);
+    checkConditional(cached, "cached.bin", "cache");
+  }
+
+  checkGzip(plain, false, "disk");
+  FileService compressing(dir, NULL, new GzipCache(1024 * 1024));
+  checkGzip(compressing, true, "gzipcache");
+  if (watching) {
+    FileService cached(dir, cache);
+    checkGzip(cached, true, "cache");
+  }
+  checkSources();
+
+  string command = "rm -rf " + dir;
+  if (system(command.c_str()) != 0) {
+    cerr << "could not remove " << dir << endl;
+  }
+  cout << checks << " checks, " << failures << " failures" << endl;
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,298 @@
+// Conformance check for FastRequestParser: every request below is parsed
+// by HTTP with http_parser alone and again with the fast engine, under
+// every instruction set the CPU has, and fed to them whole, a byte at a
+// time, split in two at every point and in random pieces, on its own and
+// with another request pipelined after it. Both must agree on every
+// field, on where the request ends and on whether it is an error. A head
+// near the size limit is also fed in small pieces, as a slow client sends
+// it, and must parse without the memory it takes growing out of bounds.
+//
+//   $ make check
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "FastRequestParser.h"
+#include "HTTP.h"
+
+using namespace std;
+
+// a request that does not parse, or what was made of one that does
+struct Outcome {
+  bool error;
+  size_t consumed;
+  string fields;
+};
+
+static const char *requests[] = {
+  // what clients send
+  "GET /hello_world.html HTTP/1.1\r\nHost: localhost:8080\r\n"
+  "User-Agent: curl/7.88.1\r\nAccept: */*\r\n\r\n",
+
+  "GET /static/css/bootstrap.min.css?v=5.3.2 HTTP/1.1\r\n"
+  "Host: localhost:8080\r\nConnection: keep-alive\r\n"
+  "sec-ch-ua: \"Chromium\";v=\"120\", \"Not?A_Brand\";v=\"24\"\r\n"
+  "sec-ch-ua-mobile: ?0\r\n"
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+  "(KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+  "sec-ch-ua-platform: \"Linux\"\r\nAccept: text/css,*/*;q=0.1\r\n"
+  "Sec-Fetch-Site: same-origin\r\nSec-Fetch-Mode: no-cors\r\n"
+  "Sec-Fetch-Dest: style\r\nReferer: http://localhost:8080/bootstrap.html\r\n"
+  "Accept-Encoding: gzip, deflate, br\r\n"
+  "Accept-Language: en-US,en;q=0.9\r\n"
+  "If-None-Match: \"ce806a-18df9dbfaf3d589e-235ed\"\r\n"
+  "If-Modified-Since: Sun, 18 Oct 2026 11:57:19 GMT\r\n\r\n",
+
+  "GET / HTTP/1.1\r\nHost: example.com\r\n"
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:121.0) Gecko/20100101 "
+  "Firefox/121.0\r\nAccept: text/html,application/xhtml+xml,"
+  "application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+  "Accept-Language: en-US,en;q=0.5\r\nAccept-Encoding: gzip, deflate, br\r\n"
+  "DNT: 1\r\nConnection: keep-alive\r\nUpgrade-Insecure-Requests: 1\r\n"
+  "Cookie: session=0123456789abcdef0123456789abcdef; theme=dark\r\n\r\n",
+
+  "HEAD /index.html HTTP/1.1\r\nHost: x\r\n\r\n",
+  "DELETE /accounts/42 HTTP/1.1\r\nHost: x\r\nx-auth-token: abc123\r\n\r\n",
+  "POST /auth-tokens HTTP/1.1\r\nHost: x\r\n"
+  "Content-Type: application/x-www-form-urlencoded\r\n"
+  "Content-Length: 26\r\n\r\nusername=sam&password=1234",
+  "PUT /accounts/42 HTTP/1.1\r\nHost: x\r\nContent-Length: 16\r\n\r\n"
+  "{\"balance\": 100}",
+  "POST /empty HTTP/1.1\r\nHost: x\r\nContent-Length: 0\r\n\r\n",
+
+  // versions and keep-alive
+  "GET / HTTP/1.0\r\n\r\n",
+  "GET / HTTP/1.0\r\nConnection: keep-alive\r\n\r\n",
+  "GET / HTTP/1.0\r\nconnection: KEEP-ALIVE  \r\n\r\n",
+  "GET / HTTP/1.1\r\nConnection: close\r\n\r\n",
+  "GET / HTTP/1.1\r\nProxy-Connection: close\r\n\r\n",
+  "GET / HTTP/1.1\r\nConnection: keep-alive, Upgrade\r\n\r\n",
+  "GET / HTTP/2.0\r\nHost: x\r\n\r\n",
+  "GET / HTTP/1.12\r\nHost: x\r\n\r\n",
+
+  // URLs
+  "GET /a/b/c.html?x=1&y=2 HTTP/1.1\r\n\r\n",
+  "GET /search??q=1 HTTP/1.1\r\n\r\n",
+  "GET /a?b?c HTTP/1.1\r\n\r\n",
+  "GET /? HTTP/1.1\r\n\r\n",
+  "GET /%7Euser/%20x;p=1 HTTP/1.1\r\n\r\n",
+  "GET /a/very/long/path/that/goes/past/one/vector/register/and/then/some"
+  "/more/index.html?and=a&query=string&that=is&long=too HTTP/1.1\r\n\r\n",
+  "GET http://example.com/index.html HTTP/1.1\r\nHost: example.com\r\n\r\n",
+  "GET http://example.com:8080 HTTP/1.1\r\n\r\n",
+
+  // header layout
+  "GET / HTTP/1.1\r\nhost: lower\r\nHOST: upper\r\n\r\n",
+  "GET / HTTP/1.1\r\nX-Empty:\r\nX-Spaces:    \r\nX-Tab:\tvalue\r\n\r\n",
+  "GET / HTTP/1.1\r\nX-Trailing: value   \r\n\r\n",
+  "GET / HTTP/1.1\r\nX-Colon: a:b:c\r\n\r\n",
+  "GET / HTTP/1.1\r\nX-High: caf\xc3\xa9\r\n\r\n",
+  "GET / HTTP/1.1\r\nX-Control: a\x01z\r\n\r\n",
+  "GET / HTTP/1.1\nHost: x\nAccept: */*\n\n",
+  "GET / HTTP/1.1\r\nHost: x\n\r\n",
+  "\r\n\r\nGET /after-blank-lines HTTP/1.1\r\nHost: x\r\n\r\n",
+  "GET / HTTP/1.1\r\nBad Header: x\r\n\r\n",
+  "GET / HTTP/1.1\r\nNoColon\r\nHost: x\r\n\r\n",
+  "GET / HTTP/1.1\r\nHost: x\r\nContent-Length: 5 \r\n\r\nhello",
+  "GET / HTTP/1.1\r\nContent-Length: 2\r\nContent-Length: 3\r\n\r\nabc",
+  "POST /chunked HTTP/1.1\r\nHost: x\r\nTransfer-Encoding: chunked\r\n\r\n"
+  "5\r\nhello\r\n6\r\n world\r\n0\r\n\r\n",
+  "GET /chat HTTP/1.1\r\nHost: x\r\nUpgrade: websocket\r\n"
+  "Connection: Upgrade\r\n\r\n",
+
+  // not requests
+  "get / HTTP/1.1\r\n\r\n",
+  "GET / HTTX/1.1\r\n\r\n",
+  "GET / HTTP/x.1\r\n\r\n",
+  "GET  /two-spaces HTTP/1.1\r\n\r\n",
+  "GET / HTTP/1.1\r\nContent-Length: abc\r\n\r\n",
+  "GET / HTTP/1.1\r\nHost: x\rY: z\r\n\r\n",
+  "\x16\x03\x01\x02\x00\x01\x00\x01\xfc\x03\x03",
+};
+
+static string describe(HTTP &http) {
+  stringstream out;
+  out << "done=" << http.isDone() << " headerDone=" << http.isHeaderDone();
+  if (http.isHeaderDone()) {
+    out << " url=" << http.getUrl() << " path=" << http.getPath()
+        << " query=" << http.getQuery() << " http11=" << http.isHttp11();
+    for (size_t idx = 0; idx < http.getHeaderCount(); idx++) {
+      const HttpHeader &header = http.getHeader(idx);
+      out << " [" << header.name << "|" << header.value << "]";
+    }
+  }
+  if (http.isDone()) {
+    out << " method=" << http.getMethod() << " keepAlive="
+        << http.shouldKeepAlive() << " body=" << http.getBody();
+  }
+  return out.str();
+}
+
+// feeds input in pieces of the given sizes, the rest in one go after them
+static Outcome run(HTTP::Engine engine, const string &input,
+                   const vector<size_t> &pieces) {
+  HTTP::setEngine(engine);
+  HTTP http;
+  Outcome outcome = {false, 0, ""};
+  size_t offset = 0;
+  size_t piece = 0;
+  while (offset < input.size() && !http.isDone()) {
+    size_t len = input.size() - offset;
+    if (piece < pieces.size() && pieces[piece] < len) {
+      len = pieces[piece];
+    }
+    piece++;
+    int ret = http.addData((const unsigned char *) input.data() + offset, len);
+    if (!http.isDone() && ret < (int) len) {
+      outcome.error = true;
+      break;
+    }
+    offset += ret;
+  }
+  outcome.consumed = offset;
+  outcome.fields = describe(http);
+  return outcome;
+}
+
+static bool same(const Outcome &a, const Outcome &b) {
+  if (a.error != b.error) {
+    return false;
+  }
+  // after an error only the error matters
+  return a.error || (a.consumed == b.consumed && a.fields == b.fields);
+}
+
+static string printable(const string &input) {
+  string out;
+  for (size_t idx = 0; idx < input.size(); idx++) {
+    char c = input[idx];
+    if (c == '\r') {
+      out += "\\r";
+    } else if (c == '\n') {
+      out += "\\n";
+    } else if ((unsigned char) c < ' ' || (unsigned char) c >= 0x7f) {
+      char hex[8];
+      snprintf(hex, sizeof(hex), "\\x%02x", (unsigned char) c);
+      out += hex;
+    } else {
+      out += c;
+    }
+  }
+  return out;
+}
+
+// peak resident memory so far, in kB
+static long peakKb() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+// a head of about 78 kB, just under HTTP_MAX_HEADER_SIZE, fed a piece at a
+// time; the arena must grow the strings it is gathering geometrically, or
+// each piece copies all of them again
+static int checkLongHead() {
+  string head = "GET /" + string(20000, 'p') + " HTTP/1.1\r\n";
+  head += "Host: x\r\nCookie: " + string(30000, 'c') + "\r\n";
+  for (int idx = 0; head.size() < 78 * 1024; idx++) {
+    head += "X-Header-" + to_string(idx) + ": some value\r\n";
+  }
+  head += "\r\n";
+
+  HTTP::Engine engines[] = {HTTP::HTTP_PARSER, HTTP::FAST};
+  const char *names[] = {"http_parser", "fast"};
+  size_t sizes[] = {1, 16};
+  int failures = 0;
+  for (size_t engine = 0; engine < 2; engine++) {
+    for (size_t size = 0; size < 2; size++) {
+      long before = peakKb();
+      Outcome outcome = run(engines[engine], head,
+                            vector<size_t>(head.size(), sizes[size]));
+      long grown = peakKb() - before;
+      if (outcome.error || outcome.consumed != head.size()) {
+        failures++;
+        cout << names[engine] << ": long head in " << sizes[size]
+             << "-byte pieces did not parse" << endl;
+      }
+      // the head and a few copies of it are a few hundred kB
+      if (grown > 4096) {
+        failures++;
+        cout << names[engine] << ": long head in " << sizes[size]
+             << "-byte pieces took " << grown << " kB" << endl;
+      }
+    }
+  }
+  cout << "long head: " << head.size() << " bytes checked" << endl;
+  return failures;
+}
+
+int main() {
+  srandom(150);
+  // first, while the peak is still low enough to see it move
+  int failures = checkLongHead();
+  const string next = "GET /next HTTP/1.1\r\nHost: x\r\n\r\n";
+  FastRequestParser::Isa isas[] = {FastRequestParser::SCALAR,
+                                   FastRequestParser::SSE42,
+                                   FastRequestParser::AVX2};
+  size_t count = sizeof(requests) / sizeof(requests[0]);
+  long feeds = 0;
+
+  for (size_t isa = 0; isa < sizeof(isas) / sizeof(isas[0]); isa++) {
+    if (!FastRequestParser::setIsa(isas[isa])) {
+      cout << FastRequestParser::isaName(isas[isa]) << ": not on this CPU"
+           << endl;
+      continue;
+    }
+    for (size_t idx = 0; idx < count; idx++) {
+      for (int pipelined = 0; pipelined < 2; pipelined++) {
+        string input = requests[idx];
+        if (pipelined) {
+          input += next;
+        }
+
+        vector<vector<size_t> > splits;
+        splits.push_back(vector<size_t>());
+        splits.push_back(vector<size_t>(input.size(), 1));
+        for (size_t at = 1; at < input.size(); at++) {
+          splits.push_back(vector<size_t>(1, at));
+        }
+        for (int round = 0; round < 20; round++) {
+          vector<size_t> pieces;
+          for (size_t total = 0; total < input.size();) {
+            pieces.push_back(1 + random() % 24);
+            total += pieces.back();
+          }
+          splits.push_back(pieces);
+        }
+
+        for (size_t split = 0; split < splits.size(); split++) {
+          Outcome expected = run(HTTP::HTTP_PARSER, input, splits[split]);
+          Outcome got = run(HTTP::FAST, input, splits[split]);
+          feeds++;
+          if (!same(expected, got)) {
+            failures++;
+            cout << FastRequestParser::isaName(isas[isa]) << " mismatch on \""
+                 << printable(input) << "\" in " << splits[split].size()
+                 << " pieces" << endl
+                 << "  http_parser: error=" << expected.error << " consumed="
+                 << expected.consumed << " " << expected.fields << endl
+                 << "  fast:        error=" << got.error << " consumed="
+                 << got.consumed << " " << got.fields << endl;
+            break;
+          }
+        }
+      }
+    }
+    cout << FastRequestParser::isaName(isas[isa]) << ": " << count
+         << " requests checked" << endl;
+  }
+
+  cout << feeds << " feeds, " << failures << " mismatches" << endl;
+  return failures == 0 ? 0 : 1;
+}
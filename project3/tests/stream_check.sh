@@ -0,0 +1,56 @@
+#!/usr/bin/env bash
+
+# Runs gunrock_web in every mode with a file too large for -g to keep, so
+# it is gzipped while it is sent, and checks that HTTP/1.1 gets it chunked
+# and HTTP/1.0, which has no chunks, gets it ending with the connection.
+#
+#   $ make check
+
+PORT=${PORT:-8099}
+DIR=$(mktemp -d /tmp/stream_check.XXXXXX)
+trap 'rm -rf $DIR' EXIT
+
+# about 5 MB of text, -g 1 only keeps files of up to 4 MiB compressed
+for line in $(seq 1 120000); do
+  echo "<p>line $line of some compressible text</p>"
+done | head -c 5000000 > $DIR/big.html
+gzip -c < $DIR/big.html > $DIR/expected.gz
+
+failures=0
+
+fail() {
+  echo "FAIL: $1"
+  failures=$((failures + 1))
+}
+
+for mode in "-m 0" "-m 1 -t 2" "-m 2 -t 2" "-m 2 -t 0"; do
+  ./gunrock_web -d $DIR -p $PORT $mode -g 1 -C 0 -o /dev/null > /dev/null &
+  PID=$!
+  sleep 0.5
+
+  headers=$(curl -s --http1.1 -H "Accept-Encoding: gzip" -D - \
+    -o $DIR/http11.gz http://localhost:$PORT/big.html | tr -d '\r')
+  echo "$headers" | grep -qi "^Transfer-Encoding: chunked" ||
+    fail "$mode: HTTP/1.1 is not chunked"
+  gunzip -c < $DIR/http11.gz | cmp -s - $DIR/big.html ||
+    fail "$mode: HTTP/1.1 body"
+
+  headers=$(curl -s --http1.0 -H "Accept-Encoding: gzip" -D - \
+    -o $DIR/http10.gz http://localhost:$PORT/big.html | tr -d '\r')
+  echo "$headers" | grep -qi "^Transfer-Encoding" &&
+    fail "$mode: HTTP/1.0 got chunks"
+  echo "$headers" | grep -qi "^Content-Length" &&
+    fail "$mode: HTTP/1.0 got a Content-Length"
+  echo "$headers" | grep -qi "^Connection: close" ||
+    fail "$mode: HTTP/1.0 connection not closed"
+  gunzip -c < $DIR/http10.gz | cmp -s - $DIR/big.html ||
+    fail "$mode: HTTP/1.0 body"
+
+  kill $PID
+  wait $PID 2> /dev/null
+done
+
+if [ $failures -eq 0 ]; then
+  echo "stream checks passed"
+fi
+exit $failures
@@ -0,0 +1,90 @@
+// Turns a binary dthread log (make TRACE=BINARY, the default) back into
+// the text log the autograder reads, one line per event in time order:
+//
+//   $ ./gunrock_web -l trace.bin
+//   $ ./dtrace_decode trace.bin > trace.log
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "dtrace.h"
+
+using namespace std;
+
+struct Line {
+  uint64_t timestamp;
+  string text;
+};
+
+static bool earlier(const Line &a, const Line &b) {
+  return a.timestamp < b.timestamp;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    cerr << "usage: " << argv[0] << " log_file" << endl;
+    exit(1);
+  }
+
+  ifstream file(argv[1], ios::binary);
+  if (!file) {
+    cerr << "Could not open log file: " << argv[1] << endl;
+    exit(1);
+  }
+  string data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+  if (data.compare(0, DTRACE_MAGIC_LEN, DTRACE_MAGIC) != 0) {
+    cerr << argv[1] << " is not a binary dthread log" << endl;
+    exit(1);
+  }
+
+  vector<Line> lines;
+  size_t offset = DTRACE_MAGIC_LEN;
+  // a server killed mid-write can leave a partial record at the end
+  while (offset + sizeof(DtraceRecord) <= data.length()) {
+    DtraceRecord record;
+    memcpy(&record, data.data() + offset, sizeof(record));
+    offset += sizeof(record);
+
+    string function, payload;
+    if (record.event == DTRACE_TEXT) {
+      size_t textLength = record.length;
+      size_t padded = (textLength + sizeof(record) - 1) / sizeof(record)
+                      * sizeof(record);
+      if (offset + padded > data.length()) {
+        break;
+      }
+      function = data.substr(offset, record.object[0]);
+      payload = data.substr(offset + record.object[0],
+                            textLength - record.object[0]);
+      offset += padded;
+    } else if (record.event < DTRACE_NUM_EVENTS) {
+      function = DTRACE_NAMES[record.event];
+      payload = dtrace_payload(record.event, (void *) record.object[0],
+                               (void *) record.object[1]);
+    } else {
+      cerr << "unknown event " << record.event << " at offset "
+           << offset - sizeof(record) << endl;
+      exit(1);
+    }
+
+    Line line;
+    line.timestamp = record.timestamp;
+    line.text = function + " thread: " + to_string(record.tid) + " " + payload;
+    lines.push_back(line);
+  }
+
+  // each thread's events are already in order, a stable sort keeps them
+  // that way when two threads share a timestamp
+  stable_sort(lines.begin(), lines.end(), earlier);
+  for (size_t idx = 0; idx < lines.size(); idx++) {
+    cout << lines[idx].text << "\n";
+  }
+  return 0;
+}